@@ -0,0 +1,68 @@
+#ifndef __KCPAPPPOOL_H__
+#define __KCPAPPPOOL_H__
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "ikcp.h"
+#include "kcpqueue.h"
+
+struct KCPAppMessage
+{
+    int conv;
+    IKCPBUF* buf; //one whole package, NULL when the session was kicked
+};
+
+//runs on an app thread and owns the buf reference
+typedef void(*app_message_func)(int conv, IKCPBUF* buf, void* user);
+
+//application threads fed by the network loops. every loop owns one single
+//producer ring per app thread and a conv always goes to thread conv % threads,
+//so its messages keep their order. a full ring never blocks the loop, the
+//rest waits in a backlog on the loop side until the ring has room
+class KCPAppPool
+{
+public:
+    static const int BATCH_SIZE = 64; //messages taken from one ring before the next
+public:
+    KCPAppPool();
+    ~KCPAppPool();
+
+    bool Start(int threads, int loops, int queue_size, app_message_func handler, void* user);
+    void Stop(); //handles everything queued, then joins the threads
+    //loop side, returns false if the message went to the backlog
+    bool Push(int loop, int conv, IKCPBUF* buf);
+    void Flush(int loop); //moves the backlog on and wakes the threads that got work
+    bool HasBacklog(int loop) const;
+    int GetThreads() const;
+private:
+    struct Ring
+    {
+        KCPSPSCQueue<KCPAppMessage> queue;
+        std::vector<KCPAppMessage> backlog; //in order behind the queue
+        bool pushed; //since the last Flush
+    };
+
+    struct Worker
+    {
+        std::thread thread;
+        int event_fd;
+        std::atomic<bool> idle; //about to block on event_fd, wants a write
+    };
+
+    Ring* GetRing(int loop, int thread) const;
+    bool MoveBacklog(Ring* ring);
+    bool IsIdle(int thread) const;
+    void WorkerMain(int thread);
+
+    int threads_;
+    int loops_;
+    app_message_func handler_;
+    void* user_;
+    std::vector<Ring*> rings_; //loop * threads_ + thread
+    std::vector<Worker*> workers_;
+    std::atomic<bool> stopping_;
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef __KCPCOMPRESS_H__
+#define __KCPCOMPRESS_H__
+
+#include "ikcp.h"
+
+//set in the 4 byte package length of a compressed package, the length
+//then counts the packed bytes: length(4) original length(4) lz4 block
+const IUINT32 KCP_PACKAGE_COMPRESSED = 0x40000000;
+const int KCP_PACKAGE_PACKED_HEAD = 8;
+const int KCP_LZ_MAX_INPUT = 64 * 1024;
+
+//lz4 block format, greedy single probe matcher, so a client can unpack
+//with any lz4 library (LZ4_decompress_safe)
+class KCPCompressor
+{
+public:
+    //returns the block size, -1 if it does not fit in capacity
+    static int Compress(const char* src, int len, char* dst, int capacity);
+    //returns the bytes written, -1 on a corrupt block or too small dst
+    static int Decompress(const char* src, int len, char* dst, int capacity);
+
+    //package starts with its own big endian length. -1 when it is not a
+    //package or the packed one would not fit in capacity, which is how a
+    //caller asks for a minimum saving
+    static int Pack(const char* package, int len, char* dst, int capacity);
+    //the original package, length head included
+    static int Unpack(const char* packed, int len, char* dst, int capacity);
+    static bool IsPacked(const char* package, int len);
+};
+
+#endif
@@ -0,0 +1,119 @@
+#ifndef __KCPFEC_H__
+#define __KCPFEC_H__
+
+#include <vector>
+
+#include "ikcp.h"
+
+//fec head in front of every datagram of a group, conv stays first so
+//conv steering and the session table still find the owner:
+//conv(4) flag(1) index(1) data shards(1) parity shards(1) group(4)
+const int KCP_FEC_HEAD_LENGTH = 12;
+const IUINT8 KCP_FEC_DATA = 0xF1; //a kcp datagram as sent, shard counts still 0
+const IUINT8 KCP_FEC_PARITY = 0xF2; //parity over the group, counts filled in
+const int KCP_FEC_MAX_SHARDS = 64; //data plus parity of one group
+const int KCP_FEC_MAX_DATAGRAM = 1500;
+
+enum KCPGFKernel
+{
+    KCP_GF_SCALAR, //256 byte product table per coefficient
+    KCP_GF_SSSE3, //pshufb over two 16 entry nibble tables, 16 bytes a step
+    KCP_GF_AVX2, //the same, 32 bytes a step
+};
+
+//Reed-Solomon over GF(2^8), systematic with Cauchy parity rows, so any
+//data_shards of the data_shards + parity_shards shards rebuild the data.
+//the kernel is picked from the cpu on first use
+class KCPReedSolomon
+{
+public:
+    //parity[i] = sum of coefficient(i, j) * data[j], all shards len bytes
+    static bool Encode(const char* const* data, int data_shards, char* const* parity,
+        int parity_shards, int len);
+    //shards holds data then parity, rebuilds the data shards not present
+    static bool Reconstruct(char* const* shards, const bool* present, int data_shards,
+        int parity_shards, int len);
+    static void MulAdd(char* dst, const char* src, IUINT8 c, int len); //dst ^= c * src
+    static int GetKernel();
+    static int SetKernel(int kernel); //downgrade only, for benchmarks. returns the one in use
+    static const char* GetKernelName(int kernel);
+};
+
+typedef void(*fec_output_func)(const char* buf, int len, void* user);
+
+//datagrams go out at once behind a fec head, the parity follows when the
+//group is full or Flush() closes it short. a short group gets parity in
+//the same ratio, rounded up, unless it is too short to earn one whole
+//parity shard: a lone ack datagram goes without
+class KCPFecEncoder
+{
+public:
+    KCPFecEncoder(IUINT32 conv, int data_shards, int parity_shards, fec_output_func output,
+        void* user);
+
+    void Encode(const char* buf, int len);
+    void Flush();
+    int GetDataShards() const;
+    int GetParityShards() const;
+private:
+    void Emit(IUINT8 flag, int index, int count, int parity, const char* buf, int len);
+    void NextGroup();
+
+    IUINT32 conv_;
+    int data_shards_;
+    int parity_shards_;
+    fec_output_func output_;
+    void* user_;
+    IUINT32 group_;
+    int count_;
+    int shard_size_;
+    std::vector<std::vector<char> > shards_; //2 byte length, datagram, zero padding
+    std::vector<char> parity_;
+    std::vector<char> packet_;
+};
+
+//passes data datagrams straight on and keeps them with the parity of the
+//last WINDOW groups, a group missing some data is rebuilt as soon as
+//enough of its shards arrived. groups larger than the shard counts are
+//refused and datagrams over max_datagram are not kept, which bounds the
+//memory held to WINDOW * (data_shards + parity_shards) * max_datagram
+class KCPFecDecoder
+{
+public:
+    static const int WINDOW = 16;
+public:
+    KCPFecDecoder(IUINT32 conv, int data_shards, int parity_shards, int max_datagram,
+        fec_output_func output, void* user);
+
+    static bool IsFec(const char* data, int len);
+    static bool IsFecData(const char* data, int len); //a kcp datagram behind the head
+    bool Input(const char* data, int len); //false if not a valid fec datagram
+    IUINT64 GetRecovered() const; //datagrams rebuilt from parity so far
+private:
+    struct Group
+    {
+        IUINT32 id;
+        bool used;
+        bool done;
+        int data_shards; //0 until a parity shard tells
+        int parity_shards;
+        int shard_size;
+        int received;
+        bool present[KCP_FEC_MAX_SHARDS];
+        std::vector<char> shards[KCP_FEC_MAX_SHARDS];
+    };
+
+    Group* GetGroup(IUINT32 id);
+    void TryRecover(Group* group);
+
+    IUINT32 conv_;
+    int data_shards_;
+    int parity_shards_;
+    int max_datagram_;
+    fec_output_func output_;
+    void* user_;
+    IUINT64 recovered_;
+    Group groups_[WINDOW];
+};
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef __KCPIOBACKEND_H__
+#define __KCPIOBACKEND_H__
+
+#include <sys/socket.h>
+#include <netinet/udp.h>
+#include <vector>
+
+#include "kcpoutputqueue.h"
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+const int KCP_RECV_SLOT_SIZE = 1500; //one ethernet mtu per datagram
+const int KCP_GRO_SLOT_SIZE = 64 * 1024; //one coalesced UDP_GRO read
+const size_t KCP_GRO_CONTROL_SIZE = CMSG_SPACE(sizeof(int)); //room for the UDP_GRO cmsg
+
+enum KCPIOBackendType
+{
+    KCP_IO_SYSCALL, //recvmmsg / sendmmsg
+    KCP_IO_URING, //io_uring, falls back to KCP_IO_SYSCALL when unsupported
+};
+
+class KCPServer;
+
+//receive buffers of a backend, one datagram or gro batch per slot
+class KCPRecvSlots
+{
+public:
+    KCPRecvSlots();
+
+    void Init(int count, int slot_size);
+    void Prepare(int index, msghdr* hdr); //point hdr at the slot, ready for recvmsg
+    int GetSize() const;
+    int GetSlotSize() const;
+    char* GetData(int index);
+
+private:
+    int slot_size_;
+    std::vector<char> buf_;
+    std::vector<sockaddr_in> addrs_;
+    std::vector<iovec> iovs_;
+    std::vector<char> controls_;
+};
+
+//moves datagrams between the udp socket and a KCPServer
+class KCPIOBackend
+{
+public:
+    KCPIOBackend(KCPServer* server);
+    virtual ~KCPIOBackend();
+
+    //io_uring falls back to the syscall backend when the kernel lacks it
+    static KCPIOBackend* Create(KCPServer* server, int type, int fd, 
+        int recv_batch_size, int recv_slot_size, int send_batch_size);
+
+    virtual bool Init(int fd) = 0;
+    virtual int GetPollFd() const = 0; //readable when Read() has work
+    virtual void Read() = 0;
+    virtual void Flush(KCPOutputQueue* queue) = 0; //sent datagrams leave the queue
+    virtual bool HasPending() const; //datagrams taken from the queue but not sent yet
+    virtual const char* GetName() const = 0;
+
+protected:
+    void OnReceived(const msghdr& hdr, const char* data, int len, int capacity);
+    void OnRecvBatch(int count);
+    void OnSendCall();
+    void OnSent(const KCPOutputQueue* queue, int index);
+    void OnSendAgain();
+    void OnSendDropped();
+    bool OnSegmentError(KCPOutputQueue* queue, int index, int error);
+    void DoErrorLog(const char *fmt, ...);
+
+    KCPServer* server_;
+    int fd_;
+};
+
+class KCPSyscallBackend : public KCPIOBackend
+{
+public:
+    KCPSyscallBackend(KCPServer* server, int recv_batch_size, int recv_slot_size);
+    virtual ~KCPSyscallBackend();
+
+    virtual bool Init(int fd);
+    virtual int GetPollFd() const;
+    virtual void Read();
+    virtual void Flush(KCPOutputQueue* queue);
+    virtual const char* GetName() const;
+
+private:
+    int batch_size_;
+    int slot_size_;
+    KCPRecvSlots recv_slots_;
+    std::vector<mmsghdr> recv_msgs_;
+};
+
+struct KCPUring;
+struct io_uring_buf;
+
+class KCPUringBackend : public KCPIOBackend
+{
+public:
+    KCPUringBackend(KCPServer* server, int recv_entries, int recv_slot_size, 
+        int send_entries);
+    virtual ~KCPUringBackend();
+
+    virtual bool Init(int fd);
+    virtual int GetPollFd() const;
+    virtual void Read();
+    virtual void Flush(KCPOutputQueue* queue);
+    virtual bool HasPending() const;
+    virtual const char* GetName() const;
+
+private:
+    bool InitBufRing();
+    bool ArmRecv();
+    char* GetRecvBuf(int bid);
+    void RecycleRecvBuf(int bid);
+    void SubmitSends();
+    void ReapSends(KCPOutputQueue* queue);
+
+    int recv_entries_;
+    int slot_size_;
+    int send_entries_;
+    KCPUring* recv_ring_; //one multishot recvmsg over the provided buffers
+    KCPUring* send_ring_; //one sendmsg per datagram of the batch in flight
+    io_uring_buf* buf_ring_; //buffers the kernel picks a datagram's buffer from
+    size_t buf_ring_size_;
+    int buf_count_;
+    int buf_size_; //recvmsg_out head, address, control and slot_size_ payload
+    unsigned short buf_tail_;
+    bool recv_armed_;
+    std::vector<char> recv_bufs_;
+    msghdr recv_hdr_; //tells the kernel how much name and control room a buffer keeps
+    KCPOutputQueue inflight_; //the batch the send ring still points into
+    int send_outstanding_; //sendmsg requests of inflight_ not completed yet
+    std::vector<char> completed_;
+};
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef __KCPOUTPUTQUEUE_H__
+#define __KCPOUTPUTQUEUE_H__
+
+#include <sys/socket.h>
+#include <netinet/udp.h>
+#include <vector>
+
+#include "kcpsession.h"
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+const int KCP_GSO_MAX_SEGMENTS = 64; //UDP_MAX_SEGMENTS of older kernels
+const int KCP_GSO_MAX_BYTES = 65507; //largest udp payload over ipv4
+
+//datagrams waiting for the next sendmmsg, packed into one arena.
+//with segmentation on, back-to-back datagrams of one size to one peer 
+//share an entry and go out as a single UDP_SEGMENT send
+class KCPOutputQueue
+{
+public:
+    KCPOutputQueue();
+    ~KCPOutputQueue();
+
+    void Init(int capacity, int slot_size);
+    void Clear();
+    void SetSegmentation(bool enable);
+    bool Push(const KCPAddr& addr, const char* data, int len);
+    void Pop(int count); //drop the first count datagrams, keep the rest in order
+    void Remove(const char* done); //drop datagram i where done[i] is set
+    void Swap(KCPOutputQueue* other); //trade contents, each keeps its segmentation setting
+    mmsghdr* GetMessages();
+    const sockaddr_in& GetAddr(int index) const;
+    const char* GetData(int index) const;
+    int GetLength(int index) const;
+    int GetSegmentSize(int index) const;
+    int GetSegments(int index) const; //datagrams carried by the entry
+    int GetSize() const;
+    bool IsEmpty() const;
+    bool IsFull() const;
+
+private:
+    struct Entry
+    {
+        sockaddr_in addr;
+        socklen_t addr_len;
+        int offset;
+        int len;
+        int seg_size;
+        int seg_count;
+    };
+
+    bool Append(const KCPAddr& addr, const char* data, int len);
+
+    bool segmentation_;
+    int count_;
+    int arena_used_;
+    std::vector<Entry> entries_;
+    std::vector<char> arena_;
+    std::vector<iovec> iovs_;
+    std::vector<mmsghdr> msgs_;
+    std::vector<char> controls_;
+};
+
+#endif
@@ -0,0 +1,146 @@
+#ifndef __KCPPOOL_H__
+#define __KCPPOOL_H__
+
+#include <assert.h>
+#include <stddef.h>
+#include <vector>
+
+#include "ikcp.h"
+
+//fixed size object storage carved from slabs, freed objects are chained 
+//through their own storage. not thread safe, one pool per worker.
+//only hands out raw storage, callers placement-new and destroy themselves
+template <typename T>
+class KCPObjectPool
+{
+public:
+    static const int SLAB_OBJECTS = 256;
+
+public:
+    KCPObjectPool() : free_list_(NULL), used_(0) {}
+
+    ~KCPObjectPool()
+    {
+        assert(0 == used_);
+        for (size_t i = 0; i < slabs_.size(); i++)
+        {
+            delete[] slabs_[i];
+        }
+    }
+
+    void* Alloc()
+    {
+        if (NULL == free_list_)
+        {
+            AddSlab();
+        }
+
+        FreeNode* node = free_list_;
+        free_list_ = node->next;
+        used_++;
+        return node;
+    }
+
+    void Free(void* ptr)
+    {
+        if (NULL == ptr)
+        {
+            return;
+        }
+
+        FreeNode* node = static_cast<FreeNode*>(ptr);
+        node->next = free_list_;
+        free_list_ = node;
+        used_--;
+    }
+
+    int GetUsed() const
+    {
+        return used_;
+    }
+
+private:
+    union Storage
+    {
+        void* next;
+        char data[sizeof(T)];
+        long double align_double;
+        long long align_long;
+    };
+
+    struct FreeNode
+    {
+        FreeNode* next;
+    };
+
+    void AddSlab()
+    {
+        Storage* slab = new Storage[SLAB_OBJECTS];
+        slabs_.push_back(slab);
+        for (int i = SLAB_OBJECTS - 1; i >= 0; i--)
+        {
+            FreeNode* node = reinterpret_cast<FreeNode*>(&slab[i]);
+            node->next = free_list_;
+            free_list_ = node;
+        }
+    }
+
+    FreeNode* free_list_;
+    int used_;
+    std::vector<Storage*> slabs_;
+};
+
+//byte buffers in power of two size classes from 1K to 64K, 
+//a freed buffer goes back to its class list for the next Alloc
+class KCPBufferPool
+{
+public:
+    static const int MIN_SHIFT = 10; //1K
+    static const int MAX_SHIFT = 16; //64K
+    static const int CLASS_COUNT = MAX_SHIFT - MIN_SHIFT + 1;
+
+public:
+    KCPBufferPool();
+    ~KCPBufferPool();
+
+    char* Alloc(int size, int* capacity); //capacity gets the class size actually handed out
+    void Free(char* buffer, int capacity);
+    static int GetClassSize(int size); //smallest class holding size, 0 if above 64K
+
+private:
+    static int GetClass(int capacity);
+
+    std::vector<char*> free_[CLASS_COUNT];
+};
+
+struct KCPSegmentAllocatorStats
+{
+    IUINT64 hits; //served from the calling thread's free list
+    IUINT64 misses; //had to refill the thread's free list first
+    IUINT64 large; //above the biggest class, went to malloc
+    IUINT64 bytes_held; //slab bytes taken from the heap, never given back
+
+    KCPSegmentAllocatorStats();
+};
+
+//ikcp segment storage, classes sized from the segment mss. every thread 
+//keeps its own free lists and moves blocks to and from a shared depot 
+//REFILL_COUNT at a time, so the steady state takes no lock and no malloc.
+//plugged in through ikcp_allocator, which is process wide. Install() fails 
+//once ikcp has allocated anything, so Free only ever sees our own blocks. 
+//the first successful call fixes the classes for every server in the 
+//process, later calls return true and keep them whatever their mss
+class KCPSegmentAllocator
+{
+public:
+    static const int CLASS_COUNT = 4; //mss/8, mss/4, mss/2, mss
+    static const int REFILL_COUNT = 64;
+
+public:
+    static bool Install(int mss);
+    static void* Malloc(size_t size);
+    static void Free(void* ptr);
+    static KCPSegmentAllocatorStats GetStats();
+};
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef __KCPQUEUE_H__
+#define __KCPQUEUE_H__
+
+#include <assert.h>
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+//bounded lock-free queue, any number of producers and a single consumer.
+//every cell carries a sequence number, so producers only race on one 
+//fetch of the enqueue position and the consumer never takes a lock.
+template <typename T>
+class KCPMPSCQueue
+{
+public:
+    KCPMPSCQueue() : mask_(0), enqueue_pos_(0), dequeue_pos_(0) {}
+
+    void Init(int capacity)
+    {
+        size_t size = 2;
+        while (size < (size_t)capacity)
+        {
+            size <<= 1;
+        }
+
+        std::vector<Cell> cells(size);
+        cells_.swap(cells);
+        for (size_t i = 0; i < size; i++)
+        {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        mask_ = size - 1;
+        enqueue_pos_.store(0, std::memory_order_relaxed);
+        dequeue_pos_.store(0, std::memory_order_relaxed);
+    }
+
+    bool Push(const T& value)
+    {
+        assert(!cells_.empty());
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        Cell* cell = NULL;
+        while (true)
+        {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+            if (0 == diff)
+            {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0) //full
+            {
+                return false;
+            }
+            else
+            {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->data = value;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(T& value)
+    {
+        if (cells_.empty())
+        {
+            return false;
+        }
+
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        Cell* cell = &cells_[pos & mask_];
+        size_t seq = cell->sequence.load(std::memory_order_acquire);
+        if ((ptrdiff_t)seq - (ptrdiff_t)(pos + 1) < 0) //empty
+        {
+            return false;
+        }
+
+        value = cell->data;
+        dequeue_pos_.store(pos + 1, std::memory_order_relaxed);
+        cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool IsEmpty() const
+    {
+        return enqueue_pos_.load(std::memory_order_acquire) == 
+            dequeue_pos_.load(std::memory_order_acquire);
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::vector<Cell> cells_;
+    size_t mask_;
+    char pad0_[64];
+    std::atomic<size_t> enqueue_pos_;
+    char pad1_[64];
+    std::atomic<size_t> dequeue_pos_;
+};
+
+//bounded lock-free queue, one producer and one consumer thread. each side
+//keeps a stale copy of the other side's index and only reloads it when the
+//queue looks full or empty, so the shared lines move once per batch
+template <typename T>
+class KCPSPSCQueue
+{
+public:
+    KCPSPSCQueue() : mask_(0), tail_(0), cached_head_(0), head_(0), cached_tail_(0) {}
+
+    void Init(int capacity)
+    {
+        size_t size = 2;
+        while (size < (size_t)capacity)
+        {
+            size <<= 1;
+        }
+
+        std::vector<T> cells(size);
+        cells_.swap(cells);
+        mask_ = size - 1;
+        tail_.store(0, std::memory_order_relaxed);
+        head_.store(0, std::memory_order_relaxed);
+        cached_head_ = 0;
+        cached_tail_ = 0;
+    }
+
+    bool Push(const T& value)
+    {
+        assert(!cells_.empty());
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - cached_head_ > mask_)
+        {
+            cached_head_ = head_.load(std::memory_order_acquire);
+            if (tail - cached_head_ > mask_) //full
+            {
+                return false;
+            }
+        }
+
+        cells_[tail & mask_] = value;
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(T& value)
+    {
+        if (cells_.empty())
+        {
+            return false;
+        }
+
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head == cached_tail_)
+        {
+            cached_tail_ = tail_.load(std::memory_order_acquire);
+            if (head == cached_tail_) //empty
+            {
+                return false;
+            }
+        }
+
+        value = cells_[head & mask_];
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool IsEmpty() const
+    {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    }
+
+private:
+    std::vector<T> cells_;
+    size_t mask_;
+    char pad0_[64];
+    std::atomic<size_t> tail_; //producer side
+    size_t cached_head_;
+    char pad1_[64];
+    std::atomic<size_t> head_; //consumer side
+    size_t cached_tail_;
+    char pad2_[64];
+};
+
+#endif
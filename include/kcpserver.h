@@ -1,73 +1,256 @@
-/*
- * File:   kcpserver.h
- * Author: axiezhou
- *
- * Created on 2016/10/20
-*/
-
-#ifndef __KCPSERVER_H__
-#define __KCPSERVER_H__
-
-#include <sys/time.h>
-#include <string>
-#include <map>
-
-#include "kcpsession.h"
-
-inline IUINT64 iclock()
-{
-    struct timeval time;
-    gettimeofday(&time, NULL);
-    IINT64 value = ((IINT64)time.tv_sec) * 1000 + (time.tv_usec / 1000);
-    return value;
-}
-
-typedef void(*package_recv_cb_func)(int, const char*, int);
-typedef void(*session_kick_cb_func)(int);
-typedef void(*error_log_reporter)(const char*);
-
-struct KCPOptions
-{
-    int port;
-    int keep_session_time;
-    package_recv_cb_func recv_cb;
-    session_kick_cb_func kick_cb;
-    error_log_reporter error_reporter;
-
-    KCPOptions();
-};
-
-class KCPServer
-{
-public:
-    friend class KCPSession;
-
-public:
-    KCPServer();
-    KCPServer(const KCPOptions& options);
-    ~KCPServer();
-
-    bool Start();
-    void Update();
-    bool Send(int conv, const char* data, int len);
-    void KickSession(int conv);
-    bool SessionExist(int conv) const;
-    void SetOption(const KCPOptions& options);
-
-private:
-    bool UDPBind();
-    void Clear();
-    KCPSession* GetSession(int conv);
-    void DoOutput(const KCPAddr& addr, const char* data, int len);
-    void UDPRead();
-    void SessionUpdate();
-    void OnKCPRevc(int conv, const char* data, int len);
-    void DoErrorLog(const char *fmt, ...);
-
-    KCPOptions options_;
-    int fd_;
-    std::map<int, KCPSession*> sessions_;
-    IUINT64 current_clock_;
-};
-
+/*
+ * File:   kcpserver.h
+ * Author: axiezhou
+ *
+ * Created on 2016/10/20
+*/
+
+#ifndef __KCPSERVER_H__
+#define __KCPSERVER_H__
+
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <string>
+
+#include <vector>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <future>
+
+#include "kcpsession.h"
+#include "kcpoutputqueue.h"
+#include "kcptimerwheel.h"
+#include "kcpqueue.h"
+#include "kcpiobackend.h"
+#include "kcpsessiontable.h"
+#include "kcpapppool.h"
+
+inline IUINT64 iclock()
+{
+    struct timeval time;
+    gettimeofday(&time, NULL);
+    IINT64 value = ((IINT64)time.tv_sec) * 1000 + (time.tv_usec / 1000);
+    return value;
+}
+
+typedef void(*package_recv_cb_func)(int, const char*, int);
+typedef void(*package_recvv_cb_func)(int, const iovec*, int); //iov points into kcp segments
+typedef void(*package_recvbuf_cb_func)(int, IKCPBUF*); //owns buf, ikcp_buf_release it when done
+typedef void(*session_kick_cb_func)(int);
+typedef void(*error_log_reporter)(const char*);
+
+struct KCPOptions
+{
+    int port;
+    int keep_session_time;
+    int recv_batch_size; //max datagrams pulled by one recvmmsg call, io_uring receive buffers
+    int send_batch_size; //max datagrams queued before a sendmmsg flush
+    int worker_threads; //above 1, one reuseport socket and loop per thread
+    int command_queue_size; //commands a loop can hold from other threads
+    int command_batch_size; //commands a loop runs per tick, the rest waits a tick
+    int mtu_min; //udp payload of new sessions, path mtu discovery probes up to mtu_max
+    int mtu_max; //equal to mtu_min turns discovery off
+    bool reuseport_cbpf; //steer datagrams to workers by conv in the kernel
+    bool udp_gso; //send same size datagrams to one peer with UDP_SEGMENT
+    bool udp_gro; //let the kernel coalesce received datagrams, 64K per recv slot
+    int io_backend; //KCPIOBackendType
+    int congestion_control; //KCPCongestionType of new sessions
+    bool sack; //ack with IKCP_CMD_SACK bitmaps when the peer enables it too
+    int send_window; //ikcp_wndsize of new sessions, in segments
+    int recv_window;
+    bool seq_ring; //index in-flight and out of order segments by sn, see ikcp_setring
+    int fec_data_shards; //reed-solomon fec of new sessions, 0 is off
+    int fec_parity_shards;
+    int compress_min_size; //lz4 Send packages with a body this long or more, 0 is off
+    int app_threads; //above 0, callbacks run on this many threads instead of the loops
+    int app_queue_size; //packages one loop can queue to one app thread
+    bool segment_allocator; //serve ikcp segments from KCPSegmentAllocator, process wide
+    package_recv_cb_func recv_cb;
+    package_recvv_cb_func recvv_cb; //used instead of recv_cb when set, no copy at all
+    package_recvbuf_cb_func recvbuf_cb; //used before both when set, the package as a buffer
+    session_kick_cb_func kick_cb;
+    error_log_reporter error_reporter;
+
+    KCPOptions();
+};
+
+struct KCPServerStats
+{
+    IUINT64 recv_calls; //recvmmsg syscalls or io_uring reaps that returned data
+    IUINT64 recv_packets; //datagrams received
+    IUINT64 recv_batch_max; //most datagrams returned by one call
+    IUINT64 recv_invalid; //datagrams dropped as malformed
+    IUINT64 send_calls; //sendmmsg syscalls or io_uring submits that sent data
+    IUINT64 send_packets; //datagrams sent
+    IUINT64 send_eagain; //flushes cut short by a full socket buffer
+    IUINT64 send_dropped; //datagrams dropped on send error or full queue
+    IUINT64 recv_forwarded; //datagrams handed to the worker owning their conv
+    IUINT64 send_segmented; //datagrams the kernel cut out of UDP_SEGMENT sends
+    IUINT64 recv_coalesced; //datagrams split out of UDP_GRO reads
+    IUINT64 send_compressed; //packages sent lz4 compressed
+    IUINT64 compress_saved; //bytes compression took off them
+    IUINT64 app_dispatched; //packages and kicks queued to app threads
+    IUINT64 app_backlogged; //of them, ones that found the ring full
+    IUINT64 commands_executed; //work posted from other threads
+    IUINT64 command_wakeups; //eventfd writes that woke a sleeping loop for it
+
+    KCPServerStats();
+    void Add(const KCPServerStats& other);
+};
+
+enum KCPCommandType
+{
+    KCP_COMMAND_SEND,
+    KCP_COMMAND_BROADCAST, //data holds the convs
+    KCP_COMMAND_KICK,
+    KCP_COMMAND_EXIST,
+    KCP_COMMAND_MTU,
+    KCP_COMMAND_INPUT,
+    KCP_COMMAND_FEC, //len holds data shards << 8 | parity shards
+    KCP_COMMAND_STOP,
+};
+
+//work posted to a loop from another thread, data is owned by the command
+struct KCPCommand
+{
+    KCPCommand();
+
+    int type;
+    int conv;
+    char* data;
+    int len;
+    IKCPBUF* buf; //a send of a shared buffer holds one reference
+    sockaddr_in addr;
+    socklen_t addr_len;
+    std::promise<int>* result; //answer of a query
+};
+
+class KCPServer
+{
+public:
+    friend class KCPSession;
+    friend class KCPIOBackend;
+    friend KCPSession* NewKCPSession(KCPServer* server, const KCPAddr& addr, int conv, 
+        IUINT64 current);
+    friend void DeleteKCPSession(KCPServer* server, KCPSession* session);
+
+public:
+    KCPServer();
+    KCPServer(const KCPOptions& options);
+    ~KCPServer();
+
+    bool Start();
+    void Update();
+    bool Run(); //block in epoll until Stop()
+    void Stop();
+    int GetFd() const; //for an external loop: wait readable on it, 
+    int GetEventFd() const; //and on this one, written when another thread posts work,
+    int NextTimeout(); //or this many ms (-1 forever), then call Update()
+    bool Send(int conv, const char* data, int len);
+    bool SendV(int conv, const iovec* iov, int count); //one package gathered from iov
+    bool SendBuffer(int conv, IKCPBUF* buf); //segments reference buf, the caller keeps its reference
+    //one payload for many sessions, every session's segments reference it.
+    //returns sessions it was queued for, unknown convs are skipped; convs of 
+    //another worker, or called off the loop thread, count once the command is queued
+    int Broadcast(const int* convs, int count, const char* data, int len);
+    int BroadcastBuffer(const int* convs, int count, IKCPBUF* buf);
+    //groups are conv lists for Broadcast, a kicked or timed out conv leaves them all
+    int CreateGroup();
+    void DestroyGroup(int group);
+    bool JoinGroup(int group, int conv);
+    bool LeaveGroup(int group, int conv);
+    int SendGroup(int group, const char* data, int len); //-1 if no such group
+    void KickSession(int conv);
+    bool SessionExist(int conv) const;
+    int GetSessionMtu(int conv) const; //kcp datagram size the session sends, -1 if no session
+    //data_shards 0 turns fec off, the client has to speak the same framing.
+    //off the owning loop's thread true means the change was queued
+    bool SetSessionFec(int conv, int data_shards, int parity_shards);
+
+    void SetOption(const KCPOptions& options);
+    KCPServerStats GetStats() const;
+
+private:
+    bool UDPBind();
+    bool InitIOBackend();
+    void FlushOutput();
+    bool InitEventLoop();
+    void ArmTimer(int timeout);
+    void WatchWritable(bool enable);
+    void Clear();
+    KCPSession* GetSession(int conv);
+    void DoOutput(const KCPAddr& addr, const char* data, int len);
+    void UDPRead();
+    void HandleDatagram(const sockaddr_in& addr, socklen_t addr_len, const char* data, int len);
+    void SessionUpdate();
+    void ScheduleSession(KCPSession* session, IUINT64 expire);
+    void RescheduleSession(KCPSession* session);
+    void RemoveSession(KCPSession* session);
+    void SweepIdleSessions();
+    bool StartShards();
+    bool AttachConvSteering();
+    void StopShards();
+    void ShardMain();
+    KCPServer* GetOwnerShard(int conv) const;
+    KCPServer* GetOwnerLoop(int conv) const;
+    bool InLoopThread() const;
+    bool PostCommand(const KCPCommand& command);
+    bool PostSend(KCPServer* shard, KCPCommand& command);
+    void LeaveAllGroups(int conv);
+    int PostQuery(KCPServer* shard, int type, int conv) const;
+    void ProcessCommands(bool queries_only);
+    void ExecuteCommand(KCPCommand& command);
+    void PublishStats();
+    void OnKCPRevc(int conv, const char* data, int len);
+    void OnKCPRevc(int conv, const iovec* iov, int count, int len);
+    void Dispatch(int conv, IKCPBUF* buf);
+    static void OnAppMessage(int conv, IKCPBUF* buf, void* user);
+    void DoErrorLog(const char *fmt, ...);
+
+    KCPOptions options_;
+    int fd_;
+    int epoll_fd_;
+    int timer_fd_;
+    bool running_;
+    bool watch_writable_;
+    KCPObjectPool<KCPSession> session_pool_;
+    KCPBufferPool buffer_pool_; //session receive buffers
+    KCPSessionTable sessions_;
+    int sweep_pos_; //next table position the idle sweep looks at
+    IUINT64 sweep_clock_;
+    IUINT64 current_clock_;
+    KCPServerStats stats_;
+    KCPTimerWheel timer_wheel_;
+    iqueue_head ready_sessions_; //sessions to update on the next tick
+
+    KCPIOBackend* io_backend_;
+    KCPOutputQueue output_queue_;
+
+    //sharded mode: the facade owns one server per worker thread, 
+    //a conv always lives on shards_[conv % shards_.size()]
+    std::vector<KCPServer*> shards_;
+    std::vector<std::thread> threads_;
+    KCPServer* parent_;
+    int shard_index_;
+    //every loop takes work from other threads through commands_. event_fd_
+    //is only written when the loop announced a sleep in NextTimeout()
+    int event_fd_;
+    std::atomic<bool> sleeping_;
+    bool slept_; //loop side, event_fd_ may hold a write
+    std::atomic<std::thread::id> loop_thread_; //single loop mode, who calls Update()
+    KCPMPSCQueue<KCPCommand> commands_;
+    std::vector<KCPCommand> deferred_commands_;
+    mutable std::mutex stats_mutex_;
+    KCPServerStats published_stats_;
+
+    std::mutex groups_mutex_;
+    std::map<int, std::vector<int> > groups_;
+    std::map<int, std::vector<int> > member_groups_; //conv to the groups it joined
+    int next_group_;
+
+    KCPAppPool* app_pool_; //NULL unless app_threads, the facade owns it
+};
+
 #endif
\ No newline at end of file
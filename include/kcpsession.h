@@ -1,78 +1,122 @@
-/*
-* File:   kcpsession.h
-* Author: axiezhou
-*
-* Created on 2016/10/20
-*/
-
-#ifndef __KCPSESSION_H__
-#define __KCPSESSION_H__
-
-#include <arpa/inet.h>
-
-#include "ikcp.h"
-
-struct KCPAddr
-{
-    KCPAddr(const sockaddr_in& sockaddr, socklen_t sock_len) :
-        sockaddr(sockaddr), sock_len(sock_len){}
-    sockaddr_in sockaddr;
-    socklen_t sock_len;
-};
-
-class KCPServer;
-class KCPSession;
-
-KCPSession* NewKCPSession(KCPServer* server, const KCPAddr& addr, int conv, IUINT64 current);
-
-class KCPRingBuffer
-{
-public:
-    static const int BUFFER_SIZE = 1 * 64 * 1024; //64k //1M
-
-public:
-    KCPRingBuffer();
-    ~KCPRingBuffer();
-
-    void Clear();
-    int GetUsedSize() const;
-    int GetFreeSize() const;
-    int Write(const char* src, int len);
-    int Read(char* dst, int len);
-    bool ReadNoPop(char* dst, int len) const;
-    int GetBufferSize() const;
-private:
-    int read_pos_;
-    int write_pos_;
-    bool is_empty_;
-    bool is_full_;
-    char buffer_[BUFFER_SIZE];
-    
-};
-class KCPSession
-{
-public:
-    KCPSession(KCPServer* server, const KCPAddr& addr, IUINT64 current);
-    ~KCPSession();
-
-    void Update(IUINT32 current);
-    int Send(const char* data, int len);
-    IUINT64 LastActiveTime() const;
-    void SetKCP(ikcpcb* kcp);
-public:
-    void KCPInput(const sockaddr_in& sockaddr, const socklen_t socklen, const char* data, long sz, 
-        IUINT64 current);
-    void Output(const char* buf, int len);
-
-private:
-    void Clear();
-
-    ikcpcb* kcp_;
-    KCPServer* server_;
-    KCPAddr addr_;
-    IUINT64 last_active_time_;
-    KCPRingBuffer recv_buffer_;
-};
-
-
+/*
+* File:   kcpsession.h
+* Author: axiezhou
+*
+* Created on 2016/10/20
+*/
+
+#ifndef __KCPSESSION_H__
+#define __KCPSESSION_H__
+
+#include <arpa/inet.h>
+#include <sys/uio.h>
+
+#include "ikcp.h"
+#include "kcptimerwheel.h"
+#include "kcppool.h"
+#include "kcpfec.h"
+
+struct KCPAddr
+{
+    KCPAddr(const sockaddr_in& sockaddr, socklen_t sock_len) :
+        sockaddr(sockaddr), sock_len(sock_len){}
+    sockaddr_in sockaddr;
+    socklen_t sock_len;
+};
+
+class KCPServer;
+class KCPSession;
+class KCPMessageCursor;
+
+const IUINT64 KCP_NEVER_UPDATE = ~0ULL;
+const int KCP_SESSION_MTU_MIN = 548; //576 byte datagram any ipv4 host takes, less ip and udp heads
+const int KCP_SESSION_MTU_MAX = 1472; //1500 byte ethernet frame, less ip and udp heads
+const int KCP_SEGMENT_HEAD = 24; //kcp header of every segment
+
+enum KCPCongestionType
+{
+    KCP_CC_NONE, //window only, flushes burst up to it
+    KCP_CC_RENO, //the classic kcp cwnd
+    KCP_CC_BBR, //model based cwnd with pacing
+};
+
+KCPSession* NewKCPSession(KCPServer* server, const KCPAddr& addr, int conv, IUINT64 current);
+void DeleteKCPSession(KCPServer* server, KCPSession* session);
+
+//storage comes from the pool on the first write, grows by size class
+//up to BUFFER_SIZE and goes back to the pool whenever it drains
+class KCPRingBuffer
+{
+public:
+    static const int BUFFER_SIZE = 1 * 64 * 1024; //64k //1M
+
+public:
+    KCPRingBuffer(KCPBufferPool* pool);
+    ~KCPRingBuffer();
+
+    void Clear();
+    int GetUsedSize() const;
+    int GetFreeSize() const;
+    int Write(const char* src, int len);
+    int Read(char* dst, int len);
+    bool ReadNoPop(char* dst, int len) const;
+    int GetBufferSize() const;
+    int GetCapacity() const; //bytes held from the pool right now
+private:
+    bool Reserve(int size);
+    void Release();
+
+    KCPBufferPool* pool_;
+    char* buffer_;
+    int capacity_;
+    int read_pos_;
+    int write_pos_;
+    bool is_empty_;
+    bool is_full_;
+};
+class KCPSession
+{
+public:
+    KCPSession(KCPServer* server, const KCPAddr& addr, IUINT64 current);
+    ~KCPSession();
+
+    void Update(IUINT32 current);
+    int Send(const char* data, int len);
+    int SendV(const iovec* iov, int count);
+    int SendBuffer(IKCPBUF* buf);
+    IUINT64 LastActiveTime() const;
+    IUINT64 NextUpdateTime(IUINT64 current) const;
+    int GetConv() const;
+    KCPTimerNode* GetTimer();
+    void SetKCP(ikcpcb* kcp);
+    void SetFec(int data_shards, int parity_shards); //0 data shards turns it off
+    int GetMtu() const; //kcp datagram size path mtu discovery got to
+public:
+    void KCPInput(const sockaddr_in& sockaddr, const socklen_t socklen, const char* data, long sz, 
+        IUINT64 current);
+    void Output(const char* buf, int len);
+
+private:
+    void Clear();
+    void ResetPathMtu();
+    void DeliverPackages(KCPMessageCursor* cursor);
+    void DeliverPacked(const iovec* iov, int count, int len);
+    bool Compress(const iovec* iov, int count, iovec* packed);
+    static void FecOutput(const char* buf, int len, void* user);
+    static void FecInput(const char* buf, int len, void* user);
+
+    ikcpcb* kcp_;
+    KCPFecEncoder* fec_encoder_; //NULL unless fec is on
+    KCPFecDecoder* fec_decoder_; //made on the first fec datagram from the peer
+    int compress_misses_; //incompressible packages in a row
+    int compress_skip_; //packages sent as they are before trying again
+
+    KCPServer* server_;
+    KCPAddr addr_;
+    IUINT64 last_active_time_;
+    KCPTimerNode timer_;
+    KCPRingBuffer recv_buffer_;
+};
+
+
 #endif
\ No newline at end of file
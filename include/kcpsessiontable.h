@@ -0,0 +1,47 @@
+#ifndef __KCPSESSIONTABLE_H__
+#define __KCPSESSIONTABLE_H__
+
+#include <vector>
+
+#include "ikcp.h"
+
+class KCPSession;
+
+struct KCPSessionSlot
+{
+    int conv;
+    int state;
+    KCPSession* session;
+    IUINT64 last_active; //kept here so the idle sweep never touches the session
+};
+
+//flat hash table of sessions keyed by conv, linear probing.
+//erase leaves a tombstone and never moves other slots, so a walk by 
+//position survives erasing the current slot; only Insert may rehash
+class KCPSessionTable
+{
+public:
+    KCPSessionTable();
+    ~KCPSessionTable();
+
+    KCPSessionSlot* Find(int conv);
+    const KCPSessionSlot* Find(int conv) const;
+    KCPSessionSlot* Insert(int conv, KCPSession* session, IUINT64 current);
+    void Erase(int conv);
+    void Clear();
+    int GetSize() const;
+    int GetCapacity() const;
+    KCPSessionSlot* GetSlot(int pos); //NULL when the position holds no session
+
+private:
+    int Probe(int conv) const; //position of conv, or -1
+    int HomeSlot(int conv) const;
+    void Rehash(int capacity);
+
+    int size_;
+    int tombstones_;
+    int shift_; //32 - log2(capacity)
+    std::vector<KCPSessionSlot> slots_;
+};
+
+#endif
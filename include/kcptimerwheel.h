@@ -0,0 +1,45 @@
+#ifndef __KCPTIMERWHEEL_H__
+#define __KCPTIMERWHEEL_H__
+
+#include "ikcp.h"
+
+struct KCPTimerNode
+{
+    KCPTimerNode();
+
+    iqueue_head node;
+    IUINT64 expire;
+    bool pending; //still waiting in the wheel
+    void* data;
+};
+
+//hierarchical timing wheel with millisecond ticks, 4 levels of 256 slots
+class KCPTimerWheel
+{
+public:
+    static const int WHEEL_BITS = 8;
+    static const int WHEEL_SIZE = 1 << WHEEL_BITS;
+    static const int WHEEL_MASK = WHEEL_SIZE - 1;
+    static const int WHEEL_LEVELS = 4;
+
+public:
+    KCPTimerWheel();
+    ~KCPTimerWheel();
+
+    void Init(IUINT64 current);
+    void Schedule(KCPTimerNode* timer, IUINT64 expire);
+    void Cancel(KCPTimerNode* timer);
+    void Expire(IUINT64 current, iqueue_head* due); //move timers expired by current into due
+    IUINT64 NextExpireTime() const; //earliest time a timer may expire, ~0 if none
+    int GetSize() const;
+
+private:
+    void AddTimer(KCPTimerNode* timer);
+    void Cascade(int level, int index);
+
+    IUINT64 current_; //next tick to process
+    int count_;
+    iqueue_head slots_[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+#endif
@@ -1,1274 +1,2485 @@
-//=====================================================================
-//
-// KCP - A Better ARQ Protocol Implementation
-// skywind3000 (at) gmail.com, 2010-2011
-//  
-// Features:
-// + Average RTT reduce 30% - 40% vs traditional ARQ like tcp.
-// + Maximum RTT reduce three times vs tcp.
-// + Lightweight, distributed as a single source file.
-//
-//=====================================================================
-#include "ikcp.h"
-
-#include <stddef.h>
-#include <stdlib.h>
-#include <string.h>
-#include <stdarg.h>
-#include <stdio.h>
-
-
-
-//=====================================================================
-// KCP BASIC
-//=====================================================================
-const IUINT32 IKCP_RTO_NDL = 30;		// no delay min rto
-const IUINT32 IKCP_RTO_MIN = 100;		// normal min rto
-const IUINT32 IKCP_RTO_DEF = 200;
-const IUINT32 IKCP_RTO_MAX = 60000;
-const IUINT32 IKCP_CMD_PUSH = 81;		// cmd: push data
-const IUINT32 IKCP_CMD_ACK  = 82;		// cmd: ack
-const IUINT32 IKCP_CMD_WASK = 83;		// cmd: window probe (ask)
-const IUINT32 IKCP_CMD_WINS = 84;		// cmd: window size (tell)
-const IUINT32 IKCP_ASK_SEND = 1;		// need to send IKCP_CMD_WASK
-const IUINT32 IKCP_ASK_TELL = 2;		// need to send IKCP_CMD_WINS
-const IUINT32 IKCP_WND_SND = 32;
-const IUINT32 IKCP_WND_RCV = 32;
-const IUINT32 IKCP_MTU_DEF = 1400;
-const IUINT32 IKCP_ACK_FAST	= 3;
-const IUINT32 IKCP_INTERVAL	= 100;
-const IUINT32 IKCP_OVERHEAD = 24;
-const IUINT32 IKCP_DEADLINK = 20;
-const IUINT32 IKCP_THRESH_INIT = 2;
-const IUINT32 IKCP_THRESH_MIN = 2;
-const IUINT32 IKCP_PROBE_INIT = 7000;		// 7 secs to probe window size
-const IUINT32 IKCP_PROBE_LIMIT = 120000;	// up to 120 secs to probe window
-
-
-//---------------------------------------------------------------------
-// encode / decode
-//---------------------------------------------------------------------
-
-/* encode 8 bits unsigned int */
-static inline char *ikcp_encode8u(char *p, unsigned char c)
-{
-	*(unsigned char*)p++ = c;
-	return p;
-}
-
-/* decode 8 bits unsigned int */
-static inline const char *ikcp_decode8u(const char *p, unsigned char *c)
-{
-	*c = *(unsigned char*)p++;
-	return p;
-}
-
-/* encode 16 bits unsigned int (lsb) */
-static inline char *ikcp_encode16u(char *p, unsigned short w)
-{
-#if IWORDS_BIG_ENDIAN
-	*(unsigned char*)(p + 0) = (w & 255);
-	*(unsigned char*)(p + 1) = (w >> 8);
-#else
-	*(unsigned short*)(p) = w;
-#endif
-	p += 2;
-	return p;
-}
-
-/* decode 16 bits unsigned int (lsb) */
-static inline const char *ikcp_decode16u(const char *p, unsigned short *w)
-{
-#if IWORDS_BIG_ENDIAN
-	*w = *(const unsigned char*)(p + 1);
-	*w = *(const unsigned char*)(p + 0) + (*w << 8);
-#else
-	*w = *(const unsigned short*)p;
-#endif
-	p += 2;
-	return p;
-}
-
-/* encode 32 bits unsigned int (lsb) */
-static inline char *ikcp_encode32u(char *p, IUINT32 l)
-{
-#if IWORDS_BIG_ENDIAN
-	*(unsigned char*)(p + 0) = (unsigned char)((l >>  0) & 0xff);
-	*(unsigned char*)(p + 1) = (unsigned char)((l >>  8) & 0xff);
-	*(unsigned char*)(p + 2) = (unsigned char)((l >> 16) & 0xff);
-	*(unsigned char*)(p + 3) = (unsigned char)((l >> 24) & 0xff);
-#else
-	*(IUINT32*)p = l;
-#endif
-	p += 4;
-	return p;
-}
-
-/* decode 32 bits unsigned int (lsb) */
-static inline const char *ikcp_decode32u(const char *p, IUINT32 *l)
-{
-#if IWORDS_BIG_ENDIAN
-	*l = *(const unsigned char*)(p + 3);
-	*l = *(const unsigned char*)(p + 2) + (*l << 8);
-	*l = *(const unsigned char*)(p + 1) + (*l << 8);
-	*l = *(const unsigned char*)(p + 0) + (*l << 8);
-#else 
-	*l = *(const IUINT32*)p;
-#endif
-	p += 4;
-	return p;
-}
-
-static inline IUINT32 _imin_(IUINT32 a, IUINT32 b) {
-	return a <= b ? a : b;
-}
-
-static inline IUINT32 _imax_(IUINT32 a, IUINT32 b) {
-	return a >= b ? a : b;
-}
-
-static inline IUINT32 _ibound_(IUINT32 lower, IUINT32 middle, IUINT32 upper) 
-{
-	return _imin_(_imax_(lower, middle), upper);
-}
-
-static inline long _itimediff(IUINT32 later, IUINT32 earlier) 
-{
-	return ((IINT32)(later - earlier));
-}
-
-//---------------------------------------------------------------------
-// manage segment
-//---------------------------------------------------------------------
-typedef struct IKCPSEG IKCPSEG;
-
-static void* (*ikcp_malloc_hook)(size_t) = NULL;
-static void (*ikcp_free_hook)(void *) = NULL;
-
-// internal malloc
-static void* ikcp_malloc(size_t size) {
-	if (ikcp_malloc_hook) 
-		return ikcp_malloc_hook(size);
-	return malloc(size);
-}
-
-// internal free
-static void ikcp_free(void *ptr) {
-	if (ikcp_free_hook) {
-		ikcp_free_hook(ptr);
-	}	else {
-		free(ptr);
-	}
-}
-
-// redefine allocator
-void ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*))
-{
-	ikcp_malloc_hook = new_malloc;
-	ikcp_free_hook = new_free;
-}
-
-// allocate a new kcp segment
-static IKCPSEG* ikcp_segment_new(ikcpcb *kcp, int size)
-{
-	return (IKCPSEG*)ikcp_malloc(sizeof(IKCPSEG) + size);
-}
-
-// delete a segment
-static void ikcp_segment_delete(ikcpcb *kcp, IKCPSEG *seg)
-{
-	ikcp_free(seg);
-}
-
-// write log
-void ikcp_log(ikcpcb *kcp, int mask, const char *fmt, ...)
-{
-	char buffer[1024];
-	va_list argptr;
-	if ((mask & kcp->logmask) == 0 || kcp->writelog == 0) return;
-	va_start(argptr, fmt);
-	vsprintf(buffer, fmt, argptr);
-	va_end(argptr);
-	kcp->writelog(buffer, kcp, kcp->user);
-}
-
-// check log mask
-static int ikcp_canlog(const ikcpcb *kcp, int mask)
-{
-	if ((mask & kcp->logmask) == 0 || kcp->writelog == NULL) return 0;
-	return 1;
-}
-
-// output segment
-static int ikcp_output(ikcpcb *kcp, const void *data, int size)
-{
-	assert(kcp);
-	assert(kcp->output);
-	if (ikcp_canlog(kcp, IKCP_LOG_OUTPUT)) {
-		ikcp_log(kcp, IKCP_LOG_OUTPUT, "[RO] %ld bytes", (long)size);
-	}
-	if (size == 0) return 0;
-	return kcp->output((const char*)data, size, kcp, kcp->user);
-}
-
-// output queue
-void ikcp_qprint(const char *name, const struct IQUEUEHEAD *head)
-{
-#if 0
-	const struct IQUEUEHEAD *p;
-	printf("<%s>: [", name);
-	for (p = head->next; p != head; p = p->next) {
-		const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
-		printf("(%lu %d)", (unsigned long)seg->sn, (int)(seg->ts % 10000));
-		if (p->next != head) printf(",");
-	}
-	printf("]\n");
-#endif
-}
-
-
-//---------------------------------------------------------------------
-// create a new kcpcb
-//---------------------------------------------------------------------
-ikcpcb* ikcp_create(IUINT32 conv, void *user)
-{
-	ikcpcb *kcp = (ikcpcb*)ikcp_malloc(sizeof(struct IKCPCB));
-	if (kcp == NULL) return NULL;
-	kcp->conv = conv;
-	kcp->user = user;
-	kcp->snd_una = 0;
-	kcp->snd_nxt = 0;
-	kcp->rcv_nxt = 0;
-	kcp->ts_recent = 0;
-	kcp->ts_lastack = 0;
-	kcp->ts_probe = 0;
-	kcp->probe_wait = 0;
-	kcp->snd_wnd = IKCP_WND_SND;
-	kcp->rcv_wnd = IKCP_WND_RCV;
-	kcp->rmt_wnd = IKCP_WND_RCV;
-	kcp->cwnd = 0;
-	kcp->incr = 0;
-	kcp->probe = 0;
-	kcp->mtu = IKCP_MTU_DEF;
-	kcp->mss = kcp->mtu - IKCP_OVERHEAD;
-	kcp->stream = 0;
-
-	kcp->buffer = (char*)ikcp_malloc((kcp->mtu + IKCP_OVERHEAD) * 3);
-	if (kcp->buffer == NULL) {
-		ikcp_free(kcp);
-		return NULL;
-	}
-
-	iqueue_init(&kcp->snd_queue);
-	iqueue_init(&kcp->rcv_queue);
-	iqueue_init(&kcp->snd_buf);
-	iqueue_init(&kcp->rcv_buf);
-	kcp->nrcv_buf = 0;
-	kcp->nsnd_buf = 0;
-	kcp->nrcv_que = 0;
-	kcp->nsnd_que = 0;
-	kcp->state = 0;
-	kcp->acklist = NULL;
-	kcp->ackblock = 0;
-	kcp->ackcount = 0;
-	kcp->rx_srtt = 0;
-	kcp->rx_rttval = 0;
-	kcp->rx_rto = IKCP_RTO_DEF;
-	kcp->rx_minrto = IKCP_RTO_MIN;
-	kcp->current = 0;
-	kcp->interval = IKCP_INTERVAL;
-	kcp->ts_flush = IKCP_INTERVAL;
-	kcp->nodelay = 0;
-	kcp->updated = 0;
-	kcp->logmask = 0;
-	kcp->ssthresh = IKCP_THRESH_INIT;
-	kcp->fastresend = 0;
-	kcp->nocwnd = 0;
-	kcp->xmit = 0;
-    kcp->dead_link = IKCP_DEADLINK;
-	kcp->output = NULL;
-	kcp->writelog = NULL;
-
-	return kcp;
-}
-
-
-//---------------------------------------------------------------------
-// release a new kcpcb
-//---------------------------------------------------------------------
-void ikcp_release(ikcpcb *kcp)
-{
-	assert(kcp);
-	if (kcp) {
-		IKCPSEG *seg;
-		while (!iqueue_is_empty(&kcp->snd_buf)) {
-			seg = iqueue_entry(kcp->snd_buf.next, IKCPSEG, node);
-			iqueue_del(&seg->node);
-			ikcp_segment_delete(kcp, seg);
-		}
-		while (!iqueue_is_empty(&kcp->rcv_buf)) {
-			seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-			iqueue_del(&seg->node);
-			ikcp_segment_delete(kcp, seg);
-		}
-		while (!iqueue_is_empty(&kcp->snd_queue)) {
-			seg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
-			iqueue_del(&seg->node);
-			ikcp_segment_delete(kcp, seg);
-		}
-		while (!iqueue_is_empty(&kcp->rcv_queue)) {
-			seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
-			iqueue_del(&seg->node);
-			ikcp_segment_delete(kcp, seg);
-		}
-		if (kcp->buffer) {
-			ikcp_free(kcp->buffer);
-		}
-		if (kcp->acklist) {
-			ikcp_free(kcp->acklist);
-		}
-
-		kcp->nrcv_buf = 0;
-		kcp->nsnd_buf = 0;
-		kcp->nrcv_que = 0;
-		kcp->nsnd_que = 0;
-		kcp->ackcount = 0;
-		kcp->buffer = NULL;
-		kcp->acklist = NULL;
-		ikcp_free(kcp);
-	}
-}
-
-
-//---------------------------------------------------------------------
-// set output callback, which will be invoked by kcp
-//---------------------------------------------------------------------
-void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len,
-	ikcpcb *kcp, void *user))
-{
-	kcp->output = output;
-}
-
-
-//---------------------------------------------------------------------
-// user/upper level recv: returns size, returns below zero for EAGAIN
-//---------------------------------------------------------------------
-int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
-{
-	struct IQUEUEHEAD *p;
-	int ispeek = (len < 0)? 1 : 0;
-	int peeksize;
-	int recover = 0;
-	IKCPSEG *seg;
-	assert(kcp);
-
-	if (iqueue_is_empty(&kcp->rcv_queue))
-		return -1;
-
-	if (len < 0) len = -len;
-
-	peeksize = ikcp_peeksize(kcp);
-
-	if (peeksize < 0) 
-		return -2;
-
-	if (peeksize > len) 
-		return -3;
-
-	if (kcp->nrcv_que >= kcp->rcv_wnd)
-		recover = 1;
-
-	// merge fragment
-	for (len = 0, p = kcp->rcv_queue.next; p != &kcp->rcv_queue; ) {
-		int fragment;
-		seg = iqueue_entry(p, IKCPSEG, node);
-		p = p->next;
-
-		if (buffer) {
-			memcpy(buffer, seg->data, seg->len);
-			buffer += seg->len;
-		}
-
-		len += seg->len;
-		fragment = seg->frg;
-
-		if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
-			ikcp_log(kcp, IKCP_LOG_RECV, "recv sn=%lu", seg->sn);
-		}
-
-		if (ispeek == 0) {
-			iqueue_del(&seg->node);
-			ikcp_segment_delete(kcp, seg);
-			kcp->nrcv_que--;
-		}
-
-		if (fragment == 0) 
-			break;
-	}
-
-	assert(len == peeksize);
-
-	// move available data from rcv_buf -> rcv_queue
-	while (! iqueue_is_empty(&kcp->rcv_buf)) {
-		IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-			iqueue_del(&seg->node);
-			kcp->nrcv_buf--;
-			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-			kcp->nrcv_que++;
-			kcp->rcv_nxt++;
-		}	else {
-			break;
-		}
-	}
-
-	// fast recover
-	if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
-		// ready to send back IKCP_CMD_WINS in ikcp_flush
-		// tell remote my window size
-		kcp->probe |= IKCP_ASK_TELL;
-	}
-
-	return len;
-}
-
-
-//---------------------------------------------------------------------
-// peek data size
-//---------------------------------------------------------------------
-int ikcp_peeksize(const ikcpcb *kcp)
-{
-	struct IQUEUEHEAD *p;
-	IKCPSEG *seg;
-	int length = 0;
-
-	assert(kcp);
-
-	if (iqueue_is_empty(&kcp->rcv_queue)) return -1;
-
-	seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
-	if (seg->frg == 0) return seg->len;
-
-	if (kcp->nrcv_que < seg->frg + 1) return -1;
-
-	for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue; p = p->next) {
-		seg = iqueue_entry(p, IKCPSEG, node);
-		length += seg->len;
-		if (seg->frg == 0) break;
-	}
-
-	return length;
-}
-
-
-//---------------------------------------------------------------------
-// user/upper level send, returns below zero for error
-//---------------------------------------------------------------------
-int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
-{
-	IKCPSEG *seg;
-	int count, i;
-
-	assert(kcp->mss > 0);
-	if (len < 0) return -1;
-
-	// append to previous segment in streaming mode (if possible)
-	if (kcp->stream != 0) {
-		if (!iqueue_is_empty(&kcp->snd_queue)) {
-			IKCPSEG *old = iqueue_entry(kcp->snd_queue.prev, IKCPSEG, node);
-			if (old->len < kcp->mss) {
-				int capacity = kcp->mss - old->len;
-				int extend = (len < capacity)? len : capacity;
-				seg = ikcp_segment_new(kcp, old->len + extend);
-				assert(seg);
-				if (seg == NULL) {
-					return -2;
-				}
-				iqueue_add_tail(&seg->node, &kcp->snd_queue);
-				memcpy(seg->data, old->data, old->len);
-				if (buffer) {
-					memcpy(seg->data + old->len, buffer, extend);
-					buffer += extend;
-				}
-				seg->len = old->len + extend;
-				seg->frg = 0;
-				len -= extend;
-				iqueue_del_init(&old->node);
-				ikcp_segment_delete(kcp, old);
-			}
-		}
-		if (len <= 0) {
-			return 0;
-		}
-	}
-
-	if (len <= (int)kcp->mss) count = 1;
-	else count = (len + kcp->mss - 1) / kcp->mss;
-
-	if (count > 255) return -2;
-
-	if (count == 0) count = 1;
-
-	// fragment
-	for (i = 0; i < count; i++) {
-		int size = len > (int)kcp->mss ? (int)kcp->mss : len;
-		seg = ikcp_segment_new(kcp, size);
-		assert(seg);
-		if (seg == NULL) {
-			return -2;
-		}
-		if (buffer && len > 0) {
-			memcpy(seg->data, buffer, size);
-		}
-		seg->len = size;
-		seg->frg = (kcp->stream == 0)? (count - i - 1) : 0;
-		iqueue_init(&seg->node);
-		iqueue_add_tail(&seg->node, &kcp->snd_queue);
-		kcp->nsnd_que++;
-		if (buffer) {
-			buffer += size;
-		}
-		len -= size;
-	}
-
-	return 0;
-}
-
-
-//---------------------------------------------------------------------
-// parse ack
-//---------------------------------------------------------------------
-static void ikcp_update_ack(ikcpcb *kcp, IINT32 rtt)
-{
-	IINT32 rto = 0;
-	if (kcp->rx_srtt == 0) {
-		kcp->rx_srtt = rtt;
-		kcp->rx_rttval = rtt / 2;
-	}	else {
-		long delta = rtt - kcp->rx_srtt;
-		if (delta < 0) delta = -delta;
-		kcp->rx_rttval = (3 * kcp->rx_rttval + delta) / 4;
-		kcp->rx_srtt = (7 * kcp->rx_srtt + rtt) / 8;
-		if (kcp->rx_srtt < 1) kcp->rx_srtt = 1;
-	}
-	rto = kcp->rx_srtt + _imax_(1, 4 * kcp->rx_rttval);
-	kcp->rx_rto = _ibound_(kcp->rx_minrto, rto, IKCP_RTO_MAX);
-}
-
-static void ikcp_shrink_buf(ikcpcb *kcp)
-{
-	struct IQUEUEHEAD *p = kcp->snd_buf.next;
-	if (p != &kcp->snd_buf) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		kcp->snd_una = seg->sn;
-	}	else {
-		kcp->snd_una = kcp->snd_nxt;
-	}
-}
-
-static void ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn)
-{
-	struct IQUEUEHEAD *p, *next;
-
-	if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
-		return;
-
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		next = p->next;
-		if (sn == seg->sn) {
-			iqueue_del(p);
-			ikcp_segment_delete(kcp, seg);
-			kcp->nsnd_buf--;
-			break;
-		}
-		if (_itimediff(sn, seg->sn) < 0) {
-			break;
-		}
-	}
-}
-
-static void ikcp_parse_una(ikcpcb *kcp, IUINT32 una)
-{
-	struct IQUEUEHEAD *p, *next;
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		next = p->next;
-		if (_itimediff(una, seg->sn) > 0) {
-			iqueue_del(p);
-			ikcp_segment_delete(kcp, seg);
-			kcp->nsnd_buf--;
-		}	else {
-			break;
-		}
-	}
-}
-
-static void ikcp_parse_fastack(ikcpcb *kcp, IUINT32 sn)
-{
-	struct IQUEUEHEAD *p, *next;
-
-	if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
-		return;
-
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		next = p->next;
-		if (_itimediff(sn, seg->sn) < 0) {
-			break;
-		}
-		else if (sn != seg->sn) {
-			seg->fastack++;
-		}
-	}
-}
-
-
-//---------------------------------------------------------------------
-// ack append
-//---------------------------------------------------------------------
-static void ikcp_ack_push(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
-{
-	size_t newsize = kcp->ackcount + 1;
-	IUINT32 *ptr;
-
-	if (newsize > kcp->ackblock) {
-		IUINT32 *acklist;
-		size_t newblock;
-
-		for (newblock = 8; newblock < newsize; newblock <<= 1);
-		acklist = (IUINT32*)ikcp_malloc(newblock * sizeof(IUINT32) * 2);
-
-		if (acklist == NULL) {
-			assert(acklist != NULL);
-			abort();
-		}
-
-		if (kcp->acklist != NULL) {
-			size_t x;
-			for (x = 0; x < kcp->ackcount; x++) {
-				acklist[x * 2 + 0] = kcp->acklist[x * 2 + 0];
-				acklist[x * 2 + 1] = kcp->acklist[x * 2 + 1];
-			}
-			ikcp_free(kcp->acklist);
-		}
-
-		kcp->acklist = acklist;
-		kcp->ackblock = newblock;
-	}
-
-	ptr = &kcp->acklist[kcp->ackcount * 2];
-	ptr[0] = sn;
-	ptr[1] = ts;
-	kcp->ackcount++;
-}
-
-static void ikcp_ack_get(const ikcpcb *kcp, int p, IUINT32 *sn, IUINT32 *ts)
-{
-	if (sn) sn[0] = kcp->acklist[p * 2 + 0];
-	if (ts) ts[0] = kcp->acklist[p * 2 + 1];
-}
-
-
-//---------------------------------------------------------------------
-// parse data
-//---------------------------------------------------------------------
-void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
-{
-	struct IQUEUEHEAD *p, *prev;
-	IUINT32 sn = newseg->sn;
-	int repeat = 0;
-	
-	if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0 ||
-		_itimediff(sn, kcp->rcv_nxt) < 0) {
-		ikcp_segment_delete(kcp, newseg);
-		return;
-	}
-
-	for (p = kcp->rcv_buf.prev; p != &kcp->rcv_buf; p = prev) {
-		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
-		prev = p->prev;
-		if (seg->sn == sn) {
-			repeat = 1;
-			break;
-		}
-		if (_itimediff(sn, seg->sn) > 0) {
-			break;
-		}
-	}
-
-	if (repeat == 0) {
-		iqueue_init(&newseg->node);
-		iqueue_add(&newseg->node, p);
-		kcp->nrcv_buf++;
-	}	else {
-		ikcp_segment_delete(kcp, newseg);
-	}
-
-#if 0
-	ikcp_qprint("rcvbuf", &kcp->rcv_buf);
-	printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
-#endif
-
-	// move available data from rcv_buf -> rcv_queue
-	while (! iqueue_is_empty(&kcp->rcv_buf)) {
-		IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
-		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
-			iqueue_del(&seg->node);
-			kcp->nrcv_buf--;
-			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
-			kcp->nrcv_que++;
-			kcp->rcv_nxt++;
-		}	else {
-			break;
-		}
-	}
-
-#if 0
-	ikcp_qprint("queue", &kcp->rcv_queue);
-	printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
-#endif
-
-#if 1
-//	printf("snd(buf=%d, queue=%d)\n", kcp->nsnd_buf, kcp->nsnd_que);
-//	printf("rcv(buf=%d, queue=%d)\n", kcp->nrcv_buf, kcp->nrcv_que);
-#endif
-}
-
-
-//---------------------------------------------------------------------
-// input data
-//---------------------------------------------------------------------
-int ikcp_input(ikcpcb *kcp, const char *data, long size)
-{
-	IUINT32 una = kcp->snd_una;
-	IUINT32 maxack = 0;
-	int flag = 0;
-
-	if (ikcp_canlog(kcp, IKCP_LOG_INPUT)) {
-		ikcp_log(kcp, IKCP_LOG_INPUT, "[RI] %d bytes", size);
-	}
-
-	if (data == NULL || size < 24) return -1;
-
-	while (1) {
-		IUINT32 ts, sn, len, una, conv;
-		IUINT16 wnd;
-		IUINT8 cmd, frg;
-		IKCPSEG *seg;
-
-		if (size < (int)IKCP_OVERHEAD) break;
-
-		data = ikcp_decode32u(data, &conv);
-		if (conv != kcp->conv) return -1;
-
-		data = ikcp_decode8u(data, &cmd);
-		data = ikcp_decode8u(data, &frg);
-		data = ikcp_decode16u(data, &wnd);
-		data = ikcp_decode32u(data, &ts);
-		data = ikcp_decode32u(data, &sn);
-		data = ikcp_decode32u(data, &una);
-		data = ikcp_decode32u(data, &len);
-
-		size -= IKCP_OVERHEAD;
-
-		if ((long)size < (long)len) return -2;
-
-		if (cmd != IKCP_CMD_PUSH && cmd != IKCP_CMD_ACK &&
-			cmd != IKCP_CMD_WASK && cmd != IKCP_CMD_WINS) 
-			return -3;
-
-		kcp->rmt_wnd = wnd;
-		ikcp_parse_una(kcp, una);
-		ikcp_shrink_buf(kcp);
-
-		if (cmd == IKCP_CMD_ACK) {
-			if (_itimediff(kcp->current, ts) >= 0) {
-				ikcp_update_ack(kcp, _itimediff(kcp->current, ts));
-			}
-			ikcp_parse_ack(kcp, sn);
-			ikcp_shrink_buf(kcp);
-			if (flag == 0) {
-				flag = 1;
-				maxack = sn;
-			}	else {
-				if (_itimediff(sn, maxack) > 0) {
-					maxack = sn;
-				}
-			}
-			if (ikcp_canlog(kcp, IKCP_LOG_IN_ACK)) {
-				ikcp_log(kcp, IKCP_LOG_IN_DATA, 
-					"input ack: sn=%lu rtt=%ld rto=%ld", sn, 
-					(long)_itimediff(kcp->current, ts),
-					(long)kcp->rx_rto);
-			}
-		}
-		else if (cmd == IKCP_CMD_PUSH) {
-			if (ikcp_canlog(kcp, IKCP_LOG_IN_DATA)) {
-				ikcp_log(kcp, IKCP_LOG_IN_DATA, 
-					"input psh: sn=%lu ts=%lu", sn, ts);
-			}
-			if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0) {
-				ikcp_ack_push(kcp, sn, ts);
-				if (_itimediff(sn, kcp->rcv_nxt) >= 0) {
-					seg = ikcp_segment_new(kcp, len);
-					seg->conv = conv;
-					seg->cmd = cmd;
-					seg->frg = frg;
-					seg->wnd = wnd;
-					seg->ts = ts;
-					seg->sn = sn;
-					seg->una = una;
-					seg->len = len;
-
-					if (len > 0) {
-						memcpy(seg->data, data, len);
-					}
-
-					ikcp_parse_data(kcp, seg);
-				}
-			}
-		}
-		else if (cmd == IKCP_CMD_WASK) {
-			// ready to send back IKCP_CMD_WINS in ikcp_flush
-			// tell remote my window size
-			kcp->probe |= IKCP_ASK_TELL;
-			if (ikcp_canlog(kcp, IKCP_LOG_IN_PROBE)) {
-				ikcp_log(kcp, IKCP_LOG_IN_PROBE, "input probe");
-			}
-		}
-		else if (cmd == IKCP_CMD_WINS) {
-			// do nothing
-			if (ikcp_canlog(kcp, IKCP_LOG_IN_WINS)) {
-				ikcp_log(kcp, IKCP_LOG_IN_WINS,
-					"input wins: %lu", (IUINT32)(wnd));
-			}
-		}
-		else {
-			return -3;
-		}
-
-		data += len;
-		size -= len;
-	}
-
-	if (flag != 0) {
-		ikcp_parse_fastack(kcp, maxack);
-	}
-
-	if (_itimediff(kcp->snd_una, una) > 0) {
-		if (kcp->cwnd < kcp->rmt_wnd) {
-			IUINT32 mss = kcp->mss;
-			if (kcp->cwnd < kcp->ssthresh) {
-				kcp->cwnd++;
-				kcp->incr += mss;
-			}	else {
-				if (kcp->incr < mss) kcp->incr = mss;
-				kcp->incr += (mss * mss) / kcp->incr + (mss / 16);
-				if ((kcp->cwnd + 1) * mss <= kcp->incr) {
-					kcp->cwnd++;
-				}
-			}
-			if (kcp->cwnd > kcp->rmt_wnd) {
-				kcp->cwnd = kcp->rmt_wnd;
-				kcp->incr = kcp->rmt_wnd * mss;
-			}
-		}
-	}
-
-	return 0;
-}
-
-
-//---------------------------------------------------------------------
-// ikcp_encode_seg
-//---------------------------------------------------------------------
-static char *ikcp_encode_seg(char *ptr, const IKCPSEG *seg)
-{
-	ptr = ikcp_encode32u(ptr, seg->conv);
-	ptr = ikcp_encode8u(ptr, (IUINT8)seg->cmd);
-	ptr = ikcp_encode8u(ptr, (IUINT8)seg->frg);
-	ptr = ikcp_encode16u(ptr, (IUINT16)seg->wnd);
-	ptr = ikcp_encode32u(ptr, seg->ts);
-	ptr = ikcp_encode32u(ptr, seg->sn);
-	ptr = ikcp_encode32u(ptr, seg->una);
-	ptr = ikcp_encode32u(ptr, seg->len);
-	return ptr;
-}
-
-static int ikcp_wnd_unused(const ikcpcb *kcp)
-{
-	if (kcp->nrcv_que < kcp->rcv_wnd) {
-		return kcp->rcv_wnd - kcp->nrcv_que;
-	}
-	return 0;
-}
-
-
-//---------------------------------------------------------------------
-// ikcp_flush
-//---------------------------------------------------------------------
-void ikcp_flush(ikcpcb *kcp)
-{
-	IUINT32 current = kcp->current;
-	char *buffer = kcp->buffer;
-	char *ptr = buffer;
-	int count, size, i;
-	IUINT32 resent, cwnd;
-	IUINT32 rtomin;
-	struct IQUEUEHEAD *p;
-	int change = 0;
-	int lost = 0;
-	IKCPSEG seg;
-
-	// 'ikcp_update' haven't been called. 
-	if (kcp->updated == 0) return;
-
-	seg.conv = kcp->conv;
-	seg.cmd = IKCP_CMD_ACK;
-	seg.frg = 0;
-	seg.wnd = ikcp_wnd_unused(kcp);
-	seg.una = kcp->rcv_nxt;
-	seg.len = 0;
-	seg.sn = 0;
-	seg.ts = 0;
-
-	// flush acknowledges
-	count = kcp->ackcount;
-	for (i = 0; i < count; i++) {
-		size = (int)(ptr - buffer);
-		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-			ikcp_output(kcp, buffer, size);
-			ptr = buffer;
-		}
-		ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
-		ptr = ikcp_encode_seg(ptr, &seg);
-	}
-
-	kcp->ackcount = 0;
-
-	// probe window size (if remote window size equals zero)
-	if (kcp->rmt_wnd == 0) {
-		if (kcp->probe_wait == 0) {
-			kcp->probe_wait = IKCP_PROBE_INIT;
-			kcp->ts_probe = kcp->current + kcp->probe_wait;
-		}	
-		else {
-			if (_itimediff(kcp->current, kcp->ts_probe) >= 0) {
-				if (kcp->probe_wait < IKCP_PROBE_INIT) 
-					kcp->probe_wait = IKCP_PROBE_INIT;
-				kcp->probe_wait += kcp->probe_wait / 2;
-				if (kcp->probe_wait > IKCP_PROBE_LIMIT)
-					kcp->probe_wait = IKCP_PROBE_LIMIT;
-				kcp->ts_probe = kcp->current + kcp->probe_wait;
-				kcp->probe |= IKCP_ASK_SEND;
-			}
-		}
-	}	else {
-		kcp->ts_probe = 0;
-		kcp->probe_wait = 0;
-	}
-
-	// flush window probing commands
-	if (kcp->probe & IKCP_ASK_SEND) {
-		seg.cmd = IKCP_CMD_WASK;
-		size = (int)(ptr - buffer);
-		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-			ikcp_output(kcp, buffer, size);
-			ptr = buffer;
-		}
-		ptr = ikcp_encode_seg(ptr, &seg);
-	}
-
-	// flush window probing commands
-	if (kcp->probe & IKCP_ASK_TELL) {
-		seg.cmd = IKCP_CMD_WINS;
-		size = (int)(ptr - buffer);
-		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
-			ikcp_output(kcp, buffer, size);
-			ptr = buffer;
-		}
-		ptr = ikcp_encode_seg(ptr, &seg);
-	}
-
-	kcp->probe = 0;
-
-	// calculate window size
-	cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
-	if (kcp->nocwnd == 0) cwnd = _imin_(kcp->cwnd, cwnd);
-
-	// move data from snd_queue to snd_buf
-	while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
-		IKCPSEG *newseg;
-		if (iqueue_is_empty(&kcp->snd_queue)) break;
-
-		newseg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
-
-		iqueue_del(&newseg->node);
-		iqueue_add_tail(&newseg->node, &kcp->snd_buf);
-		kcp->nsnd_que--;
-		kcp->nsnd_buf++;
-
-		newseg->conv = kcp->conv;
-		newseg->cmd = IKCP_CMD_PUSH;
-		newseg->wnd = seg.wnd;
-		newseg->ts = current;
-		newseg->sn = kcp->snd_nxt++;
-		newseg->una = kcp->rcv_nxt;
-		newseg->resendts = current;
-		newseg->rto = kcp->rx_rto;
-		newseg->fastack = 0;
-		newseg->xmit = 0;
-	}
-
-	// calculate resent
-	resent = (kcp->fastresend > 0)? (IUINT32)kcp->fastresend : 0xffffffff;
-	rtomin = (kcp->nodelay == 0)? (kcp->rx_rto >> 3) : 0;
-
-	// flush data segments
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
-		IKCPSEG *segment = iqueue_entry(p, IKCPSEG, node);
-		int needsend = 0;
-		if (segment->xmit == 0) {
-			needsend = 1;
-			segment->xmit++;
-			segment->rto = kcp->rx_rto;
-			segment->resendts = current + segment->rto + rtomin;
-		}
-		else if (_itimediff(current, segment->resendts) >= 0) {
-			needsend = 1;
-			segment->xmit++;
-			kcp->xmit++;
-			if (kcp->nodelay == 0) {
-				segment->rto += kcp->rx_rto;
-			}	else {
-				segment->rto += kcp->rx_rto / 2;
-			}
-			segment->resendts = current + segment->rto;
-			lost = 1;
-		}
-		else if (segment->fastack >= resent) {
-			needsend = 1;
-			segment->xmit++;
-			segment->fastack = 0;
-			segment->resendts = current + segment->rto;
-			change++;
-		}
-
-		if (needsend) {
-			int size, need;
-			segment->ts = current;
-			segment->wnd = seg.wnd;
-			segment->una = kcp->rcv_nxt;
-
-			size = (int)(ptr - buffer);
-			need = IKCP_OVERHEAD + segment->len;
-
-			if (size + need > (int)kcp->mtu) {
-				ikcp_output(kcp, buffer, size);
-				ptr = buffer;
-			}
-
-			ptr = ikcp_encode_seg(ptr, segment);
-
-			if (segment->len > 0) {
-				memcpy(ptr, segment->data, segment->len);
-				ptr += segment->len;
-			}
-
-			if (segment->xmit >= kcp->dead_link) {
-				kcp->state = -1;
-			}
-		}
-	}
-
-	// flash remain segments
-	size = (int)(ptr - buffer);
-	if (size > 0) {
-		ikcp_output(kcp, buffer, size);
-	}
-
-	// update ssthresh
-	if (change) {
-		IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
-		kcp->ssthresh = inflight / 2;
-		if (kcp->ssthresh < IKCP_THRESH_MIN)
-			kcp->ssthresh = IKCP_THRESH_MIN;
-		kcp->cwnd = kcp->ssthresh + resent;
-		kcp->incr = kcp->cwnd * kcp->mss;
-	}
-
-	if (lost) {
-		kcp->ssthresh = cwnd / 2;
-		if (kcp->ssthresh < IKCP_THRESH_MIN)
-			kcp->ssthresh = IKCP_THRESH_MIN;
-		kcp->cwnd = 1;
-		kcp->incr = kcp->mss;
-	}
-
-	if (kcp->cwnd < 1) {
-		kcp->cwnd = 1;
-		kcp->incr = kcp->mss;
-	}
-}
-
-
-//---------------------------------------------------------------------
-// update state (call it repeatedly, every 10ms-100ms), or you can ask 
-// ikcp_check when to call it again (without ikcp_input/_send calling).
-// 'current' - current timestamp in millisec. 
-//---------------------------------------------------------------------
-void ikcp_update(ikcpcb *kcp, IUINT32 current)
-{
-	IINT32 slap;
-
-	kcp->current = current;
-
-	if (kcp->updated == 0) {
-		kcp->updated = 1;
-		kcp->ts_flush = kcp->current;
-	}
-
-	slap = _itimediff(kcp->current, kcp->ts_flush);
-
-	if (slap >= 10000 || slap < -10000) {
-		kcp->ts_flush = kcp->current;
-		slap = 0;
-	}
-
-	if (slap >= 0) {
-		kcp->ts_flush += kcp->interval;
-		if (_itimediff(kcp->current, kcp->ts_flush) >= 0) {
-			kcp->ts_flush = kcp->current + kcp->interval;
-		}
-		ikcp_flush(kcp);
-	}
-}
-
-
-//---------------------------------------------------------------------
-// Determine when should you invoke ikcp_update:
-// returns when you should invoke ikcp_update in millisec, if there 
-// is no ikcp_input/_send calling. you can call ikcp_update in that
-// time, instead of call update repeatly.
-// Important to reduce unnacessary ikcp_update invoking. use it to 
-// schedule ikcp_update (eg. implementing an epoll-like mechanism, 
-// or optimize ikcp_update when handling massive kcp connections)
-//---------------------------------------------------------------------
-IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
-{
-	IUINT32 ts_flush = kcp->ts_flush;
-	IINT32 tm_flush = 0x7fffffff;
-	IINT32 tm_packet = 0x7fffffff;
-	IUINT32 minimal = 0;
-	struct IQUEUEHEAD *p;
-
-	if (kcp->updated == 0) {
-		return current;
-	}
-
-	if (_itimediff(current, ts_flush) >= 10000 ||
-		_itimediff(current, ts_flush) < -10000) {
-		ts_flush = current;
-	}
-
-	if (_itimediff(current, ts_flush) >= 0) {
-		return current;
-	}
-
-	tm_flush = _itimediff(ts_flush, current);
-
-	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
-		const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
-		IINT32 diff = _itimediff(seg->resendts, current);
-		if (diff <= 0) {
-			return current;
-		}
-		if (diff < tm_packet) tm_packet = diff;
-	}
-
-	minimal = (IUINT32)(tm_packet < tm_flush ? tm_packet : tm_flush);
-	if (minimal >= kcp->interval) minimal = kcp->interval;
-
-	return current + minimal;
-}
-
-
-
-int ikcp_setmtu(ikcpcb *kcp, int mtu)
-{
-	char *buffer;
-	if (mtu < 50 || mtu < (int)IKCP_OVERHEAD) 
-		return -1;
-	buffer = (char*)ikcp_malloc((mtu + IKCP_OVERHEAD) * 3);
-	if (buffer == NULL) 
-		return -2;
-	kcp->mtu = mtu;
-	kcp->mss = kcp->mtu - IKCP_OVERHEAD;
-	ikcp_free(kcp->buffer);
-	kcp->buffer = buffer;
-	return 0;
-}
-
-int ikcp_interval(ikcpcb *kcp, int interval)
-{
-	if (interval > 5000) interval = 5000;
-	else if (interval < 10) interval = 10;
-	kcp->interval = interval;
-	return 0;
-}
-
-int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc)
-{
-	if (nodelay >= 0) {
-		kcp->nodelay = nodelay;
-		if (nodelay) {
-			kcp->rx_minrto = IKCP_RTO_NDL;	
-		}	
-		else {
-			kcp->rx_minrto = IKCP_RTO_MIN;
-		}
-	}
-	if (interval >= 0) {
-		if (interval > 5000) interval = 5000;
-		else if (interval < 10) interval = 10;
-		kcp->interval = interval;
-	}
-	if (resend >= 0) {
-		kcp->fastresend = resend;
-	}
-	if (nc >= 0) {
-		kcp->nocwnd = nc;
-	}
-	return 0;
-}
-
-
-int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd)
-{
-	if (kcp) {
-		if (sndwnd > 0) {
-			kcp->snd_wnd = sndwnd;
-		}
-		if (rcvwnd > 0) {
-			kcp->rcv_wnd = rcvwnd;
-		}
-	}
-	return 0;
-}
-
-int ikcp_waitsnd(const ikcpcb *kcp)
-{
-	return kcp->nsnd_buf + kcp->nsnd_que;
-}
-
-
-// read conv
-IUINT32 ikcp_getconv(const void *ptr)
-{
-	IUINT32 conv;
-	ikcp_decode32u((const char*)ptr, &conv);
-	return conv;
-}
-
-
+//=====================================================================
+//
+// KCP - A Better ARQ Protocol Implementation
+// skywind3000 (at) gmail.com, 2010-2011
+//  
+// Features:
+// + Average RTT reduce 30% - 40% vs traditional ARQ like tcp.
+// + Maximum RTT reduce three times vs tcp.
+// + Lightweight, distributed as a single source file.
+//
+//=====================================================================
+#include "ikcp.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+
+
+//=====================================================================
+// KCP BASIC
+//=====================================================================
+const IUINT32 IKCP_RTO_NDL = 30;		// no delay min rto
+const IUINT32 IKCP_RTO_MIN = 100;		// normal min rto
+const IUINT32 IKCP_RTO_DEF = 200;
+const IUINT32 IKCP_RTO_MAX = 60000;
+const IUINT32 IKCP_CMD_PUSH = 81;		// cmd: push data
+const IUINT32 IKCP_CMD_ACK  = 82;		// cmd: ack
+const IUINT32 IKCP_CMD_WASK = 83;		// cmd: window probe (ask)
+const IUINT32 IKCP_CMD_WINS = 84;		// cmd: window size (tell)
+const IUINT32 IKCP_CMD_SACK = 85;		// cmd: una + receive bitmap
+const IUINT32 IKCP_CMD_PART = 86;		// cmd: piece of a push too big for the mtu
+const IUINT32 IKCP_ASK_SEND = 1;		// need to send IKCP_CMD_WASK
+const IUINT32 IKCP_ASK_TELL = 2;		// need to send IKCP_CMD_WINS
+const int IKCP_SACK_ENABLE = 1;
+const int IKCP_SACK_PEER = 2;			// peer understands IKCP_CMD_SACK
+const IUINT32 IKCP_SACK_ADVERT = 1;		// frg of a WINS that says so
+const IUINT32 IKCP_SACK_ADVERTS = 16;	// adverts sent while peer is unknown
+const IUINT32 IKCP_PMTU_PROBE = 2;		// frg of a padded WASK, sn is its size
+const IUINT32 IKCP_PMTU_ACK = 2;		// frg of the WINS that confirms one
+const IUINT32 IKCP_PMTU_TRIES = 3;		// unconfirmed probes before a size fails
+const IUINT32 IKCP_PMTU_STEP = 32;		// search stops this close to a failure
+const IUINT32 IKCP_PMTU_RAISE = 600000;	// 10 mins before probing past one again
+const IUINT32 IKCP_PMTU_BLACKHOLE = 4;	// sends of a timed out segment
+const IUINT32 IKCP_PART_HEAD = 8;		// offset and segment length
+const IUINT32 IKCP_PART_MAX = 0x10000;	// largest segment gathered from parts
+const IUINT32 IKCP_WND_SND = 32;
+const IUINT32 IKCP_WND_RCV = 32;
+const IUINT32 IKCP_MTU_DEF = 1400;
+const IUINT32 IKCP_ACK_FAST	= 3;
+const IUINT32 IKCP_INTERVAL	= 100;
+const IUINT32 IKCP_OVERHEAD = 24;
+const IUINT32 IKCP_DEADLINK = 20;
+const IUINT32 IKCP_THRESH_INIT = 2;
+const IUINT32 IKCP_THRESH_MIN = 2;
+const IUINT32 IKCP_PROBE_INIT = 7000;		// 7 secs to probe window size
+const IUINT32 IKCP_PROBE_LIMIT = 120000;	// up to 120 secs to probe window
+
+
+//---------------------------------------------------------------------
+// encode / decode
+//---------------------------------------------------------------------
+
+/* encode 8 bits unsigned int */
+static inline char *ikcp_encode8u(char *p, unsigned char c)
+{
+	*(unsigned char*)p++ = c;
+	return p;
+}
+
+/* decode 8 bits unsigned int */
+static inline const char *ikcp_decode8u(const char *p, unsigned char *c)
+{
+	*c = *(unsigned char*)p++;
+	return p;
+}
+
+/* encode 16 bits unsigned int (lsb) */
+static inline char *ikcp_encode16u(char *p, unsigned short w)
+{
+#if IWORDS_BIG_ENDIAN
+	*(unsigned char*)(p + 0) = (w & 255);
+	*(unsigned char*)(p + 1) = (w >> 8);
+#else
+	*(unsigned short*)(p) = w;
+#endif
+	p += 2;
+	return p;
+}
+
+/* decode 16 bits unsigned int (lsb) */
+static inline const char *ikcp_decode16u(const char *p, unsigned short *w)
+{
+#if IWORDS_BIG_ENDIAN
+	*w = *(const unsigned char*)(p + 1);
+	*w = *(const unsigned char*)(p + 0) + (*w << 8);
+#else
+	*w = *(const unsigned short*)p;
+#endif
+	p += 2;
+	return p;
+}
+
+/* encode 32 bits unsigned int (lsb) */
+static inline char *ikcp_encode32u(char *p, IUINT32 l)
+{
+#if IWORDS_BIG_ENDIAN
+	*(unsigned char*)(p + 0) = (unsigned char)((l >>  0) & 0xff);
+	*(unsigned char*)(p + 1) = (unsigned char)((l >>  8) & 0xff);
+	*(unsigned char*)(p + 2) = (unsigned char)((l >> 16) & 0xff);
+	*(unsigned char*)(p + 3) = (unsigned char)((l >> 24) & 0xff);
+#else
+	*(IUINT32*)p = l;
+#endif
+	p += 4;
+	return p;
+}
+
+/* decode 32 bits unsigned int (lsb) */
+static inline const char *ikcp_decode32u(const char *p, IUINT32 *l)
+{
+#if IWORDS_BIG_ENDIAN
+	*l = *(const unsigned char*)(p + 3);
+	*l = *(const unsigned char*)(p + 2) + (*l << 8);
+	*l = *(const unsigned char*)(p + 1) + (*l << 8);
+	*l = *(const unsigned char*)(p + 0) + (*l << 8);
+#else 
+	*l = *(const IUINT32*)p;
+#endif
+	p += 4;
+	return p;
+}
+
+static inline IUINT32 _imin_(IUINT32 a, IUINT32 b) {
+	return a <= b ? a : b;
+}
+
+static inline IUINT32 _imax_(IUINT32 a, IUINT32 b) {
+	return a >= b ? a : b;
+}
+
+static inline IUINT32 _ibound_(IUINT32 lower, IUINT32 middle, IUINT32 upper) 
+{
+	return _imin_(_imax_(lower, middle), upper);
+}
+
+static inline long _itimediff(IUINT32 later, IUINT32 earlier) 
+{
+	return ((IINT32)(later - earlier));
+}
+
+//---------------------------------------------------------------------
+// manage segment
+//---------------------------------------------------------------------
+typedef struct IKCPSEG IKCPSEG;
+
+static void* (*ikcp_malloc_hook)(size_t) = NULL;
+static void (*ikcp_free_hook)(void *) = NULL;
+static int ikcp_malloc_used = 0;	// ikcp has allocated, the allocator is fixed
+
+// internal malloc
+static void* ikcp_malloc(size_t size) {
+	if (ikcp_malloc_hook) 
+		return ikcp_malloc_hook(size);
+	if (__atomic_load_n(&ikcp_malloc_used, __ATOMIC_RELAXED) == 0)
+		__atomic_store_n(&ikcp_malloc_used, 1, __ATOMIC_RELAXED);
+	return malloc(size);
+}
+
+// internal free
+static void ikcp_free(void *ptr) {
+	if (ikcp_free_hook) {
+		ikcp_free_hook(ptr);
+	}	else {
+		free(ptr);
+	}
+}
+
+// redefine allocator, only before the first block is handed out: a block
+// from one allocator must never reach the other one's free
+int ikcp_allocator(void* (*new_malloc)(size_t), void (*new_free)(void*))
+{
+	if (__atomic_load_n(&ikcp_malloc_used, __ATOMIC_RELAXED) != 0)
+		return -1;
+	ikcp_malloc_hook = new_malloc;
+	ikcp_free_hook = new_free;
+	__atomic_store_n(&ikcp_malloc_used, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+// allocate a new kcp segment
+static IKCPSEG* ikcp_segment_new(ikcpcb *kcp, int size)
+{
+	IKCPSEG *seg = (IKCPSEG*)ikcp_malloc(sizeof(IKCPSEG) + size);
+	if (seg) {
+		seg->buf = NULL;
+		seg->fastpos = 0;
+	}
+	return seg;
+}
+
+// delete a segment
+static void ikcp_segment_delete(ikcpcb *kcp, IKCPSEG *seg)
+{
+	if (seg->buf) {
+		ikcp_buf_release(seg->buf);
+	}
+	ikcp_free(seg);
+}
+
+// where the payload of a segment lives
+static inline const char* ikcp_segment_payload(const IKCPSEG *seg)
+{
+	return seg->buf ? seg->buf->data + seg->bufofs : seg->data;
+}
+
+IKCPBUF* ikcp_buf_new(int len)
+{
+	IKCPBUF *buf;
+	if (len < 0) return NULL;
+	buf = (IKCPBUF*)ikcp_malloc(sizeof(IKCPBUF) + len);
+	if (buf) {
+		buf->refcnt = 1;
+		buf->len = len;
+	}
+	return buf;
+}
+
+void ikcp_buf_ref(IKCPBUF *buf)
+{
+	assert(buf);
+	__sync_add_and_fetch(&buf->refcnt, 1);
+}
+
+void ikcp_buf_release(IKCPBUF *buf)
+{
+	if (buf && __sync_sub_and_fetch(&buf->refcnt, 1) == 0) {
+		ikcp_free(buf);
+	}
+}
+
+// copy 'size' bytes off a scatter list, pieces with NULL data copy nothing
+static void ikcp_vec_read(char *dst, const IKCPVEC **vec, int *offset, int size)
+{
+	while (size > 0) {
+		int canread = (*vec)->len - *offset;
+		if (canread <= 0) {
+			(*vec)++;
+			*offset = 0;
+			continue;
+		}
+		if (canread > size) canread = size;
+		if ((*vec)->data) {
+			memcpy(dst, (*vec)->data + *offset, canread);
+		}
+		dst += canread;
+		*offset += canread;
+		size -= canread;
+	}
+}
+
+// write log
+void ikcp_log(ikcpcb *kcp, int mask, const char *fmt, ...)
+{
+	char buffer[1024];
+	va_list argptr;
+	if ((mask & kcp->logmask) == 0 || kcp->writelog == 0) return;
+	va_start(argptr, fmt);
+	vsprintf(buffer, fmt, argptr);
+	va_end(argptr);
+	kcp->writelog(buffer, kcp, kcp->user);
+}
+
+// check log mask
+static int ikcp_canlog(const ikcpcb *kcp, int mask)
+{
+	if ((mask & kcp->logmask) == 0 || kcp->writelog == NULL) return 0;
+	return 1;
+}
+
+// output segment
+static int ikcp_output(ikcpcb *kcp, const void *data, int size)
+{
+	assert(kcp);
+	assert(kcp->output);
+	if (ikcp_canlog(kcp, IKCP_LOG_OUTPUT)) {
+		ikcp_log(kcp, IKCP_LOG_OUTPUT, "[RO] %ld bytes", (long)size);
+	}
+	if (size == 0) return 0;
+	return kcp->output((const char*)data, size, kcp, kcp->user);
+}
+
+// output queue
+void ikcp_qprint(const char *name, const struct IQUEUEHEAD *head)
+{
+#if 0
+	const struct IQUEUEHEAD *p;
+	printf("<%s>: [", name);
+	for (p = head->next; p != head; p = p->next) {
+		const IKCPSEG *seg = iqueue_entry(p, const IKCPSEG, node);
+		printf("(%lu %d)", (unsigned long)seg->sn, (int)(seg->ts % 10000));
+		if (p->next != head) printf(",");
+	}
+	printf("]\n");
+#endif
+}
+
+
+//---------------------------------------------------------------------
+// create a new kcpcb
+//---------------------------------------------------------------------
+ikcpcb* ikcp_create(IUINT32 conv, void *user)
+{
+	ikcpcb *kcp = (ikcpcb*)ikcp_malloc(sizeof(struct IKCPCB));
+	if (kcp == NULL) return NULL;
+	kcp->conv = conv;
+	kcp->user = user;
+	kcp->snd_una = 0;
+	kcp->snd_nxt = 0;
+	kcp->rcv_nxt = 0;
+	kcp->ts_recent = 0;
+	kcp->ts_lastack = 0;
+	kcp->ts_probe = 0;
+	kcp->probe_wait = 0;
+	kcp->snd_wnd = IKCP_WND_SND;
+	kcp->rcv_wnd = IKCP_WND_RCV;
+	kcp->rmt_wnd = IKCP_WND_RCV;
+	kcp->cwnd = 0;
+	kcp->incr = 0;
+	kcp->probe = 0;
+	kcp->mtu = IKCP_MTU_DEF;
+	kcp->mss = kcp->mtu - IKCP_OVERHEAD;
+	kcp->stream = 0;
+
+	kcp->buffer = (char*)ikcp_malloc((kcp->mtu + IKCP_OVERHEAD) * 3);
+	if (kcp->buffer == NULL) {
+		ikcp_free(kcp);
+		return NULL;
+	}
+
+	iqueue_init(&kcp->snd_queue);
+	iqueue_init(&kcp->rcv_queue);
+	iqueue_init(&kcp->snd_buf);
+	iqueue_init(&kcp->rcv_buf);
+	kcp->nrcv_buf = 0;
+	kcp->nsnd_buf = 0;
+	kcp->nrcv_que = 0;
+	kcp->nsnd_que = 0;
+	kcp->state = 0;
+	kcp->acklist = NULL;
+	kcp->ackblock = 0;
+	kcp->ackcount = 0;
+	kcp->rx_srtt = 0;
+	kcp->rx_rttval = 0;
+	kcp->rx_rto = IKCP_RTO_DEF;
+	kcp->rx_minrto = IKCP_RTO_MIN;
+	kcp->current = 0;
+	kcp->interval = IKCP_INTERVAL;
+	kcp->ts_flush = IKCP_INTERVAL;
+	kcp->nodelay = 0;
+	kcp->updated = 0;
+	kcp->logmask = 0;
+	kcp->ssthresh = IKCP_THRESH_INIT;
+	kcp->fastresend = 0;
+	kcp->nocwnd = 0;
+	kcp->xmit = 0;
+    kcp->dead_link = IKCP_DEADLINK;
+	kcp->output = NULL;
+	kcp->writelog = NULL;
+	kcp->cc = &ikcp_cc_reno;
+	kcp->cc_state = NULL;
+	kcp->pacing_ts = 0;
+	kcp->pacing_tokens = 0;
+	kcp->sack = 0;
+	kcp->sack_adverts = 0;
+	kcp->snd_ring = NULL;
+	kcp->rcv_ring = NULL;
+	kcp->ring_mask = 0;
+	kcp->rto_heap = NULL;
+	kcp->rto_count = 0;
+	kcp->rto_block = 0;
+	kcp->fast_list = NULL;
+	kcp->fast_count = 0;
+	kcp->fast_block = 0;
+	kcp->pmtu_min = 0;
+	kcp->pmtu_max = 0;
+	kcp->pmtu_hi = 0;
+	kcp->pmtu_probe = 0;
+	kcp->pmtu_tries = 0;
+	kcp->ts_pmtu = 0;
+	kcp->pmtu_ack = 0;
+	kcp->pmtu_check = 0;
+	kcp->rcv_part = NULL;
+	kcp->rcv_part_len = 0;
+
+	return kcp;
+}
+
+
+//---------------------------------------------------------------------
+// release a new kcpcb
+//---------------------------------------------------------------------
+void ikcp_release(ikcpcb *kcp)
+{
+	assert(kcp);
+	if (kcp) {
+		IKCPSEG *seg;
+		while (!iqueue_is_empty(&kcp->snd_buf)) {
+			seg = iqueue_entry(kcp->snd_buf.next, IKCPSEG, node);
+			iqueue_del(&seg->node);
+			ikcp_segment_delete(kcp, seg);
+		}
+		while (!iqueue_is_empty(&kcp->rcv_buf)) {
+			seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
+			iqueue_del(&seg->node);
+			ikcp_segment_delete(kcp, seg);
+		}
+		while (!iqueue_is_empty(&kcp->snd_queue)) {
+			seg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
+			iqueue_del(&seg->node);
+			ikcp_segment_delete(kcp, seg);
+		}
+		while (!iqueue_is_empty(&kcp->rcv_queue)) {
+			seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+			iqueue_del(&seg->node);
+			ikcp_segment_delete(kcp, seg);
+		}
+		if (kcp->buffer) {
+			ikcp_free(kcp->buffer);
+		}
+		if (kcp->acklist) {
+			ikcp_free(kcp->acklist);
+		}
+		if (kcp->cc->release) {
+			kcp->cc->release(kcp);
+		}
+		if (kcp->snd_ring) {
+			ikcp_free(kcp->snd_ring);
+		}
+		if (kcp->rto_heap) {
+			ikcp_free(kcp->rto_heap);
+		}
+		if (kcp->fast_list) {
+			ikcp_free(kcp->fast_list);
+		}
+		if (kcp->rcv_part) {
+			ikcp_segment_delete(kcp, kcp->rcv_part);
+		}
+
+		kcp->nrcv_buf = 0;
+		kcp->nsnd_buf = 0;
+		kcp->nrcv_que = 0;
+		kcp->nsnd_que = 0;
+		kcp->ackcount = 0;
+		kcp->buffer = NULL;
+		kcp->acklist = NULL;
+		ikcp_free(kcp);
+	}
+}
+
+
+//---------------------------------------------------------------------
+// set output callback, which will be invoked by kcp
+//---------------------------------------------------------------------
+void ikcp_setoutput(ikcpcb *kcp, int (*output)(const char *buf, int len,
+	ikcpcb *kcp, void *user))
+{
+	kcp->output = output;
+}
+
+
+//---------------------------------------------------------------------
+// user/upper level recv: returns size, returns below zero for EAGAIN
+//---------------------------------------------------------------------
+int ikcp_recv(ikcpcb *kcp, char *buffer, int len)
+{
+	struct IQUEUEHEAD *p;
+	int ispeek = (len < 0)? 1 : 0;
+	int peeksize;
+	int recover = 0;
+	IKCPSEG *seg;
+	assert(kcp);
+
+	if (iqueue_is_empty(&kcp->rcv_queue))
+		return -1;
+
+	if (len < 0) len = -len;
+
+	peeksize = ikcp_peeksize(kcp);
+
+	if (peeksize < 0) 
+		return -2;
+
+	if (peeksize > len) 
+		return -3;
+
+	if (kcp->nrcv_que >= kcp->rcv_wnd)
+		recover = 1;
+
+	// merge fragment
+	for (len = 0, p = kcp->rcv_queue.next; p != &kcp->rcv_queue; ) {
+		int fragment;
+		seg = iqueue_entry(p, IKCPSEG, node);
+		p = p->next;
+
+		if (buffer) {
+			memcpy(buffer, seg->data, seg->len);
+			buffer += seg->len;
+		}
+
+		len += seg->len;
+		fragment = seg->frg;
+
+		if (ikcp_canlog(kcp, IKCP_LOG_RECV)) {
+			ikcp_log(kcp, IKCP_LOG_RECV, "recv sn=%lu", seg->sn);
+		}
+
+		if (ispeek == 0) {
+			iqueue_del(&seg->node);
+			ikcp_segment_delete(kcp, seg);
+			kcp->nrcv_que--;
+		}
+
+		if (fragment == 0) 
+			break;
+	}
+
+	assert(len == peeksize);
+
+	// move available data from rcv_buf -> rcv_queue
+	while (! iqueue_is_empty(&kcp->rcv_buf)) {
+		IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
+		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
+			if (kcp->rcv_ring) {
+				kcp->rcv_ring[seg->sn & kcp->ring_mask] = NULL;
+			}
+			iqueue_del(&seg->node);
+			kcp->nrcv_buf--;
+			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
+			kcp->nrcv_que++;
+			kcp->rcv_nxt++;
+		}	else {
+			break;
+		}
+	}
+
+	// fast recover
+	if (kcp->nrcv_que < kcp->rcv_wnd && recover) {
+		// ready to send back IKCP_CMD_WINS in ikcp_flush
+		// tell remote my window size
+		kcp->probe |= IKCP_ASK_TELL;
+	}
+
+	return len;
+}
+
+
+//---------------------------------------------------------------------
+// peek data size
+//---------------------------------------------------------------------
+int ikcp_peeksize(const ikcpcb *kcp)
+{
+	struct IQUEUEHEAD *p;
+	IKCPSEG *seg;
+	int length = 0;
+
+	assert(kcp);
+
+	if (iqueue_is_empty(&kcp->rcv_queue)) return -1;
+
+	seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+	if (seg->frg == 0) return seg->len;
+
+	if (kcp->nrcv_que < seg->frg + 1) return -1;
+
+	for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue; p = p->next) {
+		seg = iqueue_entry(p, IKCPSEG, node);
+		length += seg->len;
+		if (seg->frg == 0) break;
+	}
+
+	return length;
+}
+
+
+//---------------------------------------------------------------------
+// peek fragments of next message without copying
+//---------------------------------------------------------------------
+int ikcp_peekv(const ikcpcb *kcp, IKCPVEC *vec, int count)
+{
+	struct IQUEUEHEAD *p;
+	IKCPSEG *seg;
+	int n = 0;
+
+	assert(kcp);
+
+	if (iqueue_is_empty(&kcp->rcv_queue)) return -1;
+
+	seg = iqueue_entry(kcp->rcv_queue.next, IKCPSEG, node);
+	if (kcp->nrcv_que < seg->frg + 1) return -1;
+
+	for (p = kcp->rcv_queue.next; p != &kcp->rcv_queue; p = p->next) {
+		seg = iqueue_entry(p, IKCPSEG, node);
+		if (n < count) {
+			vec[n].data = seg->data;
+			vec[n].len = (int)seg->len;
+		}
+		n++;
+		if (seg->frg == 0) break;
+	}
+
+	return n;
+}
+
+
+//---------------------------------------------------------------------
+// user/upper level send, returns below zero for error
+//---------------------------------------------------------------------
+int ikcp_send(ikcpcb *kcp, const char *buffer, int len)
+{
+	IKCPVEC vec;
+	if (len < 0) return -1;
+	vec.data = buffer;
+	vec.len = len;
+	return ikcp_sendv(kcp, &vec, 1);
+}
+
+
+//---------------------------------------------------------------------
+// gather send, one message out of several pieces
+//---------------------------------------------------------------------
+int ikcp_sendv(ikcpcb *kcp, const IKCPVEC *vec, int count)
+{
+	IKCPSEG *seg;
+	int len = 0, offset = 0, i;
+
+	assert(kcp->mss > 0);
+	for (i = 0; i < count; i++) {
+		if (vec[i].len < 0) return -1;
+		len += vec[i].len;
+	}
+
+	// append to previous segment in streaming mode (if possible)
+	if (kcp->stream != 0) {
+		if (!iqueue_is_empty(&kcp->snd_queue)) {
+			IKCPSEG *old = iqueue_entry(kcp->snd_queue.prev, IKCPSEG, node);
+			if (old->len < kcp->mss && old->buf == NULL) {
+				int capacity = kcp->mss - old->len;
+				int extend = (len < capacity)? len : capacity;
+				seg = ikcp_segment_new(kcp, old->len + extend);
+				assert(seg);
+				if (seg == NULL) {
+					return -2;
+				}
+				iqueue_add_tail(&seg->node, &kcp->snd_queue);
+				memcpy(seg->data, old->data, old->len);
+				ikcp_vec_read(seg->data + old->len, &vec, &offset, extend);
+				seg->len = old->len + extend;
+				seg->frg = 0;
+				len -= extend;
+				iqueue_del_init(&old->node);
+				ikcp_segment_delete(kcp, old);
+			}
+		}
+		if (len <= 0) {
+			return 0;
+		}
+	}
+
+	if (len <= (int)kcp->mss) count = 1;
+	else count = (len + kcp->mss - 1) / kcp->mss;
+
+	if (count > 255) return -2;
+
+	if (count == 0) count = 1;
+
+	// fragment
+	for (i = 0; i < count; i++) {
+		int size = len > (int)kcp->mss ? (int)kcp->mss : len;
+		seg = ikcp_segment_new(kcp, size);
+		assert(seg);
+		if (seg == NULL) {
+			return -2;
+		}
+		ikcp_vec_read(seg->data, &vec, &offset, size);
+		seg->len = size;
+		seg->frg = (kcp->stream == 0)? (count - i - 1) : 0;
+		iqueue_init(&seg->node);
+		iqueue_add_tail(&seg->node, &kcp->snd_queue);
+		kcp->nsnd_que++;
+		len -= size;
+	}
+
+	return 0;
+}
+
+
+//---------------------------------------------------------------------
+// send a shared buffer, segments reference it
+//---------------------------------------------------------------------
+int ikcp_sendbuf(ikcpcb *kcp, IKCPBUF *buf)
+{
+	IKCPSEG *seg;
+	int len, count, i, offset = 0;
+
+	assert(kcp->mss > 0);
+	assert(buf);
+	len = buf->len;
+
+	if (len <= (int)kcp->mss) count = 1;
+	else count = (len + kcp->mss - 1) / kcp->mss;
+
+	if (count > 255) return -2;
+
+	if (count == 0) count = 1;
+
+	// fragment, never merged with other segments even in stream mode
+	for (i = 0; i < count; i++) {
+		int size = len > (int)kcp->mss ? (int)kcp->mss : len;
+		seg = ikcp_segment_new(kcp, 0);
+		assert(seg);
+		if (seg == NULL) {
+			return -2;
+		}
+		ikcp_buf_ref(buf);
+		seg->buf = buf;
+		seg->bufofs = offset;
+		seg->len = size;
+		seg->frg = (kcp->stream == 0)? (count - i - 1) : 0;
+		iqueue_init(&seg->node);
+		iqueue_add_tail(&seg->node, &kcp->snd_queue);
+		kcp->nsnd_que++;
+		offset += size;
+		len -= size;
+	}
+
+	return 0;
+}
+
+
+//---------------------------------------------------------------------
+// parse ack
+//---------------------------------------------------------------------
+static void ikcp_update_ack(ikcpcb *kcp, IINT32 rtt)
+{
+	IINT32 rto = 0;
+	if (kcp->rx_srtt == 0) {
+		kcp->rx_srtt = rtt;
+		kcp->rx_rttval = rtt / 2;
+	}	else {
+		long delta = rtt - kcp->rx_srtt;
+		if (delta < 0) delta = -delta;
+		kcp->rx_rttval = (3 * kcp->rx_rttval + delta) / 4;
+		kcp->rx_srtt = (7 * kcp->rx_srtt + rtt) / 8;
+		if (kcp->rx_srtt < 1) kcp->rx_srtt = 1;
+	}
+	rto = kcp->rx_srtt + _imax_(1, 4 * kcp->rx_rttval);
+	kcp->rx_rto = _ibound_(kcp->rx_minrto, rto, IKCP_RTO_MAX);
+}
+
+static void ikcp_shrink_buf(ikcpcb *kcp)
+{
+	struct IQUEUEHEAD *p = kcp->snd_buf.next;
+	if (p != &kcp->snd_buf) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		kcp->snd_una = seg->sn;
+	}	else {
+		kcp->snd_una = kcp->snd_nxt;
+	}
+}
+
+//---------------------------------------------------------------------
+// retransmit index: every segment of snd_buf sits in a min-heap on
+// (resendts, sn), segments with enough fast acks also in fast_list,
+// so flush and check only touch what is due
+//---------------------------------------------------------------------
+static void ikcp_seg_grow(IKCPSEG ***array, IUINT32 *block, IUINT32 count)
+{
+	IKCPSEG **grown;
+	IUINT32 newblock;
+
+	if (count < *block) return;
+
+	for (newblock = 16; newblock <= count; newblock <<= 1);
+	grown = (IKCPSEG**)ikcp_malloc(newblock * sizeof(IKCPSEG*));
+
+	if (grown == NULL) {
+		assert(grown != NULL);
+		abort();
+	}
+
+	if (*array != NULL) {
+		memcpy(grown, *array, count * sizeof(IKCPSEG*));
+		ikcp_free(*array);
+	}
+
+	*array = grown;
+	*block = newblock;
+}
+
+static inline int ikcp_rto_before(const IKCPSEG *a, const IKCPSEG *b)
+{
+	IINT32 diff = _itimediff(a->resendts, b->resendts);
+	return diff < 0 || (diff == 0 && _itimediff(a->sn, b->sn) < 0);
+}
+
+static inline void ikcp_rto_place(ikcpcb *kcp, IKCPSEG *seg, IUINT32 pos)
+{
+	kcp->rto_heap[pos] = seg;
+	seg->heappos = pos;
+}
+
+static void ikcp_rto_fix(ikcpcb *kcp, IKCPSEG *seg)
+{
+	IKCPSEG **heap = kcp->rto_heap;
+	IUINT32 pos = seg->heappos;
+
+	while (pos > 0 && ikcp_rto_before(seg, heap[(pos - 1) / 2])) {
+		ikcp_rto_place(kcp, heap[(pos - 1) / 2], pos);
+		pos = (pos - 1) / 2;
+	}
+	for (;;) {
+		IUINT32 child = pos * 2 + 1;
+		if (child >= kcp->rto_count) break;
+		if (child + 1 < kcp->rto_count && 
+			ikcp_rto_before(heap[child + 1], heap[child])) {
+			child++;
+		}
+		if (!ikcp_rto_before(heap[child], seg)) break;
+		ikcp_rto_place(kcp, heap[child], pos);
+		pos = child;
+	}
+	ikcp_rto_place(kcp, seg, pos);
+}
+
+static void ikcp_rto_push(ikcpcb *kcp, IKCPSEG *seg)
+{
+	ikcp_seg_grow(&kcp->rto_heap, &kcp->rto_block, kcp->rto_count);
+	ikcp_rto_place(kcp, seg, kcp->rto_count++);
+	ikcp_rto_fix(kcp, seg);
+}
+
+static void ikcp_rto_remove(ikcpcb *kcp, IKCPSEG *seg)
+{
+	IKCPSEG *last = kcp->rto_heap[--kcp->rto_count];
+	if (last != seg) {
+		ikcp_rto_place(kcp, last, seg->heappos);
+		ikcp_rto_fix(kcp, last);
+	}
+}
+
+// called after each fast ack, lists the segment once it reaches resend
+static void ikcp_fast_mark(ikcpcb *kcp, IKCPSEG *seg)
+{
+	if (seg->fastpos != 0 || kcp->fastresend <= 0 || 
+		seg->fastack < (IUINT32)kcp->fastresend) {
+		return;
+	}
+	ikcp_seg_grow(&kcp->fast_list, &kcp->fast_block, kcp->fast_count);
+	kcp->fast_list[kcp->fast_count++] = seg;
+	seg->fastpos = kcp->fast_count;
+}
+
+static void ikcp_fast_remove(ikcpcb *kcp, IKCPSEG *seg)
+{
+	IKCPSEG *last = kcp->fast_list[--kcp->fast_count];
+	if (last != seg) {
+		kcp->fast_list[seg->fastpos - 1] = last;
+		last->fastpos = seg->fastpos;
+	}
+	seg->fastpos = 0;
+}
+
+static void ikcp_snd_drop(ikcpcb *kcp, IKCPSEG *seg)
+{
+	if (kcp->snd_ring) {
+		kcp->snd_ring[seg->sn & kcp->ring_mask] = NULL;
+	}
+	if (seg->fastpos) {
+		ikcp_fast_remove(kcp, seg);
+	}
+	ikcp_rto_remove(kcp, seg);
+	iqueue_del(&seg->node);
+	ikcp_segment_delete(kcp, seg);
+	kcp->nsnd_buf--;
+}
+
+static void ikcp_parse_ack(ikcpcb *kcp, IUINT32 sn)
+{
+	struct IQUEUEHEAD *p, *next;
+
+	if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
+		return;
+
+	if (kcp->snd_ring) {
+		IKCPSEG *seg = kcp->snd_ring[sn & kcp->ring_mask];
+		if (seg != NULL && seg->sn == sn) {
+			ikcp_snd_drop(kcp, seg);
+		}
+		return;
+	}
+
+	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		next = p->next;
+		if (sn == seg->sn) {
+			ikcp_snd_drop(kcp, seg);
+			break;
+		}
+		if (_itimediff(sn, seg->sn) < 0) {
+			break;
+		}
+	}
+}
+
+static void ikcp_parse_una(ikcpcb *kcp, IUINT32 una)
+{
+	struct IQUEUEHEAD *p, *next;
+	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		next = p->next;
+		if (_itimediff(una, seg->sn) > 0) {
+			ikcp_snd_drop(kcp, seg);
+		}	else {
+			break;
+		}
+	}
+}
+
+// one pass over snd_buf: drop what the bitmap acks, count a fast ack
+// for the rest below maxack
+static void ikcp_parse_sack(ikcpcb *kcp, IUINT32 base, IUINT32 maxack, 
+	const char *bitmap, IUINT32 len)
+{
+	struct IQUEUEHEAD *p, *next;
+	IUINT32 bits = len * 8;
+	int fast = _itimediff(maxack, kcp->snd_una) >= 0 && 
+		_itimediff(maxack, kcp->snd_nxt) < 0;
+
+	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		IUINT32 offset = seg->sn - base;
+		next = p->next;
+		if (offset < bits && (bitmap[offset >> 3] & (1 << (offset & 7)))) {
+			ikcp_snd_drop(kcp, seg);
+		}
+		else if (fast && _itimediff(maxack, seg->sn) > 0) {
+			seg->fastack++;
+			ikcp_fast_mark(kcp, seg);
+		}
+		else if (offset >= bits) {
+			break;
+		}
+	}
+}
+
+static void ikcp_parse_fastack(ikcpcb *kcp, IUINT32 sn)
+{
+	struct IQUEUEHEAD *p, *next;
+
+	if (_itimediff(sn, kcp->snd_una) < 0 || _itimediff(sn, kcp->snd_nxt) >= 0)
+		return;
+
+	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = next) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		next = p->next;
+		if (_itimediff(sn, seg->sn) < 0) {
+			break;
+		}
+		else if (sn != seg->sn) {
+			seg->fastack++;
+			ikcp_fast_mark(kcp, seg);
+		}
+	}
+}
+
+
+//---------------------------------------------------------------------
+// ack append
+//---------------------------------------------------------------------
+static void ikcp_ack_push(ikcpcb *kcp, IUINT32 sn, IUINT32 ts)
+{
+	size_t newsize = kcp->ackcount + 1;
+	IUINT32 *ptr;
+
+	if (newsize > kcp->ackblock) {
+		IUINT32 *acklist;
+		size_t newblock;
+
+		for (newblock = 8; newblock < newsize; newblock <<= 1);
+		acklist = (IUINT32*)ikcp_malloc(newblock * sizeof(IUINT32) * 2);
+
+		if (acklist == NULL) {
+			assert(acklist != NULL);
+			abort();
+		}
+
+		if (kcp->acklist != NULL) {
+			size_t x;
+			for (x = 0; x < kcp->ackcount; x++) {
+				acklist[x * 2 + 0] = kcp->acklist[x * 2 + 0];
+				acklist[x * 2 + 1] = kcp->acklist[x * 2 + 1];
+			}
+			ikcp_free(kcp->acklist);
+		}
+
+		kcp->acklist = acklist;
+		kcp->ackblock = newblock;
+	}
+
+	ptr = &kcp->acklist[kcp->ackcount * 2];
+	ptr[0] = sn;
+	ptr[1] = ts;
+	kcp->ackcount++;
+}
+
+static void ikcp_ack_get(const ikcpcb *kcp, int p, IUINT32 *sn, IUINT32 *ts)
+{
+	if (sn) sn[0] = kcp->acklist[p * 2 + 0];
+	if (ts) ts[0] = kcp->acklist[p * 2 + 1];
+}
+
+
+//---------------------------------------------------------------------
+// parse data
+//---------------------------------------------------------------------
+void ikcp_parse_data(ikcpcb *kcp, IKCPSEG *newseg)
+{
+	struct IQUEUEHEAD *p, *prev;
+	IUINT32 sn = newseg->sn;
+	int repeat = 0;
+	
+	if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) >= 0 ||
+		_itimediff(sn, kcp->rcv_nxt) < 0) {
+		ikcp_segment_delete(kcp, newseg);
+		return;
+	}
+
+	if (kcp->rcv_ring) {
+		// the slot tells duplicates apart, the predecessor is usually the
+		// tail, otherwise the nearest occupied slot below sn
+		p = kcp->rcv_buf.prev;
+		if (kcp->rcv_ring[sn & kcp->ring_mask] != NULL) {
+			repeat = 1;
+		}
+		else if (p != &kcp->rcv_buf && 
+			_itimediff(sn, iqueue_entry(p, IKCPSEG, node)->sn) < 0) {
+			IUINT32 x;
+			p = &kcp->rcv_buf;
+			for (x = sn - 1; _itimediff(x, kcp->rcv_nxt) >= 0; x--) {
+				IKCPSEG *seg = kcp->rcv_ring[x & kcp->ring_mask];
+				if (seg != NULL) {
+					p = &seg->node;
+					break;
+				}
+			}
+		}
+	}
+	else {
+		for (p = kcp->rcv_buf.prev; p != &kcp->rcv_buf; p = prev) {
+			IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+			prev = p->prev;
+			if (seg->sn == sn) {
+				repeat = 1;
+				break;
+			}
+			if (_itimediff(sn, seg->sn) > 0) {
+				break;
+			}
+		}
+	}
+
+	if (repeat == 0) {
+		iqueue_init(&newseg->node);
+		iqueue_add(&newseg->node, p);
+		kcp->nrcv_buf++;
+		if (kcp->rcv_ring) {
+			kcp->rcv_ring[sn & kcp->ring_mask] = newseg;
+		}
+	}	else {
+		ikcp_segment_delete(kcp, newseg);
+	}
+
+#if 0
+	ikcp_qprint("rcvbuf", &kcp->rcv_buf);
+	printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
+#endif
+
+	// move available data from rcv_buf -> rcv_queue
+	while (! iqueue_is_empty(&kcp->rcv_buf)) {
+		IKCPSEG *seg = iqueue_entry(kcp->rcv_buf.next, IKCPSEG, node);
+		if (seg->sn == kcp->rcv_nxt && kcp->nrcv_que < kcp->rcv_wnd) {
+			if (kcp->rcv_ring) {
+				kcp->rcv_ring[seg->sn & kcp->ring_mask] = NULL;
+			}
+			iqueue_del(&seg->node);
+			kcp->nrcv_buf--;
+			iqueue_add_tail(&seg->node, &kcp->rcv_queue);
+			kcp->nrcv_que++;
+			kcp->rcv_nxt++;
+		}	else {
+			break;
+		}
+	}
+
+#if 0
+	ikcp_qprint("queue", &kcp->rcv_queue);
+	printf("rcv_nxt=%lu\n", kcp->rcv_nxt);
+#endif
+
+#if 1
+//	printf("snd(buf=%d, queue=%d)\n", kcp->nsnd_buf, kcp->nsnd_que);
+//	printf("rcv(buf=%d, queue=%d)\n", kcp->nrcv_buf, kcp->nrcv_que);
+#endif
+}
+
+
+//---------------------------------------------------------------------
+// path mtu: the peer got a probe of 'size' bytes. one of the mtu itself
+// ends a check, the timeouts behind it were plain loss
+//---------------------------------------------------------------------
+static void ikcp_pmtu_confirm(ikcpcb *kcp, IUINT32 size)
+{
+	if (kcp->pmtu_min == 0 || size < kcp->mtu || size > kcp->pmtu_hi) 
+		return;
+	if (size == kcp->mtu && kcp->pmtu_check == 0) 
+		return;
+	kcp->mtu = size;
+	kcp->mss = size - IKCP_OVERHEAD;
+	if (size == kcp->pmtu_probe || kcp->pmtu_check) {
+		kcp->pmtu_check = 0;
+		kcp->pmtu_probe = 0;
+		kcp->pmtu_tries = 0;
+		kcp->ts_pmtu = kcp->current;
+	}
+}
+
+
+//---------------------------------------------------------------------
+// gather the IKCP_CMD_PART pieces of one segment, which come in order.
+// returns the segment once whole, a piece of another one starts over
+//---------------------------------------------------------------------
+static IKCPSEG *ikcp_parse_part(ikcpcb *kcp, IUINT32 sn, const char *data, 
+	IUINT32 len)
+{
+	IKCPSEG *seg = kcp->rcv_part;
+	IUINT32 offset, total;
+
+	if (len < IKCP_PART_HEAD) return NULL;
+	data = ikcp_decode32u(data, &offset);
+	data = ikcp_decode32u(data, &total);
+	len -= IKCP_PART_HEAD;
+	if (total > IKCP_PART_MAX || offset > total || len > total - offset) 
+		return NULL;
+
+	if (seg != NULL && (seg->sn != sn || seg->len != total)) {
+		ikcp_segment_delete(kcp, seg);
+		seg = kcp->rcv_part = NULL;
+	}
+	if (seg == NULL) {
+		if (offset != 0) return NULL;
+		seg = ikcp_segment_new(kcp, total);
+		if (seg == NULL) return NULL;
+		seg->sn = sn;
+		seg->len = total;
+		kcp->rcv_part = seg;
+		kcp->rcv_part_len = 0;
+	}
+
+	// a piece past a gap waits for the resend
+	if (offset > kcp->rcv_part_len) return NULL;
+	memcpy(seg->data + offset, data, len);
+	if (offset + len > kcp->rcv_part_len) {
+		kcp->rcv_part_len = offset + len;
+	}
+	if (kcp->rcv_part_len < total) return NULL;
+
+	kcp->rcv_part = NULL;
+	return seg;
+}
+
+
+//---------------------------------------------------------------------
+// check conv, cmd and len of every segment in a datagram before any of
+// it is applied, returns the segment count or the ikcp_input error
+//---------------------------------------------------------------------
+static long ikcp_input_check(const ikcpcb *kcp, const char *data, long size)
+{
+	long count = 0;
+
+	while (size >= (long)IKCP_OVERHEAD) {
+		IUINT32 conv, len;
+		IUINT8 cmd;
+
+		ikcp_decode32u(data, &conv);
+		ikcp_decode8u(data + 4, &cmd);
+		ikcp_decode32u(data + 20, &len);
+		data += IKCP_OVERHEAD;
+		size -= IKCP_OVERHEAD;
+
+		if (conv != kcp->conv) return -1;
+		if (size < (long)len) return -2;
+		if (cmd < IKCP_CMD_PUSH || cmd > IKCP_CMD_PART) return -3;
+
+		data += len;
+		size -= len;
+		count++;
+	}
+
+	return count;
+}
+
+
+//---------------------------------------------------------------------
+// input data
+//---------------------------------------------------------------------
+int ikcp_input(ikcpcb *kcp, const char *data, long size)
+{
+	IUINT32 una = kcp->snd_una;
+	IUINT32 nsnd_buf = kcp->nsnd_buf;
+	IUINT32 maxack = 0;
+	IINT32 rtt = -1;
+	int flag = 0;
+	IUINT32 prev_una = 0;
+	long count, index;
+
+	if (ikcp_canlog(kcp, IKCP_LOG_INPUT)) {
+		ikcp_log(kcp, IKCP_LOG_INPUT, "[RI] %d bytes", size);
+	}
+
+	if (data == NULL || size < 24) return -1;
+
+	// a bad segment rejects the whole datagram, none of it half applied
+	count = ikcp_input_check(kcp, data, size);
+	if (count < 0) return (int)count;
+
+	for (index = 0; index < count; index++) {
+		IUINT32 ts, sn, len, una, conv;
+		IUINT16 wnd;
+		IUINT8 cmd, frg;
+		IKCPSEG *seg;
+
+		data = ikcp_decode32u(data, &conv);
+		data = ikcp_decode8u(data, &cmd);
+		data = ikcp_decode8u(data, &frg);
+		data = ikcp_decode16u(data, &wnd);
+		data = ikcp_decode32u(data, &ts);
+		data = ikcp_decode32u(data, &sn);
+		data = ikcp_decode32u(data, &una);
+		data = ikcp_decode32u(data, &len);
+
+		kcp->rmt_wnd = wnd;
+
+		// segments from one flush carry the same una, apply it once
+		if (index == 0 || una != prev_una) {
+			ikcp_parse_una(kcp, una);
+			ikcp_shrink_buf(kcp);
+			prev_una = una;
+		}
+
+		if (cmd == IKCP_CMD_ACK) {
+			if (_itimediff(kcp->current, ts) >= 0) {
+				rtt = _itimediff(kcp->current, ts);
+				ikcp_update_ack(kcp, rtt);
+			}
+			ikcp_parse_ack(kcp, sn);
+			ikcp_shrink_buf(kcp);
+			if (flag == 0) {
+				flag = 1;
+				maxack = sn;
+			}	else {
+				if (_itimediff(sn, maxack) > 0) {
+					maxack = sn;
+				}
+			}
+			if (ikcp_canlog(kcp, IKCP_LOG_IN_ACK)) {
+				ikcp_log(kcp, IKCP_LOG_IN_DATA, 
+					"input ack: sn=%lu rtt=%ld rto=%ld", sn, 
+					(long)_itimediff(kcp->current, ts),
+					(long)kcp->rx_rto);
+			}
+		}
+		else if (cmd == IKCP_CMD_PUSH) {
+			if (ikcp_canlog(kcp, IKCP_LOG_IN_DATA)) {
+				ikcp_log(kcp, IKCP_LOG_IN_DATA, 
+					"input psh: sn=%lu ts=%lu", sn, ts);
+			}
+			if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0) {
+				ikcp_ack_push(kcp, sn, ts);
+				if (_itimediff(sn, kcp->rcv_nxt) >= 0) {
+					seg = ikcp_segment_new(kcp, len);
+					seg->conv = conv;
+					seg->cmd = cmd;
+					seg->frg = frg;
+					seg->wnd = wnd;
+					seg->ts = ts;
+					seg->sn = sn;
+					seg->una = una;
+					seg->len = len;
+
+					if (len > 0) {
+						memcpy(seg->data, data, len);
+					}
+
+					ikcp_parse_data(kcp, seg);
+				}
+			}
+		}
+		else if (cmd == IKCP_CMD_PART) {
+			if (ikcp_canlog(kcp, IKCP_LOG_IN_DATA)) {
+				ikcp_log(kcp, IKCP_LOG_IN_DATA, 
+					"input part: sn=%lu ts=%lu", sn, ts);
+			}
+			if (_itimediff(sn, kcp->rcv_nxt + kcp->rcv_wnd) < 0) {
+				// acked once whole, or when it was delivered before
+				if (_itimediff(sn, kcp->rcv_nxt) < 0) {
+					ikcp_ack_push(kcp, sn, ts);
+				}
+				else if ((seg = ikcp_parse_part(kcp, sn, data, len)) != NULL) {
+					ikcp_ack_push(kcp, sn, ts);
+					seg->conv = conv;
+					seg->cmd = IKCP_CMD_PUSH;
+					seg->frg = frg;
+					seg->wnd = wnd;
+					seg->ts = ts;
+					seg->una = una;
+					ikcp_parse_data(kcp, seg);
+				}
+			}
+		}
+		else if (cmd == IKCP_CMD_WASK) {
+			if (frg == IKCP_PMTU_PROBE) {
+				// padded to sn bytes, confirm the size once it arrived whole
+				if (sn == len + IKCP_OVERHEAD && sn > kcp->pmtu_ack) {
+					kcp->pmtu_ack = sn;
+				}
+			}	else {
+				// ready to send back IKCP_CMD_WINS in ikcp_flush
+				// tell remote my window size
+				kcp->probe |= IKCP_ASK_TELL;
+			}
+			if (ikcp_canlog(kcp, IKCP_LOG_IN_PROBE)) {
+				ikcp_log(kcp, IKCP_LOG_IN_PROBE, "input probe");
+			}
+		}
+		else if (cmd == IKCP_CMD_WINS) {
+			if (frg == IKCP_SACK_ADVERT) {
+				kcp->sack |= IKCP_SACK_PEER;
+			}
+			else if (frg == IKCP_PMTU_ACK) {
+				ikcp_pmtu_confirm(kcp, sn);
+			}
+			if (ikcp_canlog(kcp, IKCP_LOG_IN_WINS)) {
+				ikcp_log(kcp, IKCP_LOG_IN_WINS,
+					"input wins: %lu", (IUINT32)(wnd));
+			}
+		}
+		else if (cmd == IKCP_CMD_SACK) {
+			kcp->sack |= IKCP_SACK_PEER;
+			if (_itimediff(kcp->current, ts) >= 0) {
+				rtt = _itimediff(kcp->current, ts);
+				ikcp_update_ack(kcp, rtt);
+			}
+			ikcp_parse_sack(kcp, una, sn, data, len);
+			ikcp_shrink_buf(kcp);
+			if (ikcp_canlog(kcp, IKCP_LOG_IN_ACK)) {
+				ikcp_log(kcp, IKCP_LOG_IN_ACK, 
+					"input sack: una=%lu maxack=%lu bitmap=%lu", una, sn, len);
+			}
+		}
+
+		data += len;
+	}
+
+	if (flag != 0) {
+		ikcp_parse_fastack(kcp, maxack);
+	}
+
+	if (kcp->cc->on_ack && (kcp->nsnd_buf != nsnd_buf || 
+		_itimediff(kcp->snd_una, una) > 0)) {
+		kcp->cc->on_ack(kcp, una, nsnd_buf - kcp->nsnd_buf, rtt);
+	}
+
+	return 0;
+}
+
+
+//---------------------------------------------------------------------
+// ikcp_encode_seg
+//---------------------------------------------------------------------
+static char *ikcp_encode_seg(char *ptr, const IKCPSEG *seg)
+{
+	ptr = ikcp_encode32u(ptr, seg->conv);
+	ptr = ikcp_encode8u(ptr, (IUINT8)seg->cmd);
+	ptr = ikcp_encode8u(ptr, (IUINT8)seg->frg);
+	ptr = ikcp_encode16u(ptr, (IUINT16)seg->wnd);
+	ptr = ikcp_encode32u(ptr, seg->ts);
+	ptr = ikcp_encode32u(ptr, seg->sn);
+	ptr = ikcp_encode32u(ptr, seg->una);
+	ptr = ikcp_encode32u(ptr, seg->len);
+	return ptr;
+}
+
+//---------------------------------------------------------------------
+// ikcp_flush_sack: one SACK for the whole acklist, the bitmap starts at
+// rcv_nxt (the una field) and marks what rcv_buf already holds
+//---------------------------------------------------------------------
+static char *ikcp_flush_sack(ikcpcb *kcp, char *ptr, IKCPSEG *seg)
+{
+	char *buffer = kcp->buffer;
+	IUINT32 nbits = 0, nbytes, maxbits, i;
+	struct IQUEUEHEAD *p;
+	int size;
+
+	// the newest ack echoes its ts for rtt and drives the fast acks
+	ikcp_ack_get(kcp, 0, &seg->sn, &seg->ts);
+	for (i = 1; i < kcp->ackcount; i++) {
+		IUINT32 sn, ts;
+		ikcp_ack_get(kcp, i, &sn, &ts);
+		if (_itimediff(sn, seg->sn) > 0) {
+			seg->sn = sn;
+			seg->ts = ts;
+		}
+	}
+
+	maxbits = _imin_(kcp->rcv_wnd, (kcp->mtu - IKCP_OVERHEAD) * 8);
+	if (!iqueue_is_empty(&kcp->rcv_buf)) {
+		IKCPSEG *last = iqueue_entry(kcp->rcv_buf.prev, IKCPSEG, node);
+		nbits = _imin_(last->sn - kcp->rcv_nxt + 1, maxbits);
+	}
+	nbytes = (nbits + 7) / 8;
+
+	size = (int)(ptr - buffer);
+	if (size + (int)(IKCP_OVERHEAD + nbytes) > (int)kcp->mtu) {
+		ikcp_output(kcp, buffer, size);
+		ptr = buffer;
+	}
+
+	seg->cmd = IKCP_CMD_SACK;
+	seg->len = nbytes;
+	ptr = ikcp_encode_seg(ptr, seg);
+	memset(ptr, 0, nbytes);
+	for (p = kcp->rcv_buf.next; p != &kcp->rcv_buf; p = p->next) {
+		IKCPSEG *rcv = iqueue_entry(p, IKCPSEG, node);
+		IUINT32 offset = rcv->sn - kcp->rcv_nxt;
+		if (offset >= nbits) break;
+		ptr[offset >> 3] |= (char)(1 << (offset & 7));
+	}
+	ptr += nbytes;
+
+	seg->cmd = IKCP_CMD_ACK;
+	seg->len = 0;
+	return ptr;
+}
+
+static int ikcp_wnd_unused(const ikcpcb *kcp)
+{
+	if (kcp->nrcv_que < kcp->rcv_wnd) {
+		return kcp->rcv_wnd - kcp->nrcv_que;
+	}
+	return 0;
+}
+
+
+// append one data segment to the output buffer
+//---------------------------------------------------------------------
+// a segment cut before the path mtu dropped goes out in IKCP_CMD_PART
+// pieces, each led by its offset and the segment length. segments only
+// outgrow pmtu_min once the peer confirmed a probe, so it knows them
+//---------------------------------------------------------------------
+static char *ikcp_flush_part(ikcpcb *kcp, const IKCPSEG *segment, char *ptr)
+{
+	char *buffer = kcp->buffer;
+	const char *payload = ikcp_segment_payload(segment);
+	IUINT32 piece = kcp->mtu - IKCP_OVERHEAD - IKCP_PART_HEAD;
+	IUINT32 offset;
+	IKCPSEG part = *segment;
+
+	part.cmd = IKCP_CMD_PART;
+	for (offset = 0; offset < segment->len; offset += piece) {
+		IUINT32 size = _imin_(piece, segment->len - offset);
+		int used = (int)(ptr - buffer);
+		if (used + (int)(IKCP_OVERHEAD + IKCP_PART_HEAD + size) > (int)kcp->mtu) {
+			ikcp_output(kcp, buffer, used);
+			ptr = buffer;
+		}
+		part.len = IKCP_PART_HEAD + size;
+		ptr = ikcp_encode_seg(ptr, &part);
+		ptr = ikcp_encode32u(ptr, offset);
+		ptr = ikcp_encode32u(ptr, segment->len);
+		memcpy(ptr, payload + offset, size);
+		ptr += size;
+	}
+	return ptr;
+}
+
+static char *ikcp_flush_data(ikcpcb *kcp, IKCPSEG *segment, char *ptr, 
+	IUINT32 wnd)
+{
+	char *buffer = kcp->buffer;
+	int size = (int)(ptr - buffer);
+	int need = IKCP_OVERHEAD + segment->len;
+
+	segment->ts = kcp->current;
+	segment->wnd = wnd;
+	segment->una = kcp->rcv_nxt;
+
+	if (need > (int)kcp->mtu && kcp->pmtu_min > 0) {
+		ptr = ikcp_flush_part(kcp, segment, ptr);
+	}
+	else {
+		if (size + need > (int)kcp->mtu) {
+			ikcp_output(kcp, buffer, size);
+			ptr = buffer;
+		}
+
+		ptr = ikcp_encode_seg(ptr, segment);
+
+		if (segment->len > 0) {
+			memcpy(ptr, ikcp_segment_payload(segment), segment->len);
+			ptr += segment->len;
+		}
+	}
+
+	if (segment->xmit >= kcp->dead_link) {
+		kcp->state = -1;
+	}
+	return ptr;
+}
+
+
+//---------------------------------------------------------------------
+// path mtu: the mtu itself went unconfirmed, start over from the floor.
+// new segments get the smaller mss, ones cut before go out in parts
+//---------------------------------------------------------------------
+static void ikcp_pmtu_blackhole(ikcpcb *kcp)
+{
+	kcp->pmtu_hi = kcp->mtu - 1;
+	kcp->mtu = kcp->pmtu_min;
+	kcp->mss = kcp->mtu - IKCP_OVERHEAD;
+	kcp->pmtu_check = 0;
+	kcp->pmtu_probe = 0;
+	kcp->pmtu_tries = 0;
+	kcp->ts_pmtu = kcp->current;
+}
+
+
+//---------------------------------------------------------------------
+// path mtu: while data is queued send one probe per rto. a search starts
+// with pmtu_hi, after a failure it halves the gap to the mtu. once settled
+// pmtu_hi goes back to pmtu_max, tried again after IKCP_PMTU_RAISE. a
+// check probes the mtu itself and drops it after as many failures
+//---------------------------------------------------------------------
+static void ikcp_pmtu_probe(ikcpcb *kcp)
+{
+	IUINT32 current = kcp->current;
+	IUINT32 size;
+	IKCPSEG seg;
+	char *ptr;
+
+	if (_itimediff(current, kcp->ts_pmtu) < 0) return;
+	if (iqueue_is_empty(&kcp->snd_queue) && iqueue_is_empty(&kcp->snd_buf)) return;
+
+	if (kcp->pmtu_check) {
+		if (++kcp->pmtu_tries > IKCP_PMTU_TRIES) {
+			ikcp_pmtu_blackhole(kcp);
+		}
+	}
+	else if (kcp->pmtu_probe != 0 && ++kcp->pmtu_tries >= IKCP_PMTU_TRIES) {
+		kcp->pmtu_hi = kcp->pmtu_probe - 1;
+		kcp->pmtu_probe = 0;
+		kcp->pmtu_tries = 0;
+	}
+	if (kcp->pmtu_probe == 0) {
+		if (kcp->pmtu_hi < kcp->mtu + IKCP_PMTU_STEP) {
+			kcp->pmtu_hi = kcp->pmtu_max;
+			kcp->ts_pmtu = current + IKCP_PMTU_RAISE;
+			return;
+		}
+		if (kcp->pmtu_hi == kcp->pmtu_max) {
+			kcp->pmtu_probe = kcp->pmtu_hi;
+		}	else {
+			kcp->pmtu_probe = (kcp->mtu + kcp->pmtu_hi + 1) / 2;
+		}
+	}
+	size = kcp->pmtu_probe;
+	kcp->ts_pmtu = current + kcp->rx_rto;
+
+	// alone in its datagram, so the peer sees the size the path carried
+	seg.conv = kcp->conv;
+	seg.cmd = IKCP_CMD_WASK;
+	seg.frg = IKCP_PMTU_PROBE;
+	seg.wnd = ikcp_wnd_unused(kcp);
+	seg.ts = current;
+	seg.sn = size;
+	seg.una = kcp->rcv_nxt;
+	seg.len = size - IKCP_OVERHEAD;
+	ptr = ikcp_encode_seg(kcp->buffer, &seg);
+	memset(ptr, 0, seg.len);
+	ikcp_output(kcp, kcp->buffer, (int)size);
+}
+
+
+//---------------------------------------------------------------------
+// ikcp_flush
+//---------------------------------------------------------------------
+void ikcp_flush(ikcpcb *kcp)
+{
+	IUINT32 current = kcp->current;
+	char *buffer = kcp->buffer;
+	char *ptr = buffer;
+	int count, size, i;
+	IUINT32 resent, cwnd;
+	IUINT32 rtomin;
+	int change = 0;
+	int lost = 0;
+	int blackhole = 0;
+	IUINT32 sent = 0, sent_bytes = 0;
+	IUINT32 rate;
+	IINT64 burst = 0;
+	IKCPSEG seg;
+
+	// 'ikcp_update' haven't been called. 
+	if (kcp->updated == 0) return;
+
+	seg.conv = kcp->conv;
+	seg.cmd = IKCP_CMD_ACK;
+	seg.frg = 0;
+	seg.wnd = ikcp_wnd_unused(kcp);
+	seg.una = kcp->rcv_nxt;
+	seg.len = 0;
+	seg.sn = 0;
+	seg.ts = 0;
+
+	// flush acknowledges
+	count = kcp->ackcount;
+	if (count > 0 && kcp->sack == (IKCP_SACK_ENABLE | IKCP_SACK_PEER)) {
+		ptr = ikcp_flush_sack(kcp, ptr, &seg);
+		count = 0;
+	}
+	for (i = 0; i < count; i++) {
+		size = (int)(ptr - buffer);
+		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
+			ikcp_output(kcp, buffer, size);
+			ptr = buffer;
+		}
+		ikcp_ack_get(kcp, i, &seg.sn, &seg.ts);
+		ptr = ikcp_encode_seg(ptr, &seg);
+	}
+
+	kcp->ackcount = 0;
+
+	// probe window size (if remote window size equals zero)
+	if (kcp->rmt_wnd == 0) {
+		if (kcp->probe_wait == 0) {
+			kcp->probe_wait = IKCP_PROBE_INIT;
+			kcp->ts_probe = kcp->current + kcp->probe_wait;
+		}	
+		else {
+			if (_itimediff(kcp->current, kcp->ts_probe) >= 0) {
+				if (kcp->probe_wait < IKCP_PROBE_INIT) 
+					kcp->probe_wait = IKCP_PROBE_INIT;
+				kcp->probe_wait += kcp->probe_wait / 2;
+				if (kcp->probe_wait > IKCP_PROBE_LIMIT)
+					kcp->probe_wait = IKCP_PROBE_LIMIT;
+				kcp->ts_probe = kcp->current + kcp->probe_wait;
+				kcp->probe |= IKCP_ASK_SEND;
+			}
+		}
+	}	else {
+		kcp->ts_probe = 0;
+		kcp->probe_wait = 0;
+	}
+
+	// flush window probing commands
+	if (kcp->probe & IKCP_ASK_SEND) {
+		seg.cmd = IKCP_CMD_WASK;
+		size = (int)(ptr - buffer);
+		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
+			ikcp_output(kcp, buffer, size);
+			ptr = buffer;
+		}
+		ptr = ikcp_encode_seg(ptr, &seg);
+	}
+
+	// flush window probing commands
+	if (kcp->probe & IKCP_ASK_TELL) {
+		seg.cmd = IKCP_CMD_WINS;
+		size = (int)(ptr - buffer);
+		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
+			ikcp_output(kcp, buffer, size);
+			ptr = buffer;
+		}
+		ptr = ikcp_encode_seg(ptr, &seg);
+	}
+
+	// confirm the largest path mtu probe since the last flush
+	if (kcp->pmtu_ack > 0) {
+		seg.cmd = IKCP_CMD_WINS;
+		seg.frg = IKCP_PMTU_ACK;
+		seg.sn = kcp->pmtu_ack;
+		size = (int)(ptr - buffer);
+		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
+			ikcp_output(kcp, buffer, size);
+			ptr = buffer;
+		}
+		ptr = ikcp_encode_seg(ptr, &seg);
+		seg.frg = 0;
+		seg.sn = 0;
+		kcp->pmtu_ack = 0;
+	}
+
+	// tell a peer of unknown version we take SACK, while sending data
+	if (kcp->sack == IKCP_SACK_ENABLE && kcp->sack_adverts < IKCP_SACK_ADVERTS &&
+		!(iqueue_is_empty(&kcp->snd_queue) && iqueue_is_empty(&kcp->snd_buf))) {
+		seg.cmd = IKCP_CMD_WINS;
+		seg.frg = IKCP_SACK_ADVERT;
+		size = (int)(ptr - buffer);
+		if (size + (int)IKCP_OVERHEAD > (int)kcp->mtu) {
+			ikcp_output(kcp, buffer, size);
+			ptr = buffer;
+		}
+		ptr = ikcp_encode_seg(ptr, &seg);
+		seg.frg = 0;
+		kcp->sack_adverts++;
+	}
+
+	kcp->probe = 0;
+
+	// calculate window size
+	cwnd = _imin_(kcp->snd_wnd, kcp->rmt_wnd);
+	if (kcp->nocwnd == 0) cwnd = _imin_(kcp->cwnd, cwnd);
+
+	// move data from snd_queue to snd_buf
+	while (_itimediff(kcp->snd_nxt, kcp->snd_una + cwnd) < 0) {
+		IKCPSEG *newseg;
+		if (iqueue_is_empty(&kcp->snd_queue)) break;
+
+		newseg = iqueue_entry(kcp->snd_queue.next, IKCPSEG, node);
+
+		iqueue_del(&newseg->node);
+		iqueue_add_tail(&newseg->node, &kcp->snd_buf);
+		kcp->nsnd_que--;
+		kcp->nsnd_buf++;
+
+		newseg->conv = kcp->conv;
+		newseg->cmd = IKCP_CMD_PUSH;
+		newseg->wnd = seg.wnd;
+		newseg->ts = current;
+		newseg->sn = kcp->snd_nxt++;
+		newseg->una = kcp->rcv_nxt;
+		newseg->resendts = current;
+		newseg->rto = kcp->rx_rto;
+		newseg->fastack = 0;
+		newseg->xmit = 0;
+		if (kcp->snd_ring) {
+			kcp->snd_ring[newseg->sn & kcp->ring_mask] = newseg;
+		}
+		ikcp_rto_push(kcp, newseg);
+	}
+
+	// calculate resent
+	resent = (kcp->fastresend > 0)? (IUINT32)kcp->fastresend : 0xffffffff;
+	rtomin = (kcp->nodelay == 0)? (kcp->rx_rto >> 3) : 0;
+
+	// refill the pacer, at most two ticks worth of burst. the clock only
+	// moves on by whole bytes added, a slow rate still adds up over ticks
+	rate = kcp->cc->pacing_rate ? kcp->cc->pacing_rate(kcp) : 0;
+	if (rate > 0) {
+		IINT64 tokens = kcp->pacing_tokens;
+		IINT32 elapsed = _itimediff(current, kcp->pacing_ts);
+		IINT64 added = elapsed > 0 ? (IINT64)rate * elapsed / 1000 : 0;
+		burst = (IINT64)rate * kcp->interval * 2 / 1000;
+		if (burst < (IINT64)kcp->mtu * 2) burst = (IINT64)kcp->mtu * 2;
+		if (added > 0) {
+			tokens += added;
+			kcp->pacing_ts += (IUINT32)(added * 1000 / rate);
+		}
+		if (tokens >= burst || elapsed < 0) {
+			tokens = burst;
+			kcp->pacing_ts = current;
+		}
+		kcp->pacing_tokens = (IINT32)tokens;
+	}
+	else {
+		kcp->pacing_ts = current;
+	}
+
+	// fast resends, a segment also due by timer is left to the timer below
+	for (i = 0; i < (int)kcp->fast_count; ) {
+		IKCPSEG *segment = kcp->fast_list[i];
+		int need = IKCP_OVERHEAD + segment->len;
+		if (segment->fastack < resent) {
+			ikcp_fast_remove(kcp, segment);
+			continue;
+		}
+		if (_itimediff(current, segment->resendts) >= 0 ||
+			(rate > 0 && kcp->pacing_tokens < need)) {
+			i++;
+			continue;
+		}
+		segment->xmit++;
+		segment->fastack = 0;
+		segment->resendts = current + segment->rto;
+		ikcp_fast_remove(kcp, segment);
+		ikcp_rto_fix(kcp, segment);
+		change++;
+
+		ptr = ikcp_flush_data(kcp, segment, ptr, seg.wnd);
+		sent++;
+		sent_bytes += need;
+		if (rate > 0) {
+			kcp->pacing_tokens -= need;
+		}
+	}
+
+	// first sends and timeouts, earliest resendts first
+	while (kcp->rto_count > 0) {
+		IKCPSEG *segment = kcp->rto_heap[0];
+		int need = IKCP_OVERHEAD + segment->len;
+		int small = 0;
+		if (_itimediff(current, segment->resendts) < 0) {
+			break;
+		}
+		if (rate > 0 && kcp->pacing_tokens < need && segment->xmit == 0) {
+			// out of tokens: wait for a later tick, pushed out so
+			// ikcp_check does not report it due already. a timeout
+			// resend goes anyway and leaves a debt of at most a burst
+			segment->resendts = current + kcp->interval;
+			ikcp_rto_fix(kcp, segment);
+			continue;
+		}
+		if (segment->xmit == 0) {
+			segment->xmit++;
+			segment->rto = kcp->rx_rto;
+			segment->resendts = current + segment->rto + rtomin;
+		}
+		else {
+			segment->xmit++;
+			kcp->xmit++;
+			if (kcp->nodelay == 0) {
+				segment->rto += kcp->rx_rto;
+			}	else {
+				segment->rto += kcp->rx_rto / 2;
+			}
+			segment->resendts = current + segment->rto;
+			lost++;
+			if (kcp->pmtu_min > 0 && segment->xmit >= IKCP_PMTU_BLACKHOLE) {
+				// one that fits pmtu_min stops sharing a bigger datagram,
+				// only the rest can point at the path
+				if ((IUINT32)need > kcp->pmtu_min) {
+					blackhole = 1;
+				}	else {
+					small = 1;
+				}
+			}
+		}
+		ikcp_rto_fix(kcp, segment);
+
+		size = (int)(ptr - buffer);
+		if (small && size + need > (int)kcp->pmtu_min) {
+			ikcp_output(kcp, buffer, size);
+			ptr = buffer;
+		}
+		ptr = ikcp_flush_data(kcp, segment, ptr, seg.wnd);
+		if (small) {
+			ikcp_output(kcp, buffer, (int)(ptr - buffer));
+			ptr = buffer;
+		}
+		sent++;
+		sent_bytes += need;
+		if (rate > 0) {
+			kcp->pacing_tokens -= need;
+			if (kcp->pacing_tokens < -burst) {
+				kcp->pacing_tokens = (IINT32)-burst;
+			}
+		}
+	}
+
+	// flash remain segments
+	size = (int)(ptr - buffer);
+	if (size > 0) {
+		ikcp_output(kcp, buffer, size);
+	}
+
+	if (kcp->pmtu_min > 0) {
+		if (blackhole && kcp->mtu > kcp->pmtu_min && kcp->pmtu_check == 0) {
+			// loss times segments out too, see the mtu fail before dropping it
+			kcp->pmtu_check = 1;
+			kcp->pmtu_probe = kcp->mtu;
+			kcp->pmtu_tries = 0;
+			kcp->ts_pmtu = current;
+		}
+		ikcp_pmtu_probe(kcp);
+	}
+
+	if ((change || lost) && kcp->cc->on_loss) {
+		kcp->cc->on_loss(kcp, cwnd, lost, change);
+	}
+
+	if (kcp->cc->on_send) {
+		kcp->cc->on_send(kcp, sent, sent_bytes);
+	}
+}
+
+
+//---------------------------------------------------------------------
+// update state (call it repeatedly, every 10ms-100ms), or you can ask 
+// ikcp_check when to call it again (without ikcp_input/_send calling).
+// 'current' - current timestamp in millisec. 
+//---------------------------------------------------------------------
+void ikcp_update(ikcpcb *kcp, IUINT32 current)
+{
+	IINT32 slap;
+
+	kcp->current = current;
+
+	if (kcp->updated == 0) {
+		kcp->updated = 1;
+		kcp->ts_flush = kcp->current;
+	}
+
+	slap = _itimediff(kcp->current, kcp->ts_flush);
+
+	if (slap >= 10000 || slap < -10000) {
+		kcp->ts_flush = kcp->current;
+		slap = 0;
+	}
+
+	if (slap >= 0) {
+		kcp->ts_flush += kcp->interval;
+		if (_itimediff(kcp->current, kcp->ts_flush) >= 0) {
+			kcp->ts_flush = kcp->current + kcp->interval;
+		}
+		ikcp_flush(kcp);
+	}
+}
+
+
+//---------------------------------------------------------------------
+// Determine when should you invoke ikcp_update:
+// returns when you should invoke ikcp_update in millisec, if there 
+// is no ikcp_input/_send calling. you can call ikcp_update in that
+// time, instead of call update repeatly.
+// Important to reduce unnacessary ikcp_update invoking. use it to 
+// schedule ikcp_update (eg. implementing an epoll-like mechanism, 
+// or optimize ikcp_update when handling massive kcp connections)
+//---------------------------------------------------------------------
+IUINT32 ikcp_check(const ikcpcb *kcp, IUINT32 current)
+{
+	IUINT32 ts_flush = kcp->ts_flush;
+	IINT32 tm_flush = 0x7fffffff;
+	IINT32 tm_packet = 0x7fffffff;
+	IUINT32 minimal = 0;
+
+	if (kcp->updated == 0) {
+		return current;
+	}
+
+	if (_itimediff(current, ts_flush) >= 10000 ||
+		_itimediff(current, ts_flush) < -10000) {
+		ts_flush = current;
+	}
+
+	if (_itimediff(current, ts_flush) >= 0) {
+		return current;
+	}
+
+	tm_flush = _itimediff(ts_flush, current);
+
+	// the heap top is the earliest resend
+	if (kcp->rto_count > 0) {
+		tm_packet = _itimediff(kcp->rto_heap[0]->resendts, current);
+		if (tm_packet <= 0) {
+			return current;
+		}
+	}
+
+	minimal = (IUINT32)(tm_packet < tm_flush ? tm_packet : tm_flush);
+	if (minimal >= kcp->interval) minimal = kcp->interval;
+
+	return current + minimal;
+}
+
+
+
+int ikcp_setmtu(ikcpcb *kcp, int mtu)
+{
+	char *buffer;
+	if (mtu < 50 || mtu < (int)IKCP_OVERHEAD) 
+		return -1;
+	// room for a probe of pmtu_max too
+	buffer = (char*)ikcp_malloc((_imax_(mtu, kcp->pmtu_max) + IKCP_OVERHEAD) * 3);
+	if (buffer == NULL) 
+		return -2;
+	kcp->mtu = mtu;
+	kcp->mss = kcp->mtu - IKCP_OVERHEAD;
+	ikcp_free(kcp->buffer);
+	kcp->buffer = buffer;
+	return 0;
+}
+
+int ikcp_setpmtu(ikcpcb *kcp, int mtu_min, int mtu_max)
+{
+	int ret;
+	if (mtu_min == 0) {
+		kcp->pmtu_min = 0;
+		kcp->pmtu_max = 0;
+		kcp->pmtu_probe = 0;
+		kcp->pmtu_check = 0;
+		return 0;
+	}
+	if (mtu_max < mtu_min) 
+		return -1;
+	kcp->pmtu_max = mtu_max;
+	ret = ikcp_setmtu(kcp, mtu_min);
+	if (ret < 0) {
+		kcp->pmtu_min = 0;
+		kcp->pmtu_max = 0;
+		return ret;
+	}
+	kcp->pmtu_min = mtu_min;
+	kcp->pmtu_hi = mtu_max;
+	kcp->pmtu_check = 0;
+	kcp->pmtu_probe = 0;
+	kcp->pmtu_tries = 0;
+	kcp->ts_pmtu = kcp->current;
+	return 0;
+}
+
+int ikcp_interval(ikcpcb *kcp, int interval)
+{
+	if (interval > 5000) interval = 5000;
+	else if (interval < 10) interval = 10;
+	kcp->interval = interval;
+	return 0;
+}
+
+int ikcp_nodelay(ikcpcb *kcp, int nodelay, int interval, int resend, int nc)
+{
+	if (nodelay >= 0) {
+		kcp->nodelay = nodelay;
+		if (nodelay) {
+			kcp->rx_minrto = IKCP_RTO_NDL;	
+		}	
+		else {
+			kcp->rx_minrto = IKCP_RTO_MIN;
+		}
+	}
+	if (interval >= 0) {
+		if (interval > 5000) interval = 5000;
+		else if (interval < 10) interval = 10;
+		kcp->interval = interval;
+	}
+	if (resend >= 0) {
+		kcp->fastresend = resend;
+	}
+	if (nc >= 0) {
+		kcp->nocwnd = nc;
+	}
+	return 0;
+}
+
+
+//---------------------------------------------------------------------
+// sequence ring: snd_buf and rcv_buf stay the ordered lists, the ring
+// only indexes them. both rings share one block, sized to a power of two
+// covering the windows and whatever the buffers already span
+//---------------------------------------------------------------------
+static IUINT32 ikcp_ring_span(const struct IQUEUEHEAD *head)
+{
+	if (iqueue_is_empty(head)) return 0;
+	return iqueue_entry(head->prev, IKCPSEG, node)->sn - 
+		iqueue_entry(head->next, IKCPSEG, node)->sn + 1;
+}
+
+static int ikcp_ring_build(ikcpcb *kcp)
+{
+	IUINT32 need = _imax_(kcp->snd_wnd, kcp->rcv_wnd);
+	IUINT32 size;
+	IKCPSEG **ring;
+	struct IQUEUEHEAD *p;
+
+	need = _imax_(need, ikcp_ring_span(&kcp->snd_buf));
+	need = _imax_(need, ikcp_ring_span(&kcp->rcv_buf));
+	for (size = 16; size < need; size <<= 1);
+
+	ring = (IKCPSEG**)ikcp_malloc(sizeof(IKCPSEG*) * size * 2);
+	if (ring == NULL) {
+		return -1;
+	}
+	memset(ring, 0, sizeof(IKCPSEG*) * size * 2);
+
+	if (kcp->snd_ring) {
+		ikcp_free(kcp->snd_ring);
+	}
+	kcp->snd_ring = ring;
+	kcp->rcv_ring = ring + size;
+	kcp->ring_mask = size - 1;
+
+	for (p = kcp->snd_buf.next; p != &kcp->snd_buf; p = p->next) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		kcp->snd_ring[seg->sn & kcp->ring_mask] = seg;
+	}
+	for (p = kcp->rcv_buf.next; p != &kcp->rcv_buf; p = p->next) {
+		IKCPSEG *seg = iqueue_entry(p, IKCPSEG, node);
+		kcp->rcv_ring[seg->sn & kcp->ring_mask] = seg;
+	}
+	return 0;
+}
+
+int ikcp_setring(ikcpcb *kcp, int enable)
+{
+	assert(kcp);
+	if (enable) {
+		return ikcp_ring_build(kcp);
+	}
+	if (kcp->snd_ring) {
+		ikcp_free(kcp->snd_ring);
+		kcp->snd_ring = NULL;
+		kcp->rcv_ring = NULL;
+	}
+	return 0;
+}
+
+
+int ikcp_wndsize(ikcpcb *kcp, int sndwnd, int rcvwnd)
+{
+	if (kcp) {
+		if (sndwnd > 0) {
+			kcp->snd_wnd = sndwnd;
+		}
+		if (rcvwnd > 0) {
+			kcp->rcv_wnd = rcvwnd;
+		}
+		if (kcp->snd_ring && ikcp_ring_build(kcp) != 0) {
+			// the lists still hold everything, fall back to scanning them
+			ikcp_free(kcp->snd_ring);
+			kcp->snd_ring = NULL;
+			kcp->rcv_ring = NULL;
+		}
+	}
+	return 0;
+}
+
+int ikcp_waitsnd(const ikcpcb *kcp)
+{
+	return kcp->nsnd_buf + kcp->nsnd_que;
+}
+
+
+// read conv
+IUINT32 ikcp_getconv(const void *ptr)
+{
+	IUINT32 conv;
+	ikcp_decode32u((const char*)ptr, &conv);
+	return conv;
+}
+
+
+int ikcp_setsack(ikcpcb *kcp, int enable)
+{
+	assert(kcp);
+	if (enable) {
+		kcp->sack |= IKCP_SACK_ENABLE;
+	}	else {
+		kcp->sack &= ~IKCP_SACK_ENABLE;
+	}
+	return 0;
+}
+
+
+//=====================================================================
+// CONGESTION CONTROL
+//=====================================================================
+int ikcp_setcc(ikcpcb *kcp, const IKCPCC *cc)
+{
+	assert(kcp && cc);
+	if (kcp->cc->release) {
+		kcp->cc->release(kcp);
+	}
+	kcp->cc = cc;
+	kcp->cc_state = NULL;
+	kcp->pacing_tokens = 0;
+	if (cc->init) {
+		cc->init(kcp);
+	}
+	return 0;
+}
+
+
+//---------------------------------------------------------------------
+// reno: slow start, additive increase, collapse on timeout
+//---------------------------------------------------------------------
+static void ikcp_reno_init(ikcpcb *kcp)
+{
+	kcp->cwnd = 1;
+	kcp->incr = kcp->mss;
+	kcp->ssthresh = IKCP_THRESH_INIT;
+}
+
+static void ikcp_reno_on_ack(ikcpcb *kcp, IUINT32 una, IUINT32 acked, IINT32 rtt)
+{
+	if (_itimediff(kcp->snd_una, una) > 0) {
+		if (kcp->cwnd < kcp->rmt_wnd) {
+			IUINT32 mss = kcp->mss;
+			if (kcp->cwnd < kcp->ssthresh) {
+				kcp->cwnd++;
+				kcp->incr += mss;
+			}	else {
+				if (kcp->incr < mss) kcp->incr = mss;
+				kcp->incr += (mss * mss) / kcp->incr + (mss / 16);
+				if ((kcp->cwnd + 1) * mss <= kcp->incr) {
+					kcp->cwnd++;
+				}
+			}
+			if (kcp->cwnd > kcp->rmt_wnd) {
+				kcp->cwnd = kcp->rmt_wnd;
+				kcp->incr = kcp->rmt_wnd * mss;
+			}
+		}
+	}
+}
+
+static void ikcp_reno_on_loss(ikcpcb *kcp, IUINT32 window, int timeouts, int fastresends)
+{
+	// update ssthresh
+	if (fastresends) {
+		IUINT32 inflight = kcp->snd_nxt - kcp->snd_una;
+		IUINT32 resent = (kcp->fastresend > 0)? (IUINT32)kcp->fastresend : 0xffffffff;
+		kcp->ssthresh = inflight / 2;
+		if (kcp->ssthresh < IKCP_THRESH_MIN)
+			kcp->ssthresh = IKCP_THRESH_MIN;
+		kcp->cwnd = kcp->ssthresh + resent;
+		kcp->incr = kcp->cwnd * kcp->mss;
+	}
+
+	if (timeouts) {
+		kcp->ssthresh = window / 2;
+		if (kcp->ssthresh < IKCP_THRESH_MIN)
+			kcp->ssthresh = IKCP_THRESH_MIN;
+		kcp->cwnd = 1;
+		kcp->incr = kcp->mss;
+	}
+}
+
+static void ikcp_reno_on_send(ikcpcb *kcp, IUINT32 segments, IUINT32 bytes)
+{
+	if (kcp->cwnd < 1) {
+		kcp->cwnd = 1;
+		kcp->incr = kcp->mss;
+	}
+}
+
+const IKCPCC ikcp_cc_reno = {
+	"reno", ikcp_reno_init, NULL, ikcp_reno_on_ack, ikcp_reno_on_loss,
+	ikcp_reno_on_send, NULL
+};
+
+
+//---------------------------------------------------------------------
+// none: only snd_wnd and rmt_wnd limit the flush
+//---------------------------------------------------------------------
+static void ikcp_none_init(ikcpcb *kcp)
+{
+	kcp->cwnd = 0xffffffff;
+}
+
+const IKCPCC ikcp_cc_none = {
+	"none", ikcp_none_init, NULL, NULL, NULL, NULL, NULL
+};
+
+
+//---------------------------------------------------------------------
+// bbr: cwnd and pacing follow the measured bottleneck bandwidth and
+// min rtt instead of reacting to loss. one round is one min rtt.
+//---------------------------------------------------------------------
+#define IKCP_BBR_STARTUP	0
+#define IKCP_BBR_DRAIN		1
+#define IKCP_BBR_PROBE_BW	2
+#define IKCP_BBR_PROBE_RTT	3
+
+const int IKCP_BBR_BW_ROUNDS = 10;			// bandwidth max filter length
+const IUINT32 IKCP_BBR_RTT_WINDOW = 10000;	// min rtt expires after 10s
+const IUINT32 IKCP_BBR_PROBE_RTT_TIME = 200;
+const IUINT32 IKCP_BBR_MIN_CWND = 4;
+const int IKCP_BBR_DRAIN_ROUNDS = 3;		// startup queue is gone by then
+const IUINT32 IKCP_BBR_HIGH_GAIN = 289;		// gains are in percent
+const IUINT32 IKCP_BBR_CYCLE[8] = { 125, 75, 100, 100, 100, 100, 100, 100 };
+
+typedef struct IKCPBBR
+{
+	int mode;
+	IUINT32 pacing_gain;
+	IUINT32 cwnd_gain;
+	IUINT32 btlbw;						// bytes per second
+	IUINT32 bw[IKCP_BBR_BW_ROUNDS];
+	IUINT32 round;
+	IUINT32 min_rtt;
+	IUINT32 min_rtt_ts;
+	IUINT32 delivered;					// bytes acked so far
+	IUINT32 sample_delivered;
+	IUINT32 sample_ts;
+	IUINT32 full_bw;
+	int full_bw_rounds;
+	int full_pipe;
+	int drain_rounds;
+	int cycle;
+	IUINT32 probe_rtt_done;
+} IKCPBBR;
+
+static void ikcp_bbr_set_mode(IKCPBBR *bbr, int mode)
+{
+	bbr->mode = mode;
+	switch (mode) {
+	case IKCP_BBR_STARTUP:
+		bbr->pacing_gain = IKCP_BBR_HIGH_GAIN;
+		bbr->cwnd_gain = IKCP_BBR_HIGH_GAIN;
+		break;
+	case IKCP_BBR_DRAIN:
+		bbr->pacing_gain = 100 * 100 / IKCP_BBR_HIGH_GAIN;
+		bbr->cwnd_gain = IKCP_BBR_HIGH_GAIN;
+		bbr->drain_rounds = 0;
+		break;
+	case IKCP_BBR_PROBE_BW:
+		bbr->cycle = 0;
+		bbr->pacing_gain = IKCP_BBR_CYCLE[0];
+		bbr->cwnd_gain = 200;
+		break;
+	default:
+		bbr->pacing_gain = 100;
+		bbr->cwnd_gain = 100;
+		break;
+	}
+}
+
+static void ikcp_bbr_init(ikcpcb *kcp)
+{
+	IKCPBBR *bbr = (IKCPBBR*)ikcp_malloc(sizeof(IKCPBBR));
+	assert(bbr);
+	memset(bbr, 0, sizeof(IKCPBBR));
+	ikcp_bbr_set_mode(bbr, IKCP_BBR_STARTUP);
+	bbr->min_rtt_ts = kcp->current;
+	kcp->cc_state = bbr;
+	kcp->cwnd = IKCP_BBR_MIN_CWND;
+}
+
+static void ikcp_bbr_release(ikcpcb *kcp)
+{
+	if (kcp->cc_state) {
+		ikcp_free(kcp->cc_state);
+		kcp->cc_state = NULL;
+	}
+}
+
+// once per round: new bandwidth sample and the state machine
+static void ikcp_bbr_on_round(ikcpcb *kcp, IKCPBBR *bbr, IUINT32 bw)
+{
+	IUINT32 inflight = (kcp->snd_nxt - kcp->snd_una) * kcp->mss;
+	IUINT32 bdp;
+	int i;
+
+	bbr->round++;
+	bbr->bw[bbr->round % IKCP_BBR_BW_ROUNDS] = bw;
+	bbr->btlbw = 0;
+	for (i = 0; i < IKCP_BBR_BW_ROUNDS; i++) {
+		if (bbr->bw[i] > bbr->btlbw) bbr->btlbw = bbr->bw[i];
+	}
+	bdp = (IUINT32)((IINT64)bbr->btlbw * bbr->min_rtt / 1000);
+
+	switch (bbr->mode) {
+	case IKCP_BBR_STARTUP:
+		// the pipe is full once bandwidth stops growing 25% a round
+		if ((IINT64)bbr->btlbw * 4 >= (IINT64)bbr->full_bw * 5) {
+			bbr->full_bw = bbr->btlbw;
+			bbr->full_bw_rounds = 0;
+		}
+		else if (++bbr->full_bw_rounds >= 3) {
+			bbr->full_pipe = 1;
+			ikcp_bbr_set_mode(bbr, IKCP_BBR_DRAIN);
+		}
+		break;
+	case IKCP_BBR_DRAIN:
+		// a hole at snd_una keeps inflight up under loss, and draining
+		// shrinks bdp with it. the round limit ends that spiral
+		if (inflight <= bdp || ++bbr->drain_rounds >= IKCP_BBR_DRAIN_ROUNDS) {
+			ikcp_bbr_set_mode(bbr, IKCP_BBR_PROBE_BW);
+		}
+		break;
+	case IKCP_BBR_PROBE_BW:
+		bbr->cycle = (bbr->cycle + 1) % 8;
+		bbr->pacing_gain = IKCP_BBR_CYCLE[bbr->cycle];
+		break;
+	case IKCP_BBR_PROBE_RTT:
+		if (_itimediff(kcp->current, bbr->probe_rtt_done) >= 0) {
+			bbr->min_rtt_ts = kcp->current;
+			ikcp_bbr_set_mode(bbr, bbr->full_pipe? 
+				IKCP_BBR_PROBE_BW : IKCP_BBR_STARTUP);
+		}
+		break;
+	}
+
+	// an old min rtt may hide a shorter path, drain the queue to look
+	if (bbr->mode != IKCP_BBR_PROBE_RTT && 
+		_itimediff(kcp->current, bbr->min_rtt_ts) > (IINT32)IKCP_BBR_RTT_WINDOW) {
+		ikcp_bbr_set_mode(bbr, IKCP_BBR_PROBE_RTT);
+		bbr->probe_rtt_done = kcp->current + IKCP_BBR_PROBE_RTT_TIME;
+	}
+}
+
+static void ikcp_bbr_on_ack(ikcpcb *kcp, IUINT32 una, IUINT32 acked, IINT32 rtt)
+{
+	IKCPBBR *bbr = (IKCPBBR*)kcp->cc_state;
+	IINT32 elapsed;
+	IUINT32 round_time;
+
+	bbr->delivered += acked * kcp->mss;
+
+	if (rtt >= 0) {
+		IUINT32 sample = rtt > 0 ? (IUINT32)rtt : 1;
+		if (bbr->min_rtt == 0 || sample <= bbr->min_rtt ||
+			_itimediff(kcp->current, bbr->min_rtt_ts) > (IINT32)IKCP_BBR_RTT_WINDOW) {
+			bbr->min_rtt = sample;
+			if (bbr->mode != IKCP_BBR_PROBE_RTT) {
+				bbr->min_rtt_ts = kcp->current;
+			}
+		}
+	}
+
+	if (bbr->sample_ts == 0) {
+		bbr->sample_ts = kcp->current;
+		bbr->sample_delivered = bbr->delivered;
+	}
+
+	round_time = bbr->min_rtt > kcp->interval ? bbr->min_rtt : kcp->interval;
+	elapsed = _itimediff(kcp->current, bbr->sample_ts);
+	if (elapsed >= (IINT32)round_time) {
+		IUINT32 bw = (IUINT32)((IINT64)(bbr->delivered - bbr->sample_delivered) * 1000 / elapsed);
+		bbr->sample_ts = kcp->current;
+		bbr->sample_delivered = bbr->delivered;
+		ikcp_bbr_on_round(kcp, bbr, bw);
+	}
+
+	if (bbr->mode == IKCP_BBR_PROBE_RTT) {
+		kcp->cwnd = IKCP_BBR_MIN_CWND;
+	}
+	else if (bbr->btlbw == 0 || bbr->min_rtt == 0) {
+		kcp->cwnd += acked;		// no model yet, grow like slow start
+	}
+	else {
+		IINT64 bdp = (IINT64)bbr->btlbw * bbr->min_rtt / 1000;
+		IUINT32 cwnd = (IUINT32)(bdp * bbr->cwnd_gain / 100 / kcp->mss);
+		if (bbr->mode == IKCP_BBR_STARTUP && cwnd < kcp->cwnd + acked) {
+			cwnd = kcp->cwnd + acked;
+		}
+		kcp->cwnd = cwnd;
+	}
+	if (kcp->cwnd < IKCP_BBR_MIN_CWND) {
+		kcp->cwnd = IKCP_BBR_MIN_CWND;
+	}
+}
+
+// never below the minimum window per round, a collapsed bandwidth
+// sample would otherwise starve the acks that could raise it again
+static IUINT32 ikcp_bbr_pacing_rate(const ikcpcb *kcp)
+{
+	const IKCPBBR *bbr = (const IKCPBBR*)kcp->cc_state;
+	IINT64 rate, least;
+	IUINT32 round_time;
+	if (bbr->btlbw == 0) {
+		return 0;
+	}
+	round_time = bbr->min_rtt > kcp->interval ? bbr->min_rtt : kcp->interval;
+	rate = (IINT64)bbr->btlbw * bbr->pacing_gain / 100;
+	least = (IINT64)IKCP_BBR_MIN_CWND * kcp->mtu * 1000 / round_time;
+	rate = rate > least ? rate : least;
+	return (IUINT32)(rate < 0xffffffff ? rate : 0xffffffff);
+}
+
+const IKCPCC ikcp_cc_bbr = {
+	"bbr", ikcp_bbr_init, ikcp_bbr_release, ikcp_bbr_on_ack, NULL, NULL,
+	ikcp_bbr_pacing_rate
+};
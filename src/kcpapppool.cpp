@@ -0,0 +1,232 @@
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "kcpapppool.h"
+
+KCPAppPool::KCPAppPool() : threads_(0), loops_(0), handler_(NULL), user_(NULL),
+    stopping_(false)
+{
+}
+
+KCPAppPool::~KCPAppPool()
+{
+    Stop();
+}
+
+bool KCPAppPool::Start(int threads, int loops, int queue_size, app_message_func handler,
+    void* user)
+{
+    assert(workers_.empty());
+    assert(threads > 0 && loops > 0 && NULL != handler);
+    threads_ = threads;
+    loops_ = loops;
+    handler_ = handler;
+    user_ = user;
+    stopping_.store(false);
+
+    for (int i = 0; i < loops_ * threads_; i++)
+    {
+        Ring* ring = new Ring();
+        ring->queue.Init(queue_size);
+        ring->pushed = false;
+        rings_.push_back(ring);
+    }
+
+    for (int i = 0; i < threads_; i++)
+    {
+        Worker* worker = new Worker();
+        worker->idle.store(false);
+        worker->event_fd = eventfd(0, EFD_CLOEXEC);
+        workers_.push_back(worker);
+        if (worker->event_fd < 0)
+        {
+            Stop();
+            return false;
+        }
+    }
+    for (int i = 0; i < threads_; i++)
+    {
+        workers_[i]->thread = std::thread(&KCPAppPool::WorkerMain, this, i);
+    }
+    return true;
+}
+
+void KCPAppPool::Stop()
+{
+    //the loops are gone by now, their backlog still goes out in order
+    bool running = !workers_.empty() && workers_.back()->thread.joinable();
+    for (int loop = 0; running && loop < loops_; loop++)
+    {
+        while (HasBacklog(loop))
+        {
+            Flush(loop);
+            std::this_thread::yield();
+        }
+    }
+
+    stopping_.store(true);
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+        Worker* worker = workers_[i];
+        if (worker->thread.joinable())
+        {
+            IUINT64 one = 1;
+            ssize_t ret = write(worker->event_fd, &one, sizeof(one));
+            (void)ret;
+            worker->thread.join();
+        }
+        if (worker->event_fd >= 0)
+        {
+            close(worker->event_fd);
+        }
+        delete worker;
+    }
+    workers_.clear();
+
+    for (size_t i = 0; i < rings_.size(); i++)
+    {
+        Ring* ring = rings_[i];
+        KCPAppMessage message;
+        while (ring->queue.Pop(message))
+        {
+            ikcp_buf_release(message.buf);
+        }
+        for (size_t j = 0; j < ring->backlog.size(); j++)
+        {
+            ikcp_buf_release(ring->backlog[j].buf);
+        }
+        delete ring;
+    }
+    rings_.clear();
+    loops_ = 0;
+    threads_ = 0;
+}
+
+bool KCPAppPool::Push(int loop, int conv, IKCPBUF* buf)
+{
+    Ring* ring = GetRing(loop, (IUINT32)conv % threads_);
+    KCPAppMessage message;
+    message.conv = conv;
+    message.buf = buf;
+    ring->pushed = true;
+    if (ring->backlog.empty() && ring->queue.Push(message))
+    {
+        return true;
+    }
+    ring->backlog.push_back(message);
+    return false;
+}
+
+void KCPAppPool::Flush(int loop)
+{
+    for (int thread = 0; thread < threads_; thread++)
+    {
+        Ring* ring = GetRing(loop, thread);
+        if (!ring->backlog.empty() && MoveBacklog(ring))
+        {
+            ring->pushed = true;
+        }
+        if (!ring->pushed)
+        {
+            continue;
+        }
+
+        //pairs with the fence in WorkerMain: either the thread sees the
+        //messages on its last look, or it is idle here and gets a write
+        ring->pushed = false;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        Worker* worker = workers_[thread];
+        if (worker->idle.exchange(false))
+        {
+            IUINT64 one = 1;
+            ssize_t ret = write(worker->event_fd, &one, sizeof(one));
+            (void)ret;
+        }
+    }
+}
+
+bool KCPAppPool::HasBacklog(int loop) const
+{
+    for (int thread = 0; thread < threads_; thread++)
+    {
+        if (!GetRing(loop, thread)->backlog.empty())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+int KCPAppPool::GetThreads() const
+{
+    return threads_;
+}
+
+KCPAppPool::Ring* KCPAppPool::GetRing(int loop, int thread) const
+{
+    assert(loop >= 0 && loop < loops_);
+    return rings_[loop * threads_ + thread];
+}
+
+bool KCPAppPool::MoveBacklog(Ring* ring)
+{
+    size_t moved = 0;
+    while (moved < ring->backlog.size() && ring->queue.Push(ring->backlog[moved]))
+    {
+        moved++;
+    }
+    ring->backlog.erase(ring->backlog.begin(), ring->backlog.begin() + moved);
+    return moved > 0;
+}
+
+bool KCPAppPool::IsIdle(int thread) const
+{
+    for (int loop = 0; loop < loops_; loop++)
+    {
+        if (!GetRing(loop, thread)->queue.IsEmpty())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void KCPAppPool::WorkerMain(int thread)
+{
+    Worker* worker = workers_[thread];
+    while (true)
+    {
+        bool handled = false;
+        for (int loop = 0; loop < loops_; loop++)
+        {
+            Ring* ring = GetRing(loop, thread);
+            KCPAppMessage message;
+            for (int i = 0; i < BATCH_SIZE && ring->queue.Pop(message); i++)
+            {
+                handler_(message.conv, message.buf, user_);
+                handled = true;
+            }
+        }
+        if (handled)
+        {
+            continue;
+        }
+
+        worker->idle.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!IsIdle(thread))
+        {
+            worker->idle.store(false);
+            continue;
+        }
+        if (stopping_.load())
+        {
+            break;
+        }
+
+        IUINT64 counter = 0;
+        ssize_t ret = read(worker->event_fd, &counter, sizeof(counter));
+        (void)ret;
+        worker->idle.store(false);
+    }
+}
@@ -0,0 +1,344 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "kcpcompress.h"
+
+static const int lz_hash_log = 12;
+static const int lz_min_match = 4;
+static const int lz_last_literals = 5; //a block ends with at least this many literals
+static const int lz_match_limit = 12; //no match starts closer than this to the end
+
+//positions are stored as base + offset, whatever is below base belongs to
+//an earlier input, so the table never needs clearing between packages
+struct KCPLZTable
+{
+    IUINT32 base;
+    IUINT32 pos[1 << lz_hash_log];
+};
+
+static thread_local KCPLZTable lz_table;
+
+static inline IUINT32 Read32(const unsigned char* p)
+{
+    IUINT32 v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline IUINT64 Read64(const unsigned char* p)
+{
+    IUINT64 v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline int LZHash(IUINT32 v)
+{
+    return (int)((v * 2654435761u) >> (32 - lz_hash_log));
+}
+
+static inline unsigned char* WriteLength(unsigned char* op, int len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+int KCPCompressor::Compress(const char* src, int len, char* dst, int capacity)
+{
+    if (len < 0 || len > KCP_LZ_MAX_INPUT || capacity <= 0)
+    {
+        return -1;
+    }
+
+    KCPLZTable& table = lz_table;
+    if (table.base > 0x7fffffffu)
+    {
+        memset(&table, 0, sizeof(table));
+    }
+    const IUINT32 base = table.base + 1;
+    table.base = base + len;
+
+    const unsigned char* istart = (const unsigned char*)src;
+    const unsigned char* ip = istart;
+    const unsigned char* anchor = istart;
+    const unsigned char* iend = istart + len;
+    unsigned char* op = (unsigned char*)dst;
+    unsigned char* oend = op + capacity;
+
+    if (len >= lz_match_limit + 1)
+    {
+        const unsigned char* mflimit = iend - lz_match_limit;
+        const unsigned char* matchlimit = iend - lz_last_literals;
+        while (ip < mflimit)
+        {
+            IUINT32 seq = Read32(ip);
+            int h = LZHash(seq);
+            IUINT32 ref = table.pos[h];
+            table.pos[h] = base + (IUINT32)(ip - istart);
+            if (ref < base || Read32(istart + (ref - base)) != seq)
+            {
+                ip += 1 + ((ip - anchor) >> 6); //step up over incompressible runs
+                continue;
+            }
+
+            const unsigned char* match = istart + (ref - base);
+            while (ip > anchor && match > istart && ip[-1] == match[-1])
+            {
+                ip--;
+                match--;
+            }
+            const unsigned char* p = ip + lz_min_match;
+            const unsigned char* m = match + lz_min_match;
+            while (p + 8 <= matchlimit) //8 bytes a step, the first differing byte ends it
+            {
+                IUINT64 diff = Read64(p) ^ Read64(m);
+                if (0 != diff)
+                {
+#if IWORDS_BIG_ENDIAN
+                    int same = __builtin_clzll(diff) >> 3;
+#else
+                    int same = __builtin_ctzll(diff) >> 3;
+#endif
+                    p += same;
+                    m += same;
+                    break;
+                }
+                p += 8;
+                m += 8;
+            }
+            while (p < matchlimit && *p == *m)
+            {
+                p++;
+                m++;
+            }
+
+            int literals = (int)(ip - anchor);
+            int match_len = (int)(p - ip) - lz_min_match;
+            int offset = (int)(ip - match);
+            if (op + literals + literals / 255 + match_len / 255 + 5 > oend)
+            {
+                return -1;
+            }
+
+            unsigned char* token = op++;
+            if (literals >= 15)
+            {
+                *token = 15 << 4;
+                op = WriteLength(op, literals - 15);
+            }
+            else
+            {
+                *token = (unsigned char)(literals << 4);
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+            *op++ = (unsigned char)(offset & 0xff);
+            *op++ = (unsigned char)(offset >> 8);
+            if (match_len >= 15)
+            {
+                *token |= 15;
+                op = WriteLength(op, match_len - 15);
+            }
+            else
+            {
+                *token |= (unsigned char)match_len;
+            }
+
+            ip = p;
+            anchor = ip;
+            if (ip < mflimit)
+            {
+                table.pos[LZHash(Read32(ip - 2))] = base + (IUINT32)(ip - 2 - istart);
+            }
+        }
+    }
+
+    int literals = (int)(iend - anchor);
+    if (op + literals + literals / 255 + 2 > oend)
+    {
+        return -1;
+    }
+    unsigned char* token = op++;
+    if (literals >= 15)
+    {
+        *token = 15 << 4;
+        op = WriteLength(op, literals - 15);
+    }
+    else
+    {
+        *token = (unsigned char)(literals << 4);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    return (int)(op - (unsigned char*)dst);
+}
+
+int KCPCompressor::Decompress(const char* src, int len, char* dst, int capacity)
+{
+    const unsigned char* ip = (const unsigned char*)src;
+    const unsigned char* iend = ip + len;
+    unsigned char* op = (unsigned char*)dst;
+    unsigned char* oend = op + capacity;
+
+    while (ip < iend)
+    {
+        unsigned token = *ip++;
+        size_t literals = token >> 4;
+        if (15 == literals)
+        {
+            unsigned s;
+            do
+            {
+                if (ip >= iend)
+                {
+                    return -1;
+                }
+                s = *ip++;
+                literals += s;
+            } while (255 == s);
+        }
+        if (literals > (size_t)(iend - ip) || literals > (size_t)(oend - op))
+        {
+            return -1;
+        }
+        if (literals <= 16 && iend - ip >= 16 && oend - op >= 16)
+        {
+            memcpy(op, ip, 16); //fixed size, two moves, the excess is overwritten
+        }
+        else
+        {
+            memcpy(op, ip, literals);
+        }
+        op += literals;
+        ip += literals;
+        if (ip == iend) //the last sequence has no match
+        {
+            break;
+        }
+
+        if (iend - ip < 2)
+        {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (0 == offset || offset > (size_t)(op - (unsigned char*)dst))
+        {
+            return -1;
+        }
+        size_t match_len = token & 15;
+        if (15 == match_len)
+        {
+            unsigned s;
+            do
+            {
+                if (ip >= iend)
+                {
+                    return -1;
+                }
+                s = *ip++;
+                match_len += s;
+            } while (255 == s);
+        }
+        match_len += lz_min_match;
+        if (match_len > (size_t)(oend - op))
+        {
+            return -1;
+        }
+
+        const unsigned char* match = op - offset;
+        if (offset >= 16 && (size_t)(oend - op) >= match_len + 16)
+        {
+            unsigned char* end = op + match_len;
+            do //may write up to 15 bytes past the match, still inside dst
+            {
+                memcpy(op, match, 16);
+                op += 16;
+                match += 16;
+            } while (op < end);
+            op = end;
+        }
+        else if (offset >= match_len)
+        {
+            memcpy(op, match, match_len);
+            op += match_len;
+        }
+        else //overlapping, repeats the last offset bytes
+        {
+            for (size_t i = 0; i < match_len; i++)
+            {
+                *op++ = *match++;
+            }
+        }
+    }
+    return (int)(op - (unsigned char*)dst);
+}
+
+int KCPCompressor::Pack(const char* package, int len, char* dst, int capacity)
+{
+    IUINT32 head;
+    if (len <= 4 || capacity <= KCP_PACKAGE_PACKED_HEAD)
+    {
+        return -1;
+    }
+    memcpy(&head, package, 4);
+    if ((int)ntohl(head) != len)
+    {
+        return -1;
+    }
+
+    int block = Compress(package + 4, len - 4, dst + KCP_PACKAGE_PACKED_HEAD,
+        capacity - KCP_PACKAGE_PACKED_HEAD);
+    if (block < 0)
+    {
+        return -1;
+    }
+
+    int packed = KCP_PACKAGE_PACKED_HEAD + block;
+    head = htonl(KCP_PACKAGE_COMPRESSED | (IUINT32)packed);
+    memcpy(dst, &head, 4);
+    memcpy(dst + 4, package, 4); //original length, already big endian
+    return packed;
+}
+
+int KCPCompressor::Unpack(const char* packed, int len, char* dst, int capacity)
+{
+    IUINT32 head;
+    if (!IsPacked(packed, len))
+    {
+        return -1;
+    }
+    memcpy(&head, packed + 4, 4);
+    int original = (int)ntohl(head);
+    if (original <= 4 || original > capacity)
+    {
+        return -1;
+    }
+
+    memcpy(dst, packed + 4, 4);
+    int body = Decompress(packed + KCP_PACKAGE_PACKED_HEAD, len - KCP_PACKAGE_PACKED_HEAD,
+        dst + 4, original - 4);
+    if (body != original - 4)
+    {
+        return -1;
+    }
+    return original;
+}
+
+bool KCPCompressor::IsPacked(const char* package, int len)
+{
+    IUINT32 head;
+    if (len < KCP_PACKAGE_PACKED_HEAD)
+    {
+        return false;
+    }
+    memcpy(&head, package, 4);
+    head = ntohl(head);
+    return 0xffffffffu != head && 0 != (head & KCP_PACKAGE_COMPRESSED) &&
+        (int)(head & ~KCP_PACKAGE_COMPRESSED) == len;
+}
@@ -0,0 +1,615 @@
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+
+#include "kcpfec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KCP_GF_X86 1
+#endif
+
+//GF(2^8) over x^8 + x^4 + x^3 + x^2 + 1, generator 2
+struct KCPGFTables
+{
+    IUINT8 exp[512];
+    IUINT8 log[256];
+    IUINT8 inv[256];
+    IUINT8 mul[256][256];
+    IUINT8 lo[256][16] __attribute__((aligned(16))); //c * x for x < 16
+    IUINT8 hi[256][16] __attribute__((aligned(16))); //c * (x << 4)
+
+    KCPGFTables()
+    {
+        int x = 1;
+        for (int i = 0; i < 255; i++)
+        {
+            exp[i] = (IUINT8)x;
+            exp[i + 255] = (IUINT8)x;
+            log[x] = (IUINT8)i;
+            x <<= 1;
+            if (x & 0x100)
+            {
+                x ^= 0x11d;
+            }
+        }
+        exp[510] = exp[0];
+        exp[511] = exp[1];
+        log[0] = 0;
+
+        for (int a = 0; a < 256; a++)
+        {
+            inv[a] = 0 == a ? 0 : exp[255 - log[a]];
+            for (int b = 0; b < 256; b++)
+            {
+                mul[a][b] = (0 == a || 0 == b) ? 0 : exp[log[a] + log[b]];
+            }
+            for (int n = 0; n < 16; n++)
+            {
+                lo[a][n] = mul[a][n];
+                hi[a][n] = mul[a][n << 4];
+            }
+        }
+    }
+};
+
+static const KCPGFTables gf_tables;
+
+static int DetectKernel()
+{
+#ifdef KCP_GF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return KCP_GF_AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        return KCP_GF_SSSE3;
+    }
+#endif
+    return KCP_GF_SCALAR;
+}
+
+static const int gf_best_kernel = DetectKernel();
+static int gf_kernel = gf_best_kernel;
+
+//parity row i of a group with data_shards k, a Cauchy matrix 1 / (x ^ y)
+//with x = k + i and y = j, so every square submatrix is invertible
+static inline IUINT8 Coefficient(int data_shards, int row, int column)
+{
+    return gf_tables.inv[(data_shards + row) ^ column];
+}
+
+static void MulAddScalar(IUINT8* dst, const IUINT8* src, IUINT8 c, int len)
+{
+    const IUINT8* row = gf_tables.mul[c];
+    for (int i = 0; i < len; i++)
+    {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+#ifdef KCP_GF_X86
+//the product splits into the products of the two nibbles, each a pshufb
+//into a 16 entry table. returns the bytes done, the tail is left over
+__attribute__((target("ssse3")))
+static int MulAddSSSE3(IUINT8* dst, const IUINT8* src, IUINT8 c, int len)
+{
+    const __m128i lo = _mm_load_si128((const __m128i*)gf_tables.lo[c]);
+    const __m128i hi = _mm_load_si128((const __m128i*)gf_tables.hi[c]);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    int i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i l = _mm_and_si128(x, mask);
+        __m128i h = _mm_and_si128(_mm_srli_epi64(x, 4), mask);
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(lo, l), _mm_shuffle_epi8(hi, h));
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(d, p));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static int MulAddAVX2(IUINT8* dst, const IUINT8* src, IUINT8 c, int len)
+{
+    const __m256i lo = _mm256_broadcastsi128_si256(
+        _mm_load_si128((const __m128i*)gf_tables.lo[c]));
+    const __m256i hi = _mm256_broadcastsi128_si256(
+        _mm_load_si128((const __m128i*)gf_tables.hi[c]));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    int i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i l = _mm256_and_si256(x, mask);
+        __m256i h = _mm256_and_si256(_mm256_srli_epi64(x, 4), mask);
+        __m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(lo, l), _mm256_shuffle_epi8(hi, h));
+        __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(d, p));
+    }
+    return i;
+}
+#endif
+
+void KCPReedSolomon::MulAdd(char* dst, const char* src, IUINT8 c, int len)
+{
+    IUINT8* d = (IUINT8*)dst;
+    const IUINT8* s = (const IUINT8*)src;
+    int done = 0;
+
+    if (0 == c)
+    {
+        return;
+    }
+    if (1 == c)
+    {
+        for (int i = 0; i < len; i++)
+        {
+            d[i] ^= s[i];
+        }
+        return;
+    }
+
+#ifdef KCP_GF_X86
+    if (KCP_GF_AVX2 == gf_kernel)
+    {
+        done = MulAddAVX2(d, s, c, len);
+    }
+    if (KCP_GF_AVX2 == gf_kernel || KCP_GF_SSSE3 == gf_kernel)
+    {
+        done += MulAddSSSE3(d + done, s + done, c, len - done);
+    }
+#endif
+    MulAddScalar(d + done, s + done, c, len - done);
+}
+
+bool KCPReedSolomon::Encode(const char* const* data, int data_shards, char* const* parity,
+    int parity_shards, int len)
+{
+    if (data_shards <= 0 || parity_shards <= 0 ||
+        data_shards + parity_shards > KCP_FEC_MAX_SHARDS)
+    {
+        return false;
+    }
+
+    for (int i = 0; i < parity_shards; i++)
+    {
+        memset(parity[i], 0, len);
+        for (int j = 0; j < data_shards; j++)
+        {
+            MulAdd(parity[i], data[j], Coefficient(data_shards, i, j), len);
+        }
+    }
+    return true;
+}
+
+bool KCPReedSolomon::Reconstruct(char* const* shards, const bool* present, int data_shards,
+    int parity_shards, int len)
+{
+    const int k = data_shards;
+    int rows[KCP_FEC_MAX_SHARDS];
+    int count = 0;
+    IUINT8 a[KCP_FEC_MAX_SHARDS][KCP_FEC_MAX_SHARDS];
+    IUINT8 b[KCP_FEC_MAX_SHARDS][KCP_FEC_MAX_SHARDS];
+
+    if (k <= 0 || parity_shards < 0 || k + parity_shards > KCP_FEC_MAX_SHARDS)
+    {
+        return false;
+    }
+
+    //the first k shards that arrived, as rows of the encoding matrix
+    for (int r = 0; r < k + parity_shards && count < k; r++)
+    {
+        if (present[r])
+        {
+            rows[count++] = r;
+        }
+    }
+    if (count < k)
+    {
+        return false;
+    }
+
+    for (int t = 0; t < k; t++)
+    {
+        for (int c = 0; c < k; c++)
+        {
+            a[t][c] = rows[t] < k ? (rows[t] == c) : Coefficient(k, rows[t] - k, c);
+            b[t][c] = (t == c);
+        }
+    }
+
+    //Gauss-Jordan, b ends up as the inverse of a
+    for (int c = 0; c < k; c++)
+    {
+        int pivot = c;
+        while (pivot < k && 0 == a[pivot][c])
+        {
+            pivot++;
+        }
+        if (pivot == k)
+        {
+            return false;
+        }
+        if (pivot != c)
+        {
+            for (int x = 0; x < k; x++)
+            {
+                IUINT8 t = a[c][x]; a[c][x] = a[pivot][x]; a[pivot][x] = t;
+                t = b[c][x]; b[c][x] = b[pivot][x]; b[pivot][x] = t;
+            }
+        }
+        IUINT8 scale = gf_tables.inv[a[c][c]];
+        for (int x = 0; x < k; x++)
+        {
+            a[c][x] = gf_tables.mul[scale][a[c][x]];
+            b[c][x] = gf_tables.mul[scale][b[c][x]];
+        }
+        for (int r = 0; r < k; r++)
+        {
+            IUINT8 f = a[r][c];
+            if (r == c || 0 == f)
+            {
+                continue;
+            }
+            for (int x = 0; x < k; x++)
+            {
+                a[r][x] ^= gf_tables.mul[f][a[c][x]];
+                b[r][x] ^= gf_tables.mul[f][b[c][x]];
+            }
+        }
+    }
+
+    for (int j = 0; j < k; j++)
+    {
+        if (present[j])
+        {
+            continue;
+        }
+        memset(shards[j], 0, len);
+        for (int t = 0; t < k; t++)
+        {
+            MulAdd(shards[j], shards[rows[t]], b[j][t], len);
+        }
+    }
+    return true;
+}
+
+int KCPReedSolomon::GetKernel()
+{
+    return gf_kernel;
+}
+
+int KCPReedSolomon::SetKernel(int kernel)
+{
+    gf_kernel = kernel < gf_best_kernel ? kernel : gf_best_kernel;
+    return gf_kernel;
+}
+
+const char* KCPReedSolomon::GetKernelName(int kernel)
+{
+    switch (kernel)
+    {
+    case KCP_GF_AVX2:
+        return "avx2";
+    case KCP_GF_SSSE3:
+        return "ssse3";
+    default:
+        return "scalar";
+    }
+}
+
+static inline void EncodeU32(char* p, IUINT32 v)
+{
+    p[0] = (char)(v & 0xff);
+    p[1] = (char)((v >> 8) & 0xff);
+    p[2] = (char)((v >> 16) & 0xff);
+    p[3] = (char)((v >> 24) & 0xff);
+}
+
+static inline IUINT32 DecodeU32(const char* p)
+{
+    const IUINT8* u = (const IUINT8*)p;
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((IUINT32)u[3] << 24);
+}
+
+KCPFecEncoder::KCPFecEncoder(IUINT32 conv, int data_shards, int parity_shards,
+    fec_output_func output, void* user) : conv_(conv), output_(output), user_(user),
+    group_(0), count_(0), shard_size_(0)
+{
+    assert(NULL != output_);
+    data_shards_ = data_shards < 1 ? 1 :
+        (data_shards > KCP_FEC_MAX_SHARDS - 1 ? KCP_FEC_MAX_SHARDS - 1 : data_shards);
+    parity_shards_ = parity_shards < 1 ? 1 :
+        (parity_shards > KCP_FEC_MAX_SHARDS - data_shards_ ?
+        KCP_FEC_MAX_SHARDS - data_shards_ : parity_shards);
+    shards_.resize(data_shards_);
+}
+
+void KCPFecEncoder::Encode(const char* buf, int len)
+{
+    assert(len > 0 && len <= KCP_FEC_MAX_DATAGRAM);
+    std::vector<char>& shard = shards_[count_];
+    shard.resize(2 + len);
+    shard[0] = (char)(len & 0xff);
+    shard[1] = (char)(len >> 8);
+    memcpy(&shard[2], buf, len);
+    if (shard_size_ < 2 + len)
+    {
+        shard_size_ = 2 + len;
+    }
+
+    Emit(KCP_FEC_DATA, count_, 0, 0, buf, len);
+    count_++;
+    if (count_ == data_shards_)
+    {
+        Flush();
+    }
+}
+
+void KCPFecEncoder::Flush()
+{
+    if (0 == count_)
+    {
+        return;
+    }
+
+    //too short to earn a whole parity shard, kcp retransmits what it loses
+    if (count_ * parity_shards_ < data_shards_)
+    {
+        NextGroup();
+        return;
+    }
+
+    int parity = (count_ * parity_shards_ + data_shards_ - 1) / data_shards_;
+    const char* data[KCP_FEC_MAX_SHARDS] = { NULL };
+    char* out[KCP_FEC_MAX_SHARDS] = { NULL };
+
+    parity_.resize(parity * shard_size_);
+    for (int j = 0; j < count_; j++)
+    {
+        shards_[j].resize(shard_size_, 0);
+        data[j] = &shards_[j][0];
+    }
+    for (int i = 0; i < parity; i++)
+    {
+        out[i] = &parity_[i * shard_size_];
+    }
+
+    KCPReedSolomon::Encode(data, count_, out, parity, shard_size_);
+    for (int i = 0; i < parity; i++)
+    {
+        Emit(KCP_FEC_PARITY, count_ + i, count_, parity, out[i], shard_size_);
+    }
+    NextGroup();
+}
+
+void KCPFecEncoder::NextGroup()
+{
+    group_++;
+    count_ = 0;
+    shard_size_ = 0;
+}
+
+int KCPFecEncoder::GetDataShards() const
+{
+    return data_shards_;
+}
+
+int KCPFecEncoder::GetParityShards() const
+{
+    return parity_shards_;
+}
+
+void KCPFecEncoder::Emit(IUINT8 flag, int index, int count, int parity, const char* buf, int len)
+{
+    packet_.resize(KCP_FEC_HEAD_LENGTH + len);
+    char* p = &packet_[0];
+    EncodeU32(p, conv_);
+    p[4] = (char)flag;
+    p[5] = (char)index;
+    p[6] = (char)count;
+    p[7] = (char)parity;
+    EncodeU32(p + 8, group_);
+    memcpy(p + KCP_FEC_HEAD_LENGTH, buf, len);
+    output_(p, KCP_FEC_HEAD_LENGTH + len, user_);
+}
+
+KCPFecDecoder::KCPFecDecoder(IUINT32 conv, int data_shards, int parity_shards, 
+    int max_datagram, fec_output_func output, void* user) : conv_(conv), output_(output), 
+    user_(user), recovered_(0)
+{
+    assert(NULL != output_);
+    data_shards_ = data_shards < 1 ? 1 :
+        (data_shards > KCP_FEC_MAX_SHARDS - 1 ? KCP_FEC_MAX_SHARDS - 1 : data_shards);
+    parity_shards_ = parity_shards < 1 ? 1 :
+        (parity_shards > KCP_FEC_MAX_SHARDS - data_shards_ ?
+        KCP_FEC_MAX_SHARDS - data_shards_ : parity_shards);
+    max_datagram_ = std::min(max_datagram, KCP_FEC_HEAD_LENGTH + 2 + KCP_FEC_MAX_DATAGRAM);
+    for (int i = 0; i < WINDOW; i++)
+    {
+        groups_[i].used = false;
+    }
+}
+
+bool KCPFecDecoder::IsFec(const char* data, int len)
+{
+    if (len < KCP_FEC_HEAD_LENGTH)
+    {
+        return false;
+    }
+    IUINT8 flag = (IUINT8)data[4];
+    return KCP_FEC_DATA == flag || KCP_FEC_PARITY == flag;
+}
+
+bool KCPFecDecoder::IsFecData(const char* data, int len)
+{
+    return len > KCP_FEC_HEAD_LENGTH && KCP_FEC_DATA == (IUINT8)data[4];
+}
+
+bool KCPFecDecoder::Input(const char* data, int len)
+{
+    if (!IsFec(data, len) || DecodeU32(data) != conv_)
+    {
+        return false;
+    }
+
+    IUINT8 flag = (IUINT8)data[4];
+    int index = (IUINT8)data[5];
+    int count = (IUINT8)data[6];
+    int parity = (IUINT8)data[7];
+    IUINT32 id = DecodeU32(data + 8);
+    const char* payload = data + KCP_FEC_HEAD_LENGTH;
+    int payload_len = len - KCP_FEC_HEAD_LENGTH;
+
+    if (index >= data_shards_ + parity_shards_ || payload_len <= 0)
+    {
+        return false;
+    }
+
+    if (KCP_FEC_DATA == flag)
+    {
+        if (index >= data_shards_)
+        {
+            return false;
+        }
+        output_(payload, payload_len, user_);
+        if (len > max_datagram_)
+        {
+            return true; //kcp takes it, it is just not kept for a rebuild
+        }
+    }
+    else if (0 == count || count > data_shards_ || parity > parity_shards_ ||
+        index < count || index >= count + parity || len > max_datagram_)
+    {
+        return false;
+    }
+
+    Group* group = GetGroup(id);
+    if (NULL == group || group->done || group->present[index])
+    {
+        return true;
+    }
+
+    std::vector<char>& shard = group->shards[index];
+    if (KCP_FEC_DATA == flag)
+    {
+        shard.resize(2 + payload_len);
+        shard[0] = (char)(payload_len & 0xff);
+        shard[1] = (char)(payload_len >> 8);
+        memcpy(&shard[2], payload, payload_len);
+    }
+    else
+    {
+        if (0 == group->data_shards)
+        {
+            group->data_shards = count;
+            group->parity_shards = parity;
+            group->shard_size = payload_len;
+        }
+        else if (count != group->data_shards || parity != group->parity_shards ||
+            payload_len != group->shard_size)
+        {
+            return false;
+        }
+        shard.assign(payload, payload + payload_len);
+    }
+    group->present[index] = true;
+    group->received++;
+
+    TryRecover(group);
+    return true;
+}
+
+IUINT64 KCPFecDecoder::GetRecovered() const
+{
+    return recovered_;
+}
+
+KCPFecDecoder::Group* KCPFecDecoder::GetGroup(IUINT32 id)
+{
+    Group* group = &groups_[id % WINDOW];
+    if (group->used && group->id == id)
+    {
+        return group;
+    }
+    if (group->used && (IINT32)(id - group->id) < 0)
+    {
+        return NULL; //fell out of the window
+    }
+
+    group->id = id;
+    group->used = true;
+    group->done = false;
+    group->data_shards = 0;
+    group->parity_shards = 0;
+    group->shard_size = 0;
+    group->received = 0;
+    memset(group->present, 0, sizeof(group->present));
+    return group;
+}
+
+void KCPFecDecoder::TryRecover(Group* group)
+{
+    const int k = group->data_shards;
+    const int n = k + group->parity_shards;
+    if (0 == k || group->received < k)
+    {
+        return;
+    }
+
+    int present = 0;
+    int missing = 0;
+    for (int r = 0; r < n; r++)
+    {
+        present += group->present[r] ? 1 : 0;
+        missing += (r < k && !group->present[r]) ? 1 : 0;
+    }
+    if (0 == missing)
+    {
+        group->done = true;
+        return;
+    }
+    if (present < k)
+    {
+        return;
+    }
+
+    char* shards[KCP_FEC_MAX_SHARDS];
+    for (int r = 0; r < n; r++)
+    {
+        std::vector<char>& shard = group->shards[r];
+        if (group->present[r] && (int)shard.size() > group->shard_size)
+        {
+            group->done = true; //a data shard longer than the parity, not ours
+            return;
+        }
+        shard.resize(group->shard_size, 0);
+        shards[r] = &shard[0];
+    }
+
+    group->done = true;
+    if (!KCPReedSolomon::Reconstruct(shards, group->present, k, group->parity_shards,
+        group->shard_size))
+    {
+        return;
+    }
+
+    for (int j = 0; j < k; j++)
+    {
+        if (group->present[j])
+        {
+            continue;
+        }
+        const IUINT8* shard = (const IUINT8*)shards[j];
+        int len = shard[0] | (shard[1] << 8);
+        if (len > 0 && len + 2 <= group->shard_size)
+        {
+            recovered_++;
+            output_(shards[j] + 2, len, user_);
+        }
+    }
+}
@@ -0,0 +1,317 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <assert.h>
+#include <arpa/inet.h>
+#include <algorithm>
+
+#include "kcpiobackend.h"
+#include "kcpserver.h"
+
+KCPRecvSlots::KCPRecvSlots() : slot_size_(0)
+{
+}
+
+void KCPRecvSlots::Init(int count, int slot_size)
+{
+    slot_size_ = slot_size;
+    buf_.resize((size_t)count * slot_size);
+    addrs_.resize(count);
+    iovs_.resize(count);
+    controls_.resize(count * KCP_GRO_CONTROL_SIZE);
+}
+
+void KCPRecvSlots::Prepare(int index, msghdr* hdr)
+{
+    iovs_[index].iov_base = GetData(index);
+    iovs_[index].iov_len = slot_size_;
+
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_name = &addrs_[index];
+    hdr->msg_namelen = sizeof(sockaddr_in);
+    hdr->msg_iov = &iovs_[index];
+    hdr->msg_iovlen = 1;
+    hdr->msg_control = &controls_[index * KCP_GRO_CONTROL_SIZE];
+    hdr->msg_controllen = KCP_GRO_CONTROL_SIZE;
+}
+
+int KCPRecvSlots::GetSize() const
+{
+    return (int)addrs_.size();
+}
+
+int KCPRecvSlots::GetSlotSize() const
+{
+    return slot_size_;
+}
+
+char* KCPRecvSlots::GetData(int index)
+{
+    return &buf_[(size_t)index * slot_size_];
+}
+
+KCPIOBackend::KCPIOBackend(KCPServer* server) : server_(server), fd_(-1)
+{
+}
+
+KCPIOBackend::~KCPIOBackend()
+{
+}
+
+bool KCPIOBackend::HasPending() const
+{
+    return false;
+}
+
+void KCPIOBackend::OnReceived(const msghdr& hdr, const char* data, int len, int capacity)
+{
+    KCPServerStats& stats = server_->stats_;
+    if (hdr.msg_flags & MSG_TRUNC)
+    {
+        stats.recv_packets++;
+        stats.recv_invalid++;
+        DoErrorLog("kcp package truncated, larger than %d", capacity);
+        return;
+    }
+
+    //with UDP_GRO the kernel may hand over a run of same size datagrams
+    //from one peer, cut it back into datagrams where it lies
+    int seg_size = len;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL; 
+        cmsg = CMSG_NXTHDR((msghdr*)&hdr, cmsg))
+    {
+        if (SOL_UDP == cmsg->cmsg_level && UDP_GRO == cmsg->cmsg_type)
+        {
+            int gso_size = 0;
+            memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+            if (gso_size > 0 && gso_size < len)
+            {
+                seg_size = gso_size;
+            }
+            break;
+        }
+    }
+
+    const sockaddr_in& addr = *(const sockaddr_in*)hdr.msg_name;
+    for (int offset = 0; offset < len; offset += seg_size)
+    {
+        stats.recv_packets++;
+        if (seg_size < len)
+        {
+            stats.recv_coalesced++;
+        }
+        server_->HandleDatagram(addr, hdr.msg_namelen, data + offset, 
+            std::min(seg_size, len - offset));
+    }
+}
+
+void KCPIOBackend::OnRecvBatch(int count)
+{
+    KCPServerStats& stats = server_->stats_;
+    stats.recv_calls++;
+    if ((IUINT64)count > stats.recv_batch_max)
+    {
+        stats.recv_batch_max = count;
+    }
+}
+
+void KCPIOBackend::OnSendCall()
+{
+    server_->stats_.send_calls++;
+}
+
+void KCPIOBackend::OnSent(const KCPOutputQueue* queue, int index)
+{
+    int segments = queue->GetSegments(index);
+    server_->stats_.send_packets += segments;
+    if (segments > 1)
+    {
+        server_->stats_.send_segmented += segments;
+    }
+}
+
+void KCPIOBackend::OnSendAgain()
+{
+    server_->stats_.send_eagain++;
+}
+
+void KCPIOBackend::OnSendDropped()
+{
+    server_->stats_.send_dropped++;
+}
+
+bool KCPIOBackend::OnSegmentError(KCPOutputQueue* queue, int index, int error)
+{
+    //EIO: the device cannot checksum the segments, EINVAL: too many segments
+    if (queue->GetSegments(index) <= 1 || (EIO != error && EINVAL != error))
+    {
+        return false;
+    }
+
+    DoErrorLog("udp segmentation send error:%s, fall back to one datagram per send", 
+        strerror(error));
+    queue->SetSegmentation(false);
+
+    const sockaddr_in& addr = queue->GetAddr(index);
+    const char* data = queue->GetData(index);
+    int len = queue->GetLength(index);
+    int seg_size = queue->GetSegmentSize(index);
+    for (int offset = 0; offset < len; offset += seg_size)
+    {
+        int size = std::min(seg_size, len - offset);
+        if (sendto(fd_, data + offset, size, 0, (const sockaddr*)&addr, sizeof(addr)) < 0)
+        {
+            OnSendDropped();
+            continue;
+        }
+        server_->stats_.send_packets++;
+    }
+    OnSendCall();
+    return true;
+}
+
+void KCPIOBackend::DoErrorLog(const char *fmt, ...)
+{
+    char buffer[1024];
+    va_list argptr;
+    va_start(argptr, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, argptr);
+    va_end(argptr);
+    server_->DoErrorLog("%s", buffer);
+}
+
+KCPIOBackend* KCPIOBackend::Create(KCPServer* server, int type, int fd, 
+    int recv_batch_size, int recv_slot_size, int send_batch_size)
+{
+    if (KCP_IO_URING == type)
+    {
+        KCPIOBackend* backend = new KCPUringBackend(server, recv_batch_size, 
+            recv_slot_size, send_batch_size);
+        if (backend->Init(fd))
+        {
+            return backend;
+        }
+        delete backend;
+        server->DoErrorLog("io_uring backend unavailable, fall back to recvmmsg/sendmmsg");
+    }
+
+    KCPIOBackend* backend = new KCPSyscallBackend(server, recv_batch_size, recv_slot_size);
+    if (!backend->Init(fd))
+    {
+        delete backend;
+        return NULL;
+    }
+    return backend;
+}
+
+KCPSyscallBackend::KCPSyscallBackend(KCPServer* server, int recv_batch_size, 
+    int recv_slot_size) : KCPIOBackend(server), 
+    batch_size_(recv_batch_size > 0 ? recv_batch_size : 1), slot_size_(recv_slot_size)
+{
+}
+
+KCPSyscallBackend::~KCPSyscallBackend()
+{
+}
+
+bool KCPSyscallBackend::Init(int fd)
+{
+    fd_ = fd;
+    recv_slots_.Init(batch_size_, slot_size_);
+    recv_msgs_.resize(batch_size_);
+    return true;
+}
+
+int KCPSyscallBackend::GetPollFd() const
+{
+    return fd_;
+}
+
+void KCPSyscallBackend::Read()
+{
+    assert(fd_ > 0);
+    do
+    {
+        for (int i = 0; i < batch_size_; i++)
+        {
+            recv_slots_.Prepare(i, &recv_msgs_[i].msg_hdr);
+        }
+
+        int n = recvmmsg(fd_, &recv_msgs_[0], batch_size_, 0, NULL);
+        if (n <= 0)
+        {
+            if (n < 0 && EAGAIN != errno && EINTR != errno) //system call error
+            {
+                DoErrorLog("call recvmmsg error(%d):%s", errno, strerror(errno));
+            }
+            break;
+        }
+
+        OnRecvBatch(n);
+        for (int i = 0; i < n; i++)
+        {
+            OnReceived(recv_msgs_[i].msg_hdr, recv_slots_.GetData(i), 
+                (int)recv_msgs_[i].msg_len, slot_size_);
+        }
+
+        if (n < batch_size_) //socket drained
+        {
+            break;
+        }
+    } while (true);
+}
+
+void KCPSyscallBackend::Flush(KCPOutputQueue* queue)
+{
+    assert(fd_ > 0);
+    mmsghdr* msgs = queue->GetMessages();
+    int count = queue->GetSize();
+    int sent = 0;
+    while (sent < count)
+    {
+        int n = sendmmsg(fd_, msgs + sent, count - sent, 0);
+        if (n > 0)
+        {
+            OnSendCall();
+            for (int i = sent; i < sent + n; i++)
+            {
+                OnSent(queue, i);
+            }
+            sent += n;
+            continue;
+        }
+
+        if (EINTR == errno)
+        {
+            continue;
+        }
+        if (EAGAIN == errno || EWOULDBLOCK == errno || ENOBUFS == errno)
+        {
+            //keep the rest queued, they go out first on the next flush
+            OnSendAgain();
+            break;
+        }
+
+        if (OnSegmentError(queue, sent, errno))
+        {
+            sent++;
+            continue;
+        }
+
+        //the first datagram failed, drop it and go on with the others
+        const sockaddr_in& addr = queue->GetAddr(sent);
+        DoErrorLog("udp send data size(%d) to address(%s) port(%d) error:%s",
+            (int)msgs[sent].msg_hdr.msg_iov->iov_len, inet_ntoa(addr.sin_addr), 
+            ntohs(addr.sin_port), strerror(errno));
+        OnSendDropped();
+        sent++;
+    }
+
+    queue->Pop(sent);
+}
+
+const char* KCPSyscallBackend::GetName() const
+{
+    return "syscall";
+}
@@ -0,0 +1,236 @@
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <algorithm>
+
+#include "kcpoutputqueue.h"
+
+const size_t KCP_GSO_CONTROL_SIZE = CMSG_SPACE(sizeof(uint16_t));
+
+KCPOutputQueue::KCPOutputQueue() : segmentation_(false), count_(0), arena_used_(0)
+{
+}
+
+KCPOutputQueue::~KCPOutputQueue()
+{
+}
+
+void KCPOutputQueue::Init(int capacity, int slot_size)
+{
+    assert(capacity > 0 && slot_size > 0);
+    count_ = 0;
+    arena_used_ = 0;
+    entries_.resize(capacity);
+    arena_.resize((size_t)capacity * slot_size);
+    iovs_.resize(capacity);
+    msgs_.resize(capacity);
+    controls_.resize(capacity * KCP_GSO_CONTROL_SIZE);
+}
+
+void KCPOutputQueue::Clear()
+{
+    count_ = 0;
+    arena_used_ = 0;
+    entries_.clear();
+    arena_.clear();
+    iovs_.clear();
+    msgs_.clear();
+    controls_.clear();
+}
+
+void KCPOutputQueue::SetSegmentation(bool enable)
+{
+    segmentation_ = enable;
+}
+
+bool KCPOutputQueue::Push(const KCPAddr& addr, const char* data, int len)
+{
+    if (segmentation_ && Append(addr, data, len))
+    {
+        return true;
+    }
+
+    if (IsFull() || arena_used_ + len > (int)arena_.size())
+    {
+        return false;
+    }
+
+    Entry& entry = entries_[count_];
+    entry.addr = addr.sockaddr;
+    entry.addr_len = addr.sock_len;
+    entry.offset = arena_used_;
+    entry.len = len;
+    entry.seg_size = len;
+    entry.seg_count = 1;
+    memcpy(&arena_[arena_used_], data, len);
+    arena_used_ += len;
+    count_++;
+    return true;
+}
+
+bool KCPOutputQueue::Append(const KCPAddr& addr, const char* data, int len)
+{
+    if (0 == count_)
+    {
+        return false;
+    }
+
+    //only the last segment may be short, and it closes the entry
+    Entry& entry = entries_[count_ - 1];
+    if (entry.seg_count >= KCP_GSO_MAX_SEGMENTS || 0 != entry.len % entry.seg_size 
+        || len > entry.seg_size || entry.len + len > KCP_GSO_MAX_BYTES 
+        || arena_used_ + len > (int)arena_.size())
+    {
+        return false;
+    }
+    if (entry.addr.sin_addr.s_addr != addr.sockaddr.sin_addr.s_addr 
+        || entry.addr.sin_port != addr.sockaddr.sin_port)
+    {
+        return false;
+    }
+
+    //the last entry always ends at the arena tail
+    assert(entry.offset + entry.len == arena_used_);
+    memcpy(&arena_[arena_used_], data, len);
+    arena_used_ += len;
+    entry.len += len;
+    entry.seg_count++;
+    return true;
+}
+
+void KCPOutputQueue::Pop(int count)
+{
+    assert(count >= 0 && count <= count_);
+    if (count == count_)
+    {
+        count_ = 0;
+        arena_used_ = 0;
+        return;
+    }
+
+    //only reached when the socket pushed back, move the rest to the front
+    int base = entries_[count].offset;
+    memmove(&arena_[0], &arena_[base], arena_used_ - base);
+    arena_used_ -= base;
+    for (int i = count; i < count_; i++)
+    {
+        entries_[i - count] = entries_[i];
+        entries_[i - count].offset -= base;
+    }
+    count_ -= count;
+}
+
+void KCPOutputQueue::Remove(const char* done)
+{
+    //completions may come back out of order, compact the survivors
+    int kept = 0;
+    int used = 0;
+    for (int i = 0; i < count_; i++)
+    {
+        if (done[i])
+        {
+            continue;
+        }
+
+        Entry entry = entries_[i];
+        if (entry.offset != used)
+        {
+            memmove(&arena_[used], &arena_[entry.offset], entry.len);
+            entry.offset = used;
+        }
+        entries_[kept++] = entry;
+        used += entry.len;
+    }
+    count_ = kept;
+    arena_used_ = used;
+}
+
+void KCPOutputQueue::Swap(KCPOutputQueue* other)
+{
+    std::swap(count_, other->count_);
+    std::swap(arena_used_, other->arena_used_);
+    entries_.swap(other->entries_);
+    arena_.swap(other->arena_);
+    iovs_.swap(other->iovs_);
+    msgs_.swap(other->msgs_);
+    controls_.swap(other->controls_);
+}
+
+mmsghdr* KCPOutputQueue::GetMessages()
+{
+    for (int i = 0; i < count_; i++)
+    {
+        Entry& entry = entries_[i];
+        iovs_[i].iov_base = &arena_[entry.offset];
+        iovs_[i].iov_len = entry.len;
+
+        msghdr& hdr = msgs_[i].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = &entry.addr;
+        hdr.msg_namelen = entry.addr_len;
+        hdr.msg_iov = &iovs_[i];
+        hdr.msg_iovlen = 1;
+        msgs_[i].msg_len = 0;
+
+        if (entry.seg_count > 1)
+        {
+            char* control = &controls_[i * KCP_GSO_CONTROL_SIZE];
+            memset(control, 0, KCP_GSO_CONTROL_SIZE);
+            hdr.msg_control = control;
+            hdr.msg_controllen = KCP_GSO_CONTROL_SIZE;
+
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t seg_size = (uint16_t)entry.seg_size;
+            memcpy(CMSG_DATA(cmsg), &seg_size, sizeof(seg_size));
+        }
+    }
+    return count_ > 0 ? &msgs_[0] : NULL;
+}
+
+const sockaddr_in& KCPOutputQueue::GetAddr(int index) const
+{
+    assert(index >= 0 && index < count_);
+    return entries_[index].addr;
+}
+
+const char* KCPOutputQueue::GetData(int index) const
+{
+    assert(index >= 0 && index < count_);
+    return &arena_[entries_[index].offset];
+}
+
+int KCPOutputQueue::GetLength(int index) const
+{
+    assert(index >= 0 && index < count_);
+    return entries_[index].len;
+}
+
+int KCPOutputQueue::GetSegmentSize(int index) const
+{
+    assert(index >= 0 && index < count_);
+    return entries_[index].seg_size;
+}
+
+int KCPOutputQueue::GetSegments(int index) const
+{
+    assert(index >= 0 && index < count_);
+    return entries_[index].seg_count;
+}
+
+int KCPOutputQueue::GetSize() const
+{
+    return count_;
+}
+
+bool KCPOutputQueue::IsEmpty() const
+{
+    return 0 == count_;
+}
+
+bool KCPOutputQueue::IsFull() const
+{
+    return count_ >= (int)entries_.size();
+}
@@ -0,0 +1,394 @@
+#include <stdlib.h>
+#include <string.h>
+#include <mutex>
+
+#include "kcppool.h"
+
+const int KCP_POOL_KEEP_BYTES = 1024 * 1024; //free bytes a class keeps, the rest go back to the heap
+
+KCPBufferPool::KCPBufferPool()
+{
+}
+
+KCPBufferPool::~KCPBufferPool()
+{
+    for (int i = 0; i < CLASS_COUNT; i++)
+    {
+        for (size_t j = 0; j < free_[i].size(); j++)
+        {
+            delete[] free_[i][j];
+        }
+    }
+}
+
+int KCPBufferPool::GetClassSize(int size)
+{
+    int capacity = 1 << MIN_SHIFT;
+    while (capacity < size)
+    {
+        capacity <<= 1;
+    }
+    return capacity <= (1 << MAX_SHIFT) ? capacity : 0;
+}
+
+int KCPBufferPool::GetClass(int capacity)
+{
+    int index = 0;
+    while ((1 << (MIN_SHIFT + index)) < capacity)
+    {
+        index++;
+    }
+    return index;
+}
+
+char* KCPBufferPool::Alloc(int size, int* capacity)
+{
+    assert(NULL != capacity);
+    *capacity = GetClassSize(size);
+    if (0 == *capacity)
+    {
+        return NULL;
+    }
+
+    std::vector<char*>& list = free_[GetClass(*capacity)];
+    if (list.empty())
+    {
+        return new char[*capacity];
+    }
+
+    char* buffer = list.back();
+    list.pop_back();
+    return buffer;
+}
+
+void KCPBufferPool::Free(char* buffer, int capacity)
+{
+    if (NULL == buffer)
+    {
+        return;
+    }
+
+    std::vector<char*>& list = free_[GetClass(capacity)];
+    if ((int)(list.size() + 1) * capacity > KCP_POOL_KEEP_BYTES)
+    {
+        delete[] buffer;
+        return;
+    }
+    list.push_back(buffer);
+}
+
+//in front of every segment block, 16 bytes keeps the payload aligned
+struct KCPSegmentHeader
+{
+    IUINT64 cls; //class index, CLASS_COUNT for a large block
+    IUINT64 magic; //checked by Free in debug builds
+};
+
+//free blocks are chained through their payload
+struct KCPSegmentNode
+{
+    KCPSegmentNode* next;
+};
+
+struct KCPSegmentCache
+{
+    KCPSegmentNode* head[KCPSegmentAllocator::CLASS_COUNT];
+    int count[KCPSegmentAllocator::CLASS_COUNT];
+    IUINT64 hits;
+    IUINT64 misses;
+    IUINT64 large;
+    KCPSegmentCache* prev; //live caches, walked by GetStats
+    KCPSegmentCache* next;
+};
+
+const IUINT64 KCP_SEGMENT_MAGIC = 0x4b43505345474d54ULL;
+const int KCP_SEGMENT_CLASSES = KCPSegmentAllocator::CLASS_COUNT;
+
+//plain statics only, Free can still run from destructors at process exit
+static std::mutex g_segment_mutex;
+static bool g_segment_installed = false;
+static int g_segment_class_size[KCP_SEGMENT_CLASSES]; //whole block, header included
+static KCPSegmentNode* g_segment_depot[KCP_SEGMENT_CLASSES];
+static KCPSegmentCache* g_segment_caches = NULL;
+static KCPSegmentAllocatorStats g_segment_retired; //exited threads
+static IUINT64 g_segment_bytes_held = 0;
+static __thread KCPSegmentCache* t_segment_cache = NULL;
+static __thread bool t_segment_exited = false;
+
+static inline void CountSegment(IUINT64* counter)
+{
+    //only the owning thread writes, GetStats reads from any thread
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+static int GetSegmentClass(size_t size)
+{
+    size += sizeof(KCPSegmentHeader);
+    for (int i = 0; i < KCP_SEGMENT_CLASSES; i++)
+    {
+        if (size <= (size_t)g_segment_class_size[i])
+        {
+            return i;
+        }
+    }
+    return KCP_SEGMENT_CLASSES;
+}
+
+//detach up to count blocks of a class from the depot, carving a new slab 
+//when it runs dry. caller holds g_segment_mutex
+static KCPSegmentNode* TakeSegments(int cls, int count, int* taken)
+{
+    if (NULL == g_segment_depot[cls])
+    {
+        int size = g_segment_class_size[cls];
+        char* slab = (char*)malloc((size_t)size * KCPSegmentAllocator::REFILL_COUNT);
+        if (NULL == slab)
+        {
+            *taken = 0;
+            return NULL;
+        }
+        g_segment_bytes_held += (IUINT64)size * KCPSegmentAllocator::REFILL_COUNT;
+
+        for (int i = KCPSegmentAllocator::REFILL_COUNT - 1; i >= 0; i--)
+        {
+            KCPSegmentHeader* header = (KCPSegmentHeader*)(slab + (size_t)size * i);
+            header->cls = cls;
+            header->magic = KCP_SEGMENT_MAGIC;
+            KCPSegmentNode* node = (KCPSegmentNode*)(header + 1);
+            node->next = g_segment_depot[cls];
+            g_segment_depot[cls] = node;
+        }
+    }
+
+    KCPSegmentNode* head = g_segment_depot[cls];
+    KCPSegmentNode* tail = head;
+    int n = 1;
+    while (n < count && tail->next != NULL)
+    {
+        tail = tail->next;
+        n++;
+    }
+    g_segment_depot[cls] = tail->next;
+    tail->next = NULL;
+    *taken = n;
+    return head;
+}
+
+//caller holds g_segment_mutex
+static void GiveSegments(int cls, KCPSegmentNode* head, KCPSegmentNode* tail)
+{
+    tail->next = g_segment_depot[cls];
+    g_segment_depot[cls] = head;
+}
+
+//owns the calling thread's cache, hands every block back when the thread exits
+struct KCPSegmentCacheHolder
+{
+    KCPSegmentCacheHolder()
+    {
+        memset(&cache, 0, sizeof(cache));
+        std::lock_guard<std::mutex> lock(g_segment_mutex);
+        cache.next = g_segment_caches;
+        if (g_segment_caches != NULL)
+        {
+            g_segment_caches->prev = &cache;
+        }
+        g_segment_caches = &cache;
+    }
+
+    ~KCPSegmentCacheHolder()
+    {
+        std::lock_guard<std::mutex> lock(g_segment_mutex);
+        for (int i = 0; i < KCP_SEGMENT_CLASSES; i++)
+        {
+            KCPSegmentNode* node = cache.head[i];
+            while (node != NULL)
+            {
+                KCPSegmentNode* next = node->next;
+                GiveSegments(i, node, node);
+                node = next;
+            }
+        }
+        g_segment_retired.hits += cache.hits;
+        g_segment_retired.misses += cache.misses;
+        g_segment_retired.large += cache.large;
+
+        if (cache.prev != NULL)
+        {
+            cache.prev->next = cache.next;
+        }
+        else
+        {
+            g_segment_caches = cache.next;
+        }
+        if (cache.next != NULL)
+        {
+            cache.next->prev = cache.prev;
+        }
+        t_segment_cache = NULL;
+        t_segment_exited = true;
+    }
+
+    KCPSegmentCache cache;
+};
+
+//NULL once the thread's cache has been torn down
+static KCPSegmentCache* GetSegmentCache()
+{
+    if (t_segment_cache != NULL || t_segment_exited)
+    {
+        return t_segment_cache;
+    }
+    static thread_local KCPSegmentCacheHolder holder;
+    t_segment_cache = &holder.cache;
+    return t_segment_cache;
+}
+
+KCPSegmentAllocatorStats::KCPSegmentAllocatorStats()
+{
+    hits = 0;
+    misses = 0;
+    large = 0;
+    bytes_held = 0;
+}
+
+bool KCPSegmentAllocator::Install(int mss)
+{
+    if (mss <= 0)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(g_segment_mutex);
+    if (g_segment_installed)
+    {
+        return true;
+    }
+    for (int i = 0; i < CLASS_COUNT; i++)
+    {
+        size_t size = sizeof(KCPSegmentHeader) + sizeof(IKCPSEG) + (mss >> (CLASS_COUNT - 1 - i));
+        g_segment_class_size[i] = (int)((size + 15) & ~(size_t)15);
+    }
+
+    //every block Free sees then comes from Malloc and carries our header
+    if (ikcp_allocator(Malloc, Free) < 0)
+    {
+        return false;
+    }
+    g_segment_installed = true;
+    return true;
+}
+
+void* KCPSegmentAllocator::Malloc(size_t size)
+{
+    int cls = GetSegmentClass(size);
+    KCPSegmentCache* cache = GetSegmentCache();
+    if (CLASS_COUNT == cls)
+    {
+        KCPSegmentHeader* header = (KCPSegmentHeader*)malloc(sizeof(KCPSegmentHeader) + size);
+        if (NULL == header)
+        {
+            return NULL;
+        }
+        header->cls = CLASS_COUNT;
+        header->magic = KCP_SEGMENT_MAGIC;
+        if (cache != NULL)
+        {
+            CountSegment(&cache->large);
+        }
+        return header + 1;
+    }
+
+    if (NULL == cache)
+    {
+        //thread is exiting, go to the depot directly
+        std::lock_guard<std::mutex> lock(g_segment_mutex);
+        int taken = 0;
+        return TakeSegments(cls, 1, &taken);
+    }
+
+    if (NULL == cache->head[cls])
+    {
+        CountSegment(&cache->misses);
+        std::lock_guard<std::mutex> lock(g_segment_mutex);
+        cache->head[cls] = TakeSegments(cls, REFILL_COUNT, &cache->count[cls]);
+        if (NULL == cache->head[cls])
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        CountSegment(&cache->hits);
+    }
+
+    KCPSegmentNode* node = cache->head[cls];
+    cache->head[cls] = node->next;
+    cache->count[cls]--;
+    return node;
+}
+
+void KCPSegmentAllocator::Free(void* ptr)
+{
+    if (NULL == ptr)
+    {
+        return;
+    }
+
+    KCPSegmentHeader* header = (KCPSegmentHeader*)ptr - 1;
+    assert(KCP_SEGMENT_MAGIC == header->magic);
+    int cls = (int)header->cls;
+    if (CLASS_COUNT == cls)
+    {
+        free(header);
+        return;
+    }
+
+    KCPSegmentNode* node = (KCPSegmentNode*)ptr;
+    KCPSegmentCache* cache = GetSegmentCache();
+    if (NULL == cache)
+    {
+        std::lock_guard<std::mutex> lock(g_segment_mutex);
+        GiveSegments(cls, node, node);
+        return;
+    }
+
+    node->next = cache->head[cls];
+    cache->head[cls] = node;
+    if (++cache->count[cls] < 2 * REFILL_COUNT)
+    {
+        return;
+    }
+
+    //keep REFILL_COUNT, the rest go back for other threads
+    KCPSegmentNode* tail = node;
+    for (int i = 1; i < REFILL_COUNT; i++)
+    {
+        tail = tail->next;
+    }
+    KCPSegmentNode* head = tail->next;
+    tail->next = NULL;
+    tail = head;
+    while (tail->next != NULL)
+    {
+        tail = tail->next;
+    }
+    cache->count[cls] = REFILL_COUNT;
+
+    std::lock_guard<std::mutex> lock(g_segment_mutex);
+    GiveSegments(cls, head, tail);
+}
+
+KCPSegmentAllocatorStats KCPSegmentAllocator::GetStats()
+{
+    std::lock_guard<std::mutex> lock(g_segment_mutex);
+    KCPSegmentAllocatorStats stats = g_segment_retired;
+    for (KCPSegmentCache* cache = g_segment_caches; cache != NULL; cache = cache->next)
+    {
+        stats.hits += __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+        stats.misses += __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+        stats.large += __atomic_load_n(&cache->large, __ATOMIC_RELAXED);
+    }
+    stats.bytes_held = g_segment_bytes_held;
+    return stats;
+}
@@ -1,277 +1,1635 @@
-#include <stdio.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-#include <assert.h>
-#include <fcntl.h>
-#include <stdarg.h>
-
-#include "kcpserver.h"
-
-const IUINT32 KCP_HEAD_LENGTH = 24;
-
-KCPOptions::KCPOptions()
-{
-    port = 9527;
-    keep_session_time = 5 * 1000; //5s //5000ms
-    recv_cb = NULL;
-    kick_cb = NULL;
-    error_reporter = NULL;
-}
-
-KCPServer::KCPServer(const KCPOptions& options) :
-    options_(options), fd_(0), current_clock_(0)
-{
-}
-
-KCPServer::KCPServer() : fd_(0), current_clock_(0)
-{
-
-}
-
-KCPServer::~KCPServer()
-{
-    Clear();
-}
-
-bool KCPServer::Start()
-{
-    bool ret = false;
-    do 
-    {
-        if (!UDPBind())
-        {
-            break;
-        }
-
-        ret = true;
-    } while (false);
-
-    if (!ret)
-    {
-        Clear();
-    }
-
-    return ret;
-}
-
-void KCPServer::Update()
-{
-    current_clock_ = iclock();
-    UDPRead();
-    SessionUpdate();
-}
-
-bool KCPServer::Send(int conv, const char* data, int len)
-{
-    KCPSession* session = GetSession(conv);
-    if (NULL == session)
-    {
-        DoErrorLog("no session(%d) find", conv);
-        return false;
-    }
-
-    if (session->Send(data, len) < 0)
-    {
-        DoErrorLog("session(%d) send data failed", conv);
-        return false;
-    }
-
-    return true;
-}
-
-void KCPServer::KickSession(int conv)
-{
-    auto it = sessions_.find(conv);
-    if (it == sessions_.end())
-    {
-        return;
-    }
-
-    delete it->second;
-    sessions_.erase(it);
-}
-
-bool KCPServer::SessionExist(int conv) const
-{
-    return sessions_.find(conv) != sessions_.end();
-}
-
-void KCPServer::SetOption(const KCPOptions& options)
-{
-    options_ = options;
-}
-
-bool KCPServer::UDPBind()
-{
-    sockaddr_in server_addr;
-    fd_ = socket(AF_INET, SOCK_DGRAM, 0);
-    if (fd_ < 0)
-    {
-        DoErrorLog("call socket error:%s", strerror(errno));
-        return false;
-    }
-
-    int flag = fcntl(fd_, F_GETFL, 0);
-    flag |= O_NONBLOCK;
-    if (-1 == fcntl(fd_, F_SETFL, flag))
-    {
-        DoErrorLog("set socket non block error:%s", strerror(errno));
-        return false;
-    }
-
-    int opt = 1;
-    if (0 != setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
-    {
-        DoErrorLog("set socket reuse addr error:%s", strerror(errno));
-        return false;
-    }
-
-    int val = 10 * 1024 * 1024; //10M
-    if (0 != setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)))
-    {
-        DoErrorLog("set socket recv buf error:%s", strerror(errno));
-        return false;
-    }
-
-    if (0 != setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val)))
-    {
-        DoErrorLog("set socket send buf error:%s", strerror(errno));
-        return false;
-    }
-
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_addr.sin_port = htons(options_.port);
-    if (0 != bind(fd_, (const sockaddr*)&server_addr, sizeof(server_addr)))
-    {
-        DoErrorLog("call bind error:%s", strerror(errno));
-        return false;
-    }
-
-    return true;
-}
-
-
-void KCPServer::Clear()
-{
-    fd_ = 0;
-    for (auto it = sessions_.begin(); it != sessions_.end(); ++it)
-    {
-        delete it->second;
-    }
-    sessions_.clear();
-}
-
-KCPSession* KCPServer::GetSession(int conv)
-{
-    auto it = sessions_.find(conv);
-    if (it != sessions_.end())
-    {
-        return it->second;
-    }
-    return NULL;
-}
-
-void KCPServer::DoOutput(const KCPAddr& addr, const char* data, int len)
-{
-    assert(fd_ > 0);
-    if (-1 == sendto(fd_, data, len, 0, (sockaddr*)&addr.sockaddr, addr.sock_len))
-    {
-        DoErrorLog("udp send data size(%d) to address(%s) port(%d) error:%s",
-            len, inet_ntoa(addr.sockaddr.sin_addr), ntohs(addr.sockaddr.sin_port),
-            strerror(errno));
-        return;
-    }
-}
-
-void KCPServer::UDPRead()
-{
-    assert(fd_ > 0);
-
-    static char buf[64 * 1024];
-    do
-    {
-        sockaddr_in cliaddr;
-        socklen_t len = sizeof(cliaddr);
-        memset(&cliaddr, 0, sizeof(cliaddr));
-        ssize_t n = recvfrom(fd_, buf, sizeof(buf), 0, (sockaddr*)&cliaddr, &len);
-        if (n < 0) 
-        {
-            if (EAGAIN != errno && EINTR != errno) //system call error
-            {
-                DoErrorLog("call recv from error(%d):%s", errno, strerror(errno));
-            }
-            break;
-        }
-
-        if (n < KCP_HEAD_LENGTH)
-        {
-            DoErrorLog("kcp package len(%d) invalid", n);
-            break;
-        }
-
-        int conv = ikcp_getconv(buf);
-        KCPSession* session = GetSession(conv);
-        if (NULL == session)
-        {
-            session = NewKCPSession(this, KCPAddr(cliaddr, len), conv, current_clock_);
-            sessions_[conv] = session;
-        }
-        assert(NULL != session);
-        session->KCPInput(cliaddr, len, buf, n, current_clock_);
-    } while (true);
-}
-
-void KCPServer::SessionUpdate()
-{
-    IUINT32 current = current_clock_ & 0xfffffffflu;
-    for (auto it = sessions_.begin(); it != sessions_.end();)
-    {
-        KCPSession* session = it->second;
-
-        if (options_.keep_session_time > 0 && 
-            current_clock_ > session->LastActiveTime() + options_.keep_session_time)
-        {
-            DoErrorLog("conv(%d) timeout, kick it", it->first);
-            if (NULL != options_.kick_cb)
-            {
-                options_.kick_cb(it->first);
-            }
-            delete session;
-            sessions_.erase(it++);
-            continue;
-        }
-        it++;
-        session->Update(current);
-    }
-}
-
-void KCPServer::OnKCPRevc(int conv, const char* data, int len)
-{
-    if (NULL != options_.recv_cb)
-    {
-        options_.recv_cb(conv, data, len);
-        //Send(conv, data, len);
-    }
-}
-
-void KCPServer::DoErrorLog(const char *fmt, ...)
-{
-    if (NULL == options_.error_reporter)
-    {
-        return;
-    }
-
-    static char buffer[1024];
-    va_list argptr;
-    va_start(argptr, fmt);
-    vsnprintf(buffer, sizeof(buffer), fmt, argptr);
-    va_end(argptr);
-    options_.error_reporter(buffer);
-}
-
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <algorithm>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+
+#include "kcpserver.h"
+#include "kcpcompress.h"
+
+const IUINT32 KCP_HEAD_LENGTH = 24;
+const int KCP_SWEEP_PERIOD = 1000; //the idle sweep covers the whole table once per period
+const int KCP_SWEEP_TICK = 100; //and wakes the loop at least this often
+
+static thread_local KCPServer* tls_current_shard = NULL;
+
+KCPOptions::KCPOptions()
+{
+    port = 9527;
+    keep_session_time = 5 * 1000; //5s //5000ms
+    recv_batch_size = 32;
+    send_batch_size = 64;
+    worker_threads = 1;
+    command_queue_size = 16 * 1024;
+    command_batch_size = 1024;
+    mtu_min = KCP_SESSION_MTU_MIN;
+    mtu_max = KCP_SESSION_MTU_MAX;
+    reuseport_cbpf = true;
+    io_backend = KCP_IO_SYSCALL;
+    udp_gso = true;
+    udp_gro = true;
+    congestion_control = KCP_CC_NONE;
+    sack = true;
+    send_window = 32;
+    recv_window = 32;
+    seq_ring = false;
+    fec_data_shards = 0;
+    fec_parity_shards = 0;
+    compress_min_size = 0;
+    app_threads = 0;
+    app_queue_size = 4 * 1024;
+    segment_allocator = true;
+    recv_cb = NULL;
+    recvv_cb = NULL;
+    recvbuf_cb = NULL;
+    kick_cb = NULL;
+    error_reporter = NULL;
+}
+
+KCPServerStats::KCPServerStats()
+{
+    recv_calls = 0;
+    recv_packets = 0;
+    recv_batch_max = 0;
+    recv_invalid = 0;
+    send_calls = 0;
+    send_packets = 0;
+    send_eagain = 0;
+    send_dropped = 0;
+    recv_forwarded = 0;
+    send_segmented = 0;
+    recv_coalesced = 0;
+    send_compressed = 0;
+    compress_saved = 0;
+    app_dispatched = 0;
+    app_backlogged = 0;
+    commands_executed = 0;
+    command_wakeups = 0;
+}
+
+void KCPServerStats::Add(const KCPServerStats& other)
+{
+    recv_calls += other.recv_calls;
+    recv_packets += other.recv_packets;
+    recv_batch_max = std::max(recv_batch_max, other.recv_batch_max);
+    recv_invalid += other.recv_invalid;
+    send_calls += other.send_calls;
+    send_packets += other.send_packets;
+    send_eagain += other.send_eagain;
+    send_dropped += other.send_dropped;
+    recv_forwarded += other.recv_forwarded;
+    send_segmented += other.send_segmented;
+    recv_coalesced += other.recv_coalesced;
+    send_compressed += other.send_compressed;
+    compress_saved += other.compress_saved;
+    app_dispatched += other.app_dispatched;
+    app_backlogged += other.app_backlogged;
+    commands_executed += other.commands_executed;
+    command_wakeups += other.command_wakeups;
+}
+
+KCPCommand::KCPCommand() : type(KCP_COMMAND_SEND), conv(0), data(NULL), len(0), 
+    buf(NULL), addr_len(0), result(NULL)
+{
+    memset(&addr, 0, sizeof(addr));
+}
+
+static void ReleaseCommand(KCPCommand& command)
+{
+    delete[] command.data;
+    command.data = NULL;
+    ikcp_buf_release(command.buf);
+    command.buf = NULL;
+}
+
+//removes value from lists[key], order is not kept
+static bool EraseMember(std::map<int, std::vector<int> >& lists, int key, int value, 
+    bool erase_empty)
+{
+    std::map<int, std::vector<int> >::iterator it = lists.find(key);
+    if (it == lists.end())
+    {
+        return false;
+    }
+    std::vector<int>& values = it->second;
+    std::vector<int>::iterator pos = std::find(values.begin(), values.end(), value);
+    if (pos == values.end())
+    {
+        return false;
+    }
+    *pos = values.back();
+    values.pop_back();
+    if (erase_empty && values.empty())
+    {
+        lists.erase(it);
+    }
+    return true;
+}
+
+KCPServer::KCPServer(const KCPOptions& options) :
+    options_(options), fd_(0), epoll_fd_(-1), timer_fd_(-1), running_(false), 
+    watch_writable_(false), sweep_pos_(0), sweep_clock_(0), current_clock_(0), 
+    io_backend_(NULL), parent_(NULL), shard_index_(0), event_fd_(-1), sleeping_(false),
+    slept_(false), next_group_(1), app_pool_(NULL)
+{
+    iqueue_init(&ready_sessions_);
+}
+
+KCPServer::KCPServer() : fd_(0), epoll_fd_(-1), timer_fd_(-1), running_(false), 
+    watch_writable_(false), sweep_pos_(0), sweep_clock_(0), current_clock_(0), 
+    io_backend_(NULL), parent_(NULL), shard_index_(0), event_fd_(-1), sleeping_(false),
+    slept_(false), next_group_(1), app_pool_(NULL)
+{
+    iqueue_init(&ready_sessions_);
+}
+
+KCPServer::~KCPServer()
+{
+    Clear();
+}
+
+bool KCPServer::Start()
+{
+    //ikcp takes a 50 byte mtu and up, the fec head may come off it
+    if (options_.mtu_min - KCP_FEC_HEAD_LENGTH < 50 || options_.mtu_min > options_.mtu_max ||
+        options_.mtu_max > KCP_RECV_SLOT_SIZE)
+    {
+        DoErrorLog("mtu(%d, %d) invalid", options_.mtu_min, options_.mtu_max);
+        return false;
+    }
+
+    if (options_.segment_allocator && 
+        !KCPSegmentAllocator::Install(options_.mtu_max - KCP_SEGMENT_HEAD))
+    {
+        DoErrorLog("segment allocator not installed, ikcp allocated before the server started");
+    }
+
+    if (options_.app_threads > 0 && NULL == parent_ && NULL == app_pool_)
+    {
+        //one ring per loop and app thread, the shards share the facade's pool
+        app_pool_ = new KCPAppPool();
+        if (!app_pool_->Start(options_.app_threads, std::max(options_.worker_threads, 1),
+            options_.app_queue_size, &KCPServer::OnAppMessage, this))
+        {
+            DoErrorLog("start %d app threads error:%s", options_.app_threads, strerror(errno));
+            delete app_pool_;
+            app_pool_ = NULL;
+            return false;
+        }
+    }
+
+    if (options_.worker_threads > 1 && NULL == parent_)
+    {
+        return StartShards();
+    }
+
+    bool ret = false;
+    do 
+    {
+        if (!UDPBind())
+        {
+            break;
+        }
+
+        if (!InitIOBackend())
+        {
+            break;
+        }
+
+        event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd_ < 0)
+        {
+            DoErrorLog("call eventfd error:%s", strerror(errno));
+            break;
+        }
+        commands_.Init(options_.command_queue_size);
+        loop_thread_.store(std::this_thread::get_id());
+
+        current_clock_ = iclock();
+        sweep_clock_ = current_clock_;
+        timer_wheel_.Init(current_clock_);
+        ret = true;
+    } while (false);
+
+    if (!ret)
+    {
+        Clear();
+    }
+
+    return ret;
+}
+
+void KCPServer::Update()
+{
+    if (!shards_.empty()) //workers run their own loops
+    {
+        return;
+    }
+
+    current_clock_ = iclock();
+    if (NULL == parent_)
+    {
+        loop_thread_.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    }
+    ProcessCommands(false);
+    UDPRead();
+    SessionUpdate();
+    SweepIdleSessions();
+    if (NULL != app_pool_) //one wakeup per app thread and tick
+    {
+        app_pool_->Flush(shard_index_);
+    }
+    FlushOutput();
+}
+
+bool KCPServer::Run()
+{
+    if (!shards_.empty())
+    {
+        for (size_t i = 0; i < threads_.size(); i++)
+        {
+            threads_[i].join();
+        }
+        threads_.clear();
+        return true;
+    }
+
+    if (!InitEventLoop())
+    {
+        return false;
+    }
+
+    running_ = true;
+    epoll_event events[4];
+    while (running_)
+    {
+        int timeout = NextTimeout();
+        if (0 != timeout)
+        {
+            ArmTimer(timeout);
+            int n = epoll_wait(epoll_fd_, events, 4, -1);
+            if (n < 0 && EINTR != errno)
+            {
+                DoErrorLog("call epoll wait error:%s", strerror(errno));
+                return false;
+            }
+
+            for (int i = 0; i < n; i++)
+            {
+                if (events[i].data.fd == timer_fd_) //event_fd_ is read by Update()
+                {
+                    IUINT64 counter = 0;
+                    ssize_t ret = read(events[i].data.fd, &counter, sizeof(counter));
+                    (void)ret;
+                }
+            }
+        }
+
+        Update();
+        WatchWritable(!output_queue_.IsEmpty() || io_backend_->HasPending());
+        if (NULL != parent_)
+        {
+            PublishStats();
+        }
+    }
+
+    return true;
+}
+
+void KCPServer::Stop()
+{
+    if (!shards_.empty())
+    {
+        KCPCommand command;
+        command.type = KCP_COMMAND_STOP;
+        for (size_t i = 0; i < shards_.size(); i++)
+        {
+            while (!shards_[i]->PostCommand(command))
+            {
+                std::this_thread::yield();
+            }
+        }
+        return;
+    }
+
+    if (!InLoopThread())
+    {
+        KCPCommand command;
+        command.type = KCP_COMMAND_STOP;
+        while (!PostCommand(command))
+        {
+            std::this_thread::yield();
+        }
+        return;
+    }
+
+    running_ = false;
+}
+
+int KCPServer::GetFd() const
+{
+    if (NULL != io_backend_)
+    {
+        return io_backend_->GetPollFd();
+    }
+    return fd_;
+}
+
+int KCPServer::GetEventFd() const
+{
+    return event_fd_;
+}
+
+int KCPServer::NextTimeout()
+{
+    if (!iqueue_is_empty(&ready_sessions_))
+    {
+        return 0;
+    }
+    if (NULL != app_pool_ && app_pool_->HasBacklog(shard_index_))
+    {
+        return 1; //come back for the packages a full ring turned away
+    }
+
+    int timeout = 0;
+    IUINT64 next = timer_wheel_.NextExpireTime();
+    if (options_.keep_session_time > 0 && sessions_.GetSize() > 0)
+    {
+        next = std::min(next, sweep_clock_ + KCP_SWEEP_TICK);
+    }
+    if (KCP_NEVER_UPDATE == next)
+    {
+        timeout = -1;
+    }
+    else
+    {
+        IUINT64 current = iclock();
+        if (next <= current)
+        {
+            return 0;
+        }
+        timeout = (int)std::min(next - current, (IUINT64)INT_MAX);
+    }
+
+    //pairs with the fence in PostCommand: either the loop sees the command
+    //here, or the poster sees it sleeping and writes event_fd_
+    if (event_fd_ >= 0)
+    {
+        sleeping_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!commands_.IsEmpty())
+        {
+            sleeping_.store(false, std::memory_order_relaxed);
+            return 0;
+        }
+        slept_ = true;
+    }
+    return timeout;
+}
+
+bool KCPServer::Send(int conv, const char* data, int len)
+{
+    iovec iov;
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+    return SendV(conv, &iov, 1);
+}
+
+bool KCPServer::SendV(int conv, const iovec* iov, int count)
+{
+    KCPServer* shard = GetOwnerLoop(conv);
+    if (shard != this || !InLoopThread())
+    {
+        if (shard->InLoopThread())
+        {
+            return shard->SendV(conv, iov, count);
+        }
+
+        //iov is only good for this call, the command carries a copy
+        KCPCommand command;
+        command.type = KCP_COMMAND_SEND;
+        command.conv = conv;
+        for (int i = 0; i < count; i++)
+        {
+            command.len += (int)iov[i].iov_len;
+        }
+        command.data = new char[command.len > 0 ? command.len : 1];
+        char* dst = command.data;
+        for (int i = 0; i < count; i++)
+        {
+            memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+            dst += iov[i].iov_len;
+        }
+        return PostSend(shard, command);
+    }
+
+    KCPSession* session = GetSession(conv);
+    if (NULL == session)
+    {
+        DoErrorLog("no session(%d) find", conv);
+        return false;
+    }
+
+    if (session->SendV(iov, count) < 0)
+    {
+        DoErrorLog("session(%d) send data failed", conv);
+        return false;
+    }
+
+    RescheduleSession(session);
+    return true;
+}
+
+bool KCPServer::SendBuffer(int conv, IKCPBUF* buf)
+{
+    assert(NULL != buf);
+    KCPServer* shard = GetOwnerLoop(conv);
+    if (shard != this || !InLoopThread())
+    {
+        if (shard->InLoopThread())
+        {
+            return shard->SendBuffer(conv, buf);
+        }
+
+        KCPCommand command;
+        command.type = KCP_COMMAND_SEND;
+        command.conv = conv;
+        command.buf = buf;
+        ikcp_buf_ref(buf);
+        return PostSend(shard, command);
+    }
+
+    KCPSession* session = GetSession(conv);
+    if (NULL == session)
+    {
+        DoErrorLog("no session(%d) find", conv);
+        return false;
+    }
+
+    if (session->SendBuffer(buf) < 0)
+    {
+        DoErrorLog("session(%d) send data failed", conv);
+        return false;
+    }
+
+    RescheduleSession(session);
+    return true;
+}
+
+int KCPServer::Broadcast(const int* convs, int count, const char* data, int len)
+{
+    IKCPBUF* buf = ikcp_buf_new(len);
+    if (NULL == buf)
+    {
+        DoErrorLog("alloc broadcast buffer size(%d) failed", len);
+        return 0;
+    }
+
+    //packed once for every session, same 1/16 saving rule as Send
+    int packed = -1;
+    if (options_.compress_min_size > 0 && len - 4 >= options_.compress_min_size)
+    {
+        packed = KCPCompressor::Pack(data, len, buf->data, len - len / 16);
+    }
+    if (packed > 0)
+    {
+        buf->len = packed;
+    }
+    else
+    {
+        memcpy(buf->data, data, len);
+    }
+
+    int sent = BroadcastBuffer(convs, count, buf);
+    ikcp_buf_release(buf);
+    return sent;
+}
+
+int KCPServer::BroadcastBuffer(const int* convs, int count, IKCPBUF* buf)
+{
+    assert(NULL != buf);
+    int sent = 0;
+    if (!shards_.empty() || !InLoopThread())
+    {
+        //one command per loop carrying all of its convs
+        std::vector<KCPServer*> loops(shards_);
+        if (loops.empty())
+        {
+            loops.push_back(this);
+        }
+        std::vector<std::vector<int> > owned(loops.size());
+        for (int i = 0; i < count; i++)
+        {
+            KCPServer* owner = GetOwnerLoop(convs[i]);
+            owned[shards_.empty() ? 0 : owner->shard_index_].push_back(convs[i]);
+        }
+
+        for (size_t i = 0; i < loops.size(); i++)
+        {
+            std::vector<int>& list = owned[i];
+            if (list.empty())
+            {
+                continue;
+            }
+            if (loops[i]->InLoopThread())
+            {
+                sent += loops[i]->BroadcastBuffer(&list[0], (int)list.size(), buf);
+                continue;
+            }
+
+            KCPCommand command;
+            command.type = KCP_COMMAND_BROADCAST;
+            command.len = (int)(list.size() * sizeof(int));
+            command.data = new char[command.len];
+            memcpy(command.data, &list[0], command.len);
+            command.buf = buf;
+            ikcp_buf_ref(buf);
+            if (PostSend(loops[i], command))
+            {
+                sent += (int)list.size();
+            }
+        }
+        return sent;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        KCPSession* session = GetSession(convs[i]);
+        if (NULL == session)
+        {
+            continue;
+        }
+        if (session->SendBuffer(buf) < 0)
+        {
+            DoErrorLog("session(%d) send data failed", convs[i]);
+            continue;
+        }
+        RescheduleSession(session);
+        sent++;
+    }
+    return sent;
+}
+
+int KCPServer::CreateGroup()
+{
+    std::lock_guard<std::mutex> lock(groups_mutex_);
+    int group = next_group_++;
+    groups_[group];
+    return group;
+}
+
+void KCPServer::DestroyGroup(int group)
+{
+    std::lock_guard<std::mutex> lock(groups_mutex_);
+    std::map<int, std::vector<int> >::iterator it = groups_.find(group);
+    if (it == groups_.end())
+    {
+        return;
+    }
+    const std::vector<int>& members = it->second;
+    for (size_t i = 0; i < members.size(); i++)
+    {
+        EraseMember(member_groups_, members[i], group, true);
+    }
+    groups_.erase(it);
+}
+
+bool KCPServer::JoinGroup(int group, int conv)
+{
+    std::lock_guard<std::mutex> lock(groups_mutex_);
+    std::map<int, std::vector<int> >::iterator it = groups_.find(group);
+    if (it == groups_.end())
+    {
+        return false;
+    }
+    std::vector<int>& members = it->second;
+    if (std::find(members.begin(), members.end(), conv) == members.end())
+    {
+        members.push_back(conv);
+        member_groups_[conv].push_back(group);
+    }
+    return true;
+}
+
+bool KCPServer::LeaveGroup(int group, int conv)
+{
+    std::lock_guard<std::mutex> lock(groups_mutex_);
+    if (!EraseMember(groups_, group, conv, false)) //a group stays until DestroyGroup()
+    {
+        return false;
+    }
+    EraseMember(member_groups_, conv, group, true);
+    return true;
+}
+
+//a removed session drops out of every group, a reused conv starts clean
+void KCPServer::LeaveAllGroups(int conv)
+{
+    std::lock_guard<std::mutex> lock(groups_mutex_);
+    std::map<int, std::vector<int> >::iterator it = member_groups_.find(conv);
+    if (it == member_groups_.end())
+    {
+        return;
+    }
+    const std::vector<int>& joined = it->second;
+    for (size_t i = 0; i < joined.size(); i++)
+    {
+        EraseMember(groups_, joined[i], conv, false);
+    }
+    member_groups_.erase(it);
+}
+
+int KCPServer::SendGroup(int group, const char* data, int len)
+{
+    //copy the members out, Broadcast may run callbacks that join or leave
+    static thread_local std::vector<int> members;
+    {
+        std::lock_guard<std::mutex> lock(groups_mutex_);
+        std::map<int, std::vector<int> >::iterator it = groups_.find(group);
+        if (it == groups_.end())
+        {
+            return -1;
+        }
+        members = it->second;
+    }
+    if (members.empty())
+    {
+        return 0;
+    }
+    return Broadcast(&members[0], (int)members.size(), data, len);
+}
+
+bool KCPServer::PostSend(KCPServer* shard, KCPCommand& command)
+{
+    if (!shard->PostCommand(command))
+    {
+        ReleaseCommand(command);
+        DoErrorLog("worker(%d) command queue full, session(%d) send failed",
+            shard->shard_index_, command.conv);
+        return false;
+    }
+    return true;
+}
+
+void KCPServer::KickSession(int conv)
+{
+    KCPServer* shard = GetOwnerLoop(conv);
+    if (shard != this || !InLoopThread())
+    {
+        if (shard->InLoopThread())
+        {
+            shard->KickSession(conv);
+            return;
+        }
+
+        KCPCommand command;
+        command.type = KCP_COMMAND_KICK;
+        command.conv = conv;
+        if (!shard->PostCommand(command))
+        {
+            DoErrorLog("worker(%d) command queue full, session(%d) kick failed",
+                shard->shard_index_, conv);
+        }
+        return;
+    }
+
+    KCPSession* session = GetSession(conv);
+    if (NULL == session)
+    {
+        return;
+    }
+
+    RemoveSession(session);
+}
+
+bool KCPServer::SetSessionFec(int conv, int data_shards, int parity_shards)
+{
+    if (data_shards < 0 || parity_shards < 0 || 
+        data_shards + parity_shards > KCP_FEC_MAX_SHARDS)
+    {
+        DoErrorLog("session(%d) fec shards(%d, %d) invalid", conv, data_shards, parity_shards);
+        return false;
+    }
+
+    KCPServer* shard = GetOwnerLoop(conv);
+    if (shard != this || !InLoopThread())
+    {
+        if (shard->InLoopThread())
+        {
+            return shard->SetSessionFec(conv, data_shards, parity_shards);
+        }
+
+        KCPCommand command;
+        command.type = KCP_COMMAND_FEC;
+        command.conv = conv;
+        command.len = data_shards << 8 | parity_shards;
+        if (!shard->PostCommand(command))
+        {
+            DoErrorLog("worker(%d) command queue full, session(%d) fec failed",
+                shard->shard_index_, conv);
+            return false;
+        }
+        return true;
+    }
+
+    KCPSession* session = GetSession(conv);
+    if (NULL == session)
+    {
+        return false;
+    }
+
+    session->SetFec(data_shards, parity_shards);
+    return true;
+}
+
+bool KCPServer::SessionExist(int conv) const
+{
+    KCPServer* shard = GetOwnerLoop(conv);
+    if (shard != this || !InLoopThread())
+    {
+        if (shard->InLoopThread())
+        {
+            return shard->SessionExist(conv);
+        }
+
+        return 0 != PostQuery(shard, KCP_COMMAND_EXIST, conv);
+    }
+
+    return NULL != sessions_.Find(conv);
+}
+
+int KCPServer::GetSessionMtu(int conv) const
+{
+    KCPServer* shard = GetOwnerLoop(conv);
+    if (shard != this || !InLoopThread())
+    {
+        if (shard->InLoopThread())
+        {
+            return shard->GetSessionMtu(conv);
+        }
+        return PostQuery(shard, KCP_COMMAND_MTU, conv);
+    }
+
+    const KCPSessionSlot* slot = sessions_.Find(conv);
+    if (NULL == slot)
+    {
+        return -1;
+    }
+    return slot->session->GetMtu();
+}
+
+int KCPServer::PostQuery(KCPServer* shard, int type, int conv) const
+{
+    std::promise<int> result;
+    std::future<int> future = result.get_future();
+    KCPCommand command;
+    command.type = type;
+    command.conv = conv;
+    command.result = &result;
+    while (!shard->PostCommand(command))
+    {
+        std::this_thread::yield();
+    }
+
+    //a worker asking another worker keeps answering queries itself, 
+    //so two workers asking each other never deadlock
+    KCPServer* self = tls_current_shard;
+    while (NULL != self && 
+        std::future_status::ready != future.wait_for(std::chrono::seconds(0)))
+    {
+        self->ProcessCommands(true);
+        std::this_thread::yield();
+    }
+    return future.get();
+}
+
+void KCPServer::SetOption(const KCPOptions& options)
+{
+    options_ = options;
+}
+
+KCPServerStats KCPServer::GetStats() const
+{
+    if (shards_.empty())
+    {
+        return stats_;
+    }
+
+    KCPServerStats stats;
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+        std::lock_guard<std::mutex> lock(shards_[i]->stats_mutex_);
+        stats.Add(shards_[i]->published_stats_);
+    }
+    return stats;
+}
+
+bool KCPServer::UDPBind()
+{
+    sockaddr_in server_addr;
+    fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd_ < 0)
+    {
+        DoErrorLog("call socket error:%s", strerror(errno));
+        return false;
+    }
+
+    int flag = fcntl(fd_, F_GETFL, 0);
+    flag |= O_NONBLOCK;
+    if (-1 == fcntl(fd_, F_SETFL, flag))
+    {
+        DoErrorLog("set socket non block error:%s", strerror(errno));
+        return false;
+    }
+
+    int opt = 1;
+    if (0 != setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
+    {
+        DoErrorLog("set socket reuse addr error:%s", strerror(errno));
+        return false;
+    }
+
+    if (NULL != parent_ &&
+        0 != setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)))
+    {
+        DoErrorLog("set socket reuse port error:%s", strerror(errno));
+        return false;
+    }
+
+    int val = 10 * 1024 * 1024; //10M
+    if (0 != setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val)))
+    {
+        DoErrorLog("set socket recv buf error:%s", strerror(errno));
+        return false;
+    }
+
+    if (0 != setsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &val, sizeof(val)))
+    {
+        DoErrorLog("set socket send buf error:%s", strerror(errno));
+        return false;
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_addr.sin_port = htons(options_.port);
+    if (0 != bind(fd_, (const sockaddr*)&server_addr, sizeof(server_addr)))
+    {
+        DoErrorLog("call bind error:%s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool KCPServer::InitIOBackend()
+{
+    int send_batch_size = options_.send_batch_size;
+    if (send_batch_size <= 0)
+    {
+        send_batch_size = 1;
+    }
+    output_queue_.Init(send_batch_size, KCP_RECV_SLOT_SIZE);
+
+    //a zero segment size only asks whether the kernel knows UDP_SEGMENT
+    int gso_size = 0;
+    if (options_.udp_gso && 0 == setsockopt(fd_, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)))
+    {
+        output_queue_.SetSegmentation(true);
+    }
+
+    int recv_slot_size = KCP_RECV_SLOT_SIZE;
+    int gro = 1;
+    if (options_.udp_gro && 0 == setsockopt(fd_, SOL_UDP, UDP_GRO, &gro, sizeof(gro)))
+    {
+        recv_slot_size = KCP_GRO_SLOT_SIZE;
+    }
+
+    io_backend_ = KCPIOBackend::Create(this, options_.io_backend, fd_, 
+        options_.recv_batch_size, recv_slot_size, send_batch_size);
+    return NULL != io_backend_;
+}
+
+bool KCPServer::InitEventLoop()
+{
+    assert(fd_ > 0);
+    if (epoll_fd_ >= 0)
+    {
+        return true;
+    }
+
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0)
+    {
+        DoErrorLog("call epoll create error:%s", strerror(errno));
+        return false;
+    }
+
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd_ < 0)
+    {
+        DoErrorLog("call timerfd create error:%s", strerror(errno));
+        return false;
+    }
+
+    //the udp fd is always there for EPOLLOUT, a ring backend reads through its own fd
+    int poll_fd = io_backend_->GetPollFd();
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = poll_fd == fd_ ? EPOLLIN : 0;
+    ev.data.fd = fd_;
+    if (0 != epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd_, &ev))
+    {
+        DoErrorLog("add udp fd to epoll error:%s", strerror(errno));
+        return false;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.fd = poll_fd;
+    if (poll_fd != fd_ && 0 != epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, poll_fd, &ev))
+    {
+        DoErrorLog("add io backend fd to epoll error:%s", strerror(errno));
+        return false;
+    }
+
+    ev.data.fd = timer_fd_;
+    if (0 != epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &ev))
+    {
+        DoErrorLog("add timer fd to epoll error:%s", strerror(errno));
+        return false;
+    }
+
+    ev.data.fd = event_fd_;
+    if (event_fd_ >= 0 && 0 != epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev))
+    {
+        DoErrorLog("add event fd to epoll error:%s", strerror(errno));
+        return false;
+    }
+
+    watch_writable_ = false;
+    return true;
+}
+
+void KCPServer::ArmTimer(int timeout)
+{
+    itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (timeout > 0) //a zero it_value disarms the timer
+    {
+        spec.it_value.tv_sec = timeout / 1000;
+        spec.it_value.tv_nsec = (timeout % 1000) * 1000000L;
+    }
+
+    if (0 != timerfd_settime(timer_fd_, 0, &spec, NULL))
+    {
+        DoErrorLog("set timer fd error:%s", strerror(errno));
+    }
+}
+
+void KCPServer::WatchWritable(bool enable)
+{
+    if (enable == watch_writable_)
+    {
+        return;
+    }
+
+    //a send queue held back by EAGAIN is retried as soon as the socket drains
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = io_backend_->GetPollFd() == fd_ ? EPOLLIN : 0;
+    if (enable)
+    {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.fd = fd_;
+    if (0 != epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd_, &ev))
+    {
+        DoErrorLog("modify udp fd in epoll error:%s", strerror(errno));
+        return;
+    }
+    watch_writable_ = enable;
+}
+
+void KCPServer::Clear()
+{
+    StopShards();
+    if (NULL == parent_ && NULL != app_pool_) //the loops are gone, let the app threads drain
+    {
+        app_pool_->Stop();
+        delete app_pool_;
+    }
+    app_pool_ = NULL;
+    if (event_fd_ >= 0)
+    {
+        close(event_fd_);
+        event_fd_ = -1;
+    }
+    sleeping_.store(false);
+    slept_ = false;
+    KCPCommand command;
+    while (commands_.Pop(command))
+    {
+        ReleaseCommand(command);
+    }
+    for (size_t i = 0; i < deferred_commands_.size(); i++)
+    {
+        ReleaseCommand(deferred_commands_[i]);
+    }
+    deferred_commands_.clear();
+
+    if (timer_fd_ >= 0)
+    {
+        close(timer_fd_);
+        timer_fd_ = -1;
+    }
+    if (epoll_fd_ >= 0)
+    {
+        close(epoll_fd_);
+        epoll_fd_ = -1;
+    }
+    delete io_backend_;
+    io_backend_ = NULL;
+    if (fd_ > 0)
+    {
+        close(fd_);
+    }
+    fd_ = 0;
+    for (int pos = 0; pos < sessions_.GetCapacity(); pos++)
+    {
+        KCPSessionSlot* slot = sessions_.GetSlot(pos);
+        if (NULL != slot)
+        {
+            DeleteKCPSession(this, slot->session);
+        }
+    }
+    sessions_.Clear();
+    sweep_pos_ = 0;
+    timer_wheel_.Init(0);
+    iqueue_init(&ready_sessions_);
+
+    output_queue_.Clear();
+}
+
+KCPSession* KCPServer::GetSession(int conv)
+{
+    KCPSessionSlot* slot = sessions_.Find(conv);
+    return NULL != slot ? slot->session : NULL;
+}
+
+void KCPServer::DoOutput(const KCPAddr& addr, const char* data, int len)
+{
+    if (output_queue_.Push(addr, data, len))
+    {
+        return;
+    }
+
+    FlushOutput();
+    if (!output_queue_.Push(addr, data, len))
+    {
+        stats_.send_dropped++;
+        DoErrorLog("udp output queue full, drop data size(%d) to address(%s) port(%d)",
+            len, inet_ntoa(addr.sockaddr.sin_addr), ntohs(addr.sockaddr.sin_port));
+    }
+}
+
+void KCPServer::FlushOutput()
+{
+    assert(NULL != io_backend_);
+    if (output_queue_.IsEmpty() && !io_backend_->HasPending())
+    {
+        return;
+    }
+
+    io_backend_->Flush(&output_queue_);
+}
+
+void KCPServer::UDPRead()
+{
+    assert(NULL != io_backend_);
+    io_backend_->Read();
+}
+
+void KCPServer::HandleDatagram(const sockaddr_in& addr, socklen_t addr_len, 
+    const char* data, int len)
+{
+    if (len < (int)KCP_HEAD_LENGTH)
+    {
+        stats_.recv_invalid++;
+        DoErrorLog("kcp package len(%d) invalid", len);
+        return;
+    }
+
+    int conv = ikcp_getconv(data);
+    KCPServer* owner = (NULL != parent_) ? parent_->GetOwnerShard(conv) : this;
+    if (owner != this) //without conv steering reuseport hashes the 4-tuple
+    {
+        KCPCommand command;
+        command.type = KCP_COMMAND_INPUT;
+        command.conv = conv;
+        command.data = new char[len];
+        command.len = len;
+        command.addr = addr;
+        command.addr_len = addr_len;
+        memcpy(command.data, data, len);
+        if (!owner->PostCommand(command))
+        {
+            delete[] command.data;
+            stats_.recv_invalid++;
+            DoErrorLog("worker(%d) command queue full, drop conv(%d) package",
+                owner->shard_index_, conv);
+            return;
+        }
+        stats_.recv_forwarded++;
+        return;
+    }
+
+    KCPSessionSlot* slot = sessions_.Find(conv);
+    if (NULL == slot)
+    {
+        KCPSession* session = NewKCPSession(this, KCPAddr(addr, addr_len), conv, current_clock_);
+        slot = sessions_.Insert(conv, session, current_clock_);
+    }
+    assert(NULL != slot);
+    slot->last_active = current_clock_;
+    KCPSession* session = slot->session;
+    session->KCPInput(addr, addr_len, data, len, current_clock_);
+    ScheduleSession(session, current_clock_);
+}
+
+void KCPServer::SessionUpdate()
+{
+    IUINT32 current = current_clock_ & 0xfffffffflu;
+    iqueue_head due;
+    iqueue_init(&due);
+    timer_wheel_.Expire(current_clock_, &due);
+    iqueue_splice_init(&ready_sessions_, &due);
+
+    //only sessions whose kcp deadline passed are visited
+    while (!iqueue_is_empty(&due))
+    {
+        KCPTimerNode* timer = iqueue_entry(due.next, KCPTimerNode, node);
+        iqueue_del(&timer->node);
+        KCPSession* session = static_cast<KCPSession*>(timer->data);
+        session->Update(current);
+        RescheduleSession(session);
+    }
+}
+
+void KCPServer::ScheduleSession(KCPSession* session, IUINT64 expire)
+{
+    KCPTimerNode* timer = session->GetTimer();
+    if (expire <= current_clock_)
+    {
+        timer_wheel_.Cancel(timer);
+        iqueue_add_tail(&timer->node, &ready_sessions_);
+        return;
+    }
+    timer_wheel_.Schedule(timer, expire);
+}
+
+void KCPServer::RescheduleSession(KCPSession* session)
+{
+    IUINT64 expire = session->NextUpdateTime(current_clock_);
+    if (KCP_NEVER_UPDATE == expire)
+    {
+        timer_wheel_.Cancel(session->GetTimer());
+        return;
+    }
+    ScheduleSession(session, expire);
+}
+
+void KCPServer::RemoveSession(KCPSession* session)
+{
+    //groups live on the facade, kicks and timeouts both end up here
+    (NULL != parent_ ? parent_ : this)->LeaveAllGroups(session->GetConv());
+    timer_wheel_.Cancel(session->GetTimer());
+    sessions_.Erase(session->GetConv());
+    DeleteKCPSession(this, session);
+}
+
+void KCPServer::SweepIdleSessions()
+{
+    int capacity = sessions_.GetCapacity();
+    if (options_.keep_session_time <= 0 || 0 == capacity || current_clock_ <= sweep_clock_)
+    {
+        return;
+    }
+
+    //a slice per tick, sized so the whole table is seen once per period
+    IUINT64 elapsed = current_clock_ - sweep_clock_;
+    sweep_clock_ = current_clock_;
+    IUINT64 steps = std::min((IUINT64)capacity, capacity * elapsed / KCP_SWEEP_PERIOD + 1);
+    for (IUINT64 i = 0; i < steps; i++)
+    {
+        if (sweep_pos_ >= capacity)
+        {
+            sweep_pos_ = 0;
+        }
+
+        //erasing only leaves a tombstone, the walk goes on from the same position
+        KCPSessionSlot* slot = sessions_.GetSlot(sweep_pos_++);
+        if (NULL == slot || current_clock_ <= slot->last_active + options_.keep_session_time)
+        {
+            continue;
+        }
+
+        int conv = slot->conv;
+        DoErrorLog("conv(%d) timeout, kick it", conv);
+        if (NULL != app_pool_ && NULL != options_.kick_cb) //behind the conv's last packages
+        {
+            Dispatch(conv, NULL);
+        }
+        else if (NULL != options_.kick_cb)
+        {
+            options_.kick_cb(conv);
+        }
+        RemoveSession(slot->session);
+    }
+}
+
+bool KCPServer::StartShards()
+{
+    assert(shards_.empty());
+    for (int i = 0; i < options_.worker_threads; i++)
+    {
+        KCPServer* shard = new KCPServer(options_);
+        shard->parent_ = this;
+        shard->shard_index_ = i;
+        shard->app_pool_ = app_pool_;
+        shards_.push_back(shard);
+    }
+
+    //bind in index order, the reuseport group keeps the same order
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+        if (!shards_[i]->Start())
+        {
+            StopShards();
+            return false;
+        }
+    }
+
+    if (options_.reuseport_cbpf && !AttachConvSteering())
+    {
+        DoErrorLog("conv steering unavailable, fall back to forwarding between workers");
+    }
+
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+        threads_.push_back(std::thread(&KCPServer::ShardMain, shards_[i]));
+    }
+    return true;
+}
+
+bool KCPServer::AttachConvSteering()
+{
+    assert(!shards_.empty());
+
+    //A = conv decoded little endian from the first 4 payload bytes, 
+    //return A % workers as the socket index inside the reuseport group
+    sock_filter code[] = 
+    {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 3),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 2),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 1),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 0),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (IUINT32)shards_.size()),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+
+    sock_fprog prog;
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    if (0 != setsockopt(shards_[0]->fd_, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, 
+        &prog, sizeof(prog)))
+    {
+        DoErrorLog("attach reuseport cbpf error:%s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void KCPServer::StopShards()
+{
+    if (shards_.empty())
+    {
+        return;
+    }
+
+    if (!threads_.empty())
+    {
+        Stop();
+        for (size_t i = 0; i < threads_.size(); i++)
+        {
+            threads_[i].join();
+        }
+        threads_.clear();
+    }
+
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+        delete shards_[i];
+    }
+    shards_.clear();
+}
+
+void KCPServer::ShardMain()
+{
+    tls_current_shard = this;
+    if (!Run())
+    {
+        DoErrorLog("worker(%d) loop exit on error", shard_index_);
+    }
+    tls_current_shard = NULL;
+}
+
+KCPServer* KCPServer::GetOwnerShard(int conv) const
+{
+    assert(!shards_.empty());
+    return shards_[(IUINT32)conv % shards_.size()];
+}
+
+//the server whose loop runs conv, a single server is its own only shard
+KCPServer* KCPServer::GetOwnerLoop(int conv) const
+{
+    if (shards_.empty())
+    {
+        return const_cast<KCPServer*>(this);
+    }
+    return GetOwnerShard(conv);
+}
+
+//before Start() there is no loop to hand work to, the caller owns the server
+bool KCPServer::InLoopThread() const
+{
+    if (event_fd_ < 0)
+    {
+        return true;
+    }
+    if (NULL != parent_)
+    {
+        return this == tls_current_shard;
+    }
+    return std::this_thread::get_id() == loop_thread_.load(std::memory_order_relaxed);
+}
+
+bool KCPServer::PostCommand(const KCPCommand& command)
+{
+    if (!commands_.Push(command))
+    {
+        return false;
+    }
+
+    //a busy loop picks the command up at the start of its next tick, only a
+    //sleeping one needs the syscall, and only the first poster makes it
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping_.load(std::memory_order_relaxed) && sleeping_.exchange(false))
+    {
+        IUINT64 one = 1;
+        ssize_t ret = write(event_fd_, &one, sizeof(one));
+        (void)ret;
+    }
+    return true;
+}
+
+void KCPServer::ProcessCommands(bool queries_only)
+{
+    if (slept_)
+    {
+        //a poster that saw the sleep may write after this read, the next
+        //sleep then wakes at once and reads it here, it never stays readable
+        slept_ = false;
+        sleeping_.store(false, std::memory_order_relaxed);
+        IUINT64 counter = 0;
+        if (read(event_fd_, &counter, sizeof(counter)) > 0)
+        {
+            stats_.command_wakeups += counter;
+        }
+    }
+
+    if (!queries_only && !deferred_commands_.empty())
+    {
+        std::vector<KCPCommand> deferred;
+        deferred.swap(deferred_commands_);
+        for (size_t i = 0; i < deferred.size(); i++)
+        {
+            ExecuteCommand(deferred[i]);
+        }
+    }
+
+    //capped so a flood of posts cannot starve the sockets, NextTimeout()
+    //returns 0 while any are left
+    KCPCommand command;
+    for (int i = 0; i < options_.command_batch_size && commands_.Pop(command); i++)
+    {
+        if (queries_only && KCP_COMMAND_EXIST != command.type && 
+            KCP_COMMAND_MTU != command.type)
+        {
+            deferred_commands_.push_back(command);
+            continue;
+        }
+        ExecuteCommand(command);
+    }
+}
+
+void KCPServer::ExecuteCommand(KCPCommand& command)
+{
+    stats_.commands_executed++; //deferred ones count when they run
+    switch (command.type)
+    {
+    case KCP_COMMAND_SEND:
+        if (NULL != command.buf)
+        {
+            SendBuffer(command.conv, command.buf);
+        }
+        else
+        {
+            Send(command.conv, command.data, command.len);
+        }
+        break;
+    case KCP_COMMAND_BROADCAST:
+        BroadcastBuffer((const int*)command.data, command.len / (int)sizeof(int), command.buf);
+        break;
+    case KCP_COMMAND_KICK:
+        KickSession(command.conv);
+        break;
+    case KCP_COMMAND_EXIST:
+        command.result->set_value(SessionExist(command.conv) ? 1 : 0);
+        break;
+    case KCP_COMMAND_MTU:
+        command.result->set_value(GetSessionMtu(command.conv));
+        break;
+    case KCP_COMMAND_INPUT:
+        HandleDatagram(command.addr, command.addr_len, command.data, command.len);
+        break;
+    case KCP_COMMAND_FEC:
+        SetSessionFec(command.conv, command.len >> 8, command.len & 0xff);
+        break;
+    case KCP_COMMAND_STOP:
+        running_ = false;
+        break;
+    default:
+        assert(false);
+        break;
+    }
+
+    ReleaseCommand(command);
+}
+
+void KCPServer::PublishStats()
+{
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    published_stats_ = stats_;
+}
+
+void KCPServer::OnKCPRevc(int conv, const char* data, int len)
+{
+    if (NULL != app_pool_ || NULL != options_.recvbuf_cb)
+    {
+        IKCPBUF* buf = ikcp_buf_new(len);
+        if (NULL == buf)
+        {
+            DoErrorLog("alloc package buffer size(%d) failed", len);
+            return;
+        }
+        memcpy(buf->data, data, len);
+        Dispatch(conv, buf);
+        return;
+    }
+
+    if (NULL != options_.recvv_cb)
+    {
+        iovec iov;
+        iov.iov_base = (void*)data;
+        iov.iov_len = len;
+        options_.recvv_cb(conv, &iov, 1);
+    }
+    else if (NULL != options_.recv_cb)
+    {
+        options_.recv_cb(conv, data, len);
+        //Send(conv, data, len);
+    }
+}
+
+void KCPServer::OnKCPRevc(int conv, const iovec* iov, int count, int len)
+{
+    if (NULL != app_pool_ || NULL != options_.recvbuf_cb)
+    {
+        //the one copy out of the kcp segments, the buffer then only changes hands
+        IKCPBUF* buf = ikcp_buf_new(len);
+        if (NULL == buf)
+        {
+            DoErrorLog("alloc package buffer size(%d) failed", len);
+            return;
+        }
+        char* dst = buf->data;
+        for (int i = 0; i < count; i++)
+        {
+            memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+            dst += iov[i].iov_len;
+        }
+        Dispatch(conv, buf);
+        return;
+    }
+
+    if (NULL != options_.recvv_cb)
+    {
+        options_.recvv_cb(conv, iov, count);
+        return;
+    }
+    if (1 == count)
+    {
+        OnKCPRevc(conv, (const char*)iov[0].iov_base, len);
+        return;
+    }
+
+    //recv_cb wants one block, gather the fragments
+    static thread_local std::vector<char> buffer;
+    buffer.resize(len);
+    char* dst = &buffer[0];
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+    OnKCPRevc(conv, &buffer[0], len);
+}
+
+void KCPServer::Dispatch(int conv, IKCPBUF* buf)
+{
+    if (NULL == app_pool_)
+    {
+        OnAppMessage(conv, buf, this);
+        return;
+    }
+
+    stats_.app_dispatched++;
+    if (!app_pool_->Push(shard_index_, conv, buf))
+    {
+        stats_.app_backlogged++;
+    }
+}
+
+void KCPServer::OnAppMessage(int conv, IKCPBUF* buf, void* user)
+{
+    const KCPOptions& options = static_cast<KCPServer*>(user)->options_;
+    if (NULL == buf)
+    {
+        options.kick_cb(conv);
+        return;
+    }
+    if (NULL != options.recvbuf_cb)
+    {
+        options.recvbuf_cb(conv, buf);
+        return;
+    }
+
+    if (NULL != options.recvv_cb)
+    {
+        iovec iov;
+        iov.iov_base = buf->data;
+        iov.iov_len = buf->len;
+        options.recvv_cb(conv, &iov, 1);
+    }
+    else if (NULL != options.recv_cb)
+    {
+        options.recv_cb(conv, buf->data, buf->len);
+    }
+    ikcp_buf_release(buf);
+}
+
+void KCPServer::DoErrorLog(const char *fmt, ...)
+{
+    if (NULL == options_.error_reporter)
+    {
+        return;
+    }
+
+    char buffer[1024];
+    va_list argptr;
+    va_start(argptr, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, argptr);
+    va_end(argptr);
+    options_.error_reporter(buffer);
+}
+
@@ -1,316 +1,765 @@
-#include <string.h>
-
-#include "kcpsession.h"
-#include "kcpserver.h"
-
-const int kcp_max_package_size = 64 * 1024; //64K
-const int kcp_package_len_size = 4; //4B
-
-int kcp_output(const char* buf, int len, ikcpcb* kcp, void* ptr)
-{
-    assert(NULL != ptr);
-    KCPSession* session = static_cast<KCPSession*>(ptr);
-    session->Output(buf, len);
-    return 0;
-}
-
-ikcpcb* NewKCP(int conv, KCPSession* session)
-{
-    ikcpcb* kcp = ikcp_create(conv, (void*)session);
-    assert(NULL != kcp);
-    ikcp_setoutput(kcp, kcp_output);
-    ikcp_nodelay(kcp, 1, 10, 2, 1);
-    ikcp_setmtu(kcp, 128);
-    return kcp;
-}
-
-KCPSession* NewKCPSession(KCPServer* server, const KCPAddr& addr, int conv, 
-    IUINT64 current)
-{
-    KCPSession* session = new KCPSession(server, addr, current);
-    ikcpcb* kcp = NewKCP(conv, session);
-    session->SetKCP(kcp);
-    return session;
-}
-
-KCPRingBuffer::KCPRingBuffer()
-{
-    Clear();
-}
-
-KCPRingBuffer::~KCPRingBuffer()
-{
-}
-
-void KCPRingBuffer::Clear()
-{
-    read_pos_ = 0;
-    write_pos_ = 0;
-    is_full_ = false;
-    is_empty_ = true;
-}
-
-int KCPRingBuffer::GetUsedSize() const
-{
-    if (is_empty_)
-    {
-        return 0;
-    }
-    else if (is_full_)
-    {
-        return BUFFER_SIZE;
-    }
-
-    if (write_pos_ > read_pos_)
-    {
-        return write_pos_ - read_pos_;
-    }
-    return BUFFER_SIZE - read_pos_ + write_pos_;
-}
-
-int KCPRingBuffer::GetFreeSize() const
-{
-    return BUFFER_SIZE - GetUsedSize();
-}
-
-int KCPRingBuffer::Write(const char* src, int len)
-{
-    if (len <= 0 || is_full_)
-    {
-        return 0;
-    }
-
-    is_empty_ = false;
-
-    if (write_pos_ >= read_pos_)
-    {
-        int left_size = BUFFER_SIZE - write_pos_;
-        if (left_size > len)
-        {
-            memcpy(buffer_ + write_pos_, src, len);
-            write_pos_ += len;
-            return len;
-        }
-        memcpy(buffer_ + write_pos_, src, left_size);
-        write_pos_ = std::min(read_pos_, len - left_size);
-        memcpy(buffer_, src + left_size, write_pos_);
-        is_full_ = (read_pos_ == write_pos_);
-        return left_size + write_pos_;
-    }
-
-    int can_write_size = std::min(GetFreeSize(), len);
-    memcpy(buffer_ + write_pos_, src, can_write_size);
-    write_pos_ += can_write_size;
-    is_full_ = (read_pos_ == write_pos_);
-    return can_write_size;
-}
-
-int KCPRingBuffer::Read(char* dst, int len)
-{
-    if (len <= 0 || is_empty_)
-    {
-        return 0;
-    }
-
-    is_full_ = false;
-
-    if (read_pos_ >= write_pos_)
-    {
-        int left_size = BUFFER_SIZE - read_pos_;
-        if (left_size > len)
-        {
-            memcpy(dst, buffer_ + read_pos_, len);
-            read_pos_ += len;
-            return len;
-        }
-        memcpy(dst, buffer_ + read_pos_, left_size);
-        read_pos_ = std::min(write_pos_, len - left_size);
-        memcpy(dst + left_size, buffer_, read_pos_);
-        is_empty_ = (read_pos_ == write_pos_);
-        return left_size + read_pos_;
-    }
-
-    int can_read_size = std::min(GetUsedSize(), len);
-    memcpy(dst, buffer_ + read_pos_, can_read_size);
-    read_pos_ += can_read_size;
-    is_empty_ = (read_pos_ == write_pos_);
-    return can_read_size;
-}
-
-bool KCPRingBuffer::ReadNoPop(char* dst, int len) const
-{
-    if (len <= 0 || GetUsedSize() < len)
-    {
-        return false;
-    }
-
-    if (read_pos_ >= write_pos_)
-    {
-        int left_size = BUFFER_SIZE - read_pos_;
-        int first_copy_size = std::min(left_size, len);
-        memcpy(dst, buffer_ + read_pos_, first_copy_size);
-        if (first_copy_size < len)
-        {
-            memcpy(dst + first_copy_size, buffer_, len - first_copy_size);
-        }
-    }
-    else
-    {
-        memcpy(dst, buffer_ + read_pos_, len);
-    }
-
-    return true;
-}
-
-int KCPRingBuffer::GetBufferSize() const
-{
-    return BUFFER_SIZE;
-}
-
-void KCPSession::Update(IUINT32 current)
-{
-    assert(NULL != kcp_);
-    if (current >= ikcp_check(kcp_, current))
-    {
-        ikcp_update(kcp_, current);
-    }
-
-    static char buffer[kcp_max_package_size];
-
-    do //revc kcp package 
-    {
-        int peek_size = ikcp_peeksize(kcp_);
-
-        if (peek_size < 0) //no kcp package
-        {
-            break;
-        }
-        if (peek_size > kcp_max_package_size) //error kcp package too large
-        {
-            server_->DoErrorLog("kcp peek size(%d) too large", peek_size);
-            break;
-        }
-        if (peek_size > recv_buffer_.GetFreeSize()) //buffer not enough
-        {
-            server_->DoErrorLog("revc buffer remain size(%d) not enough for peek size(%d)",
-                recv_buffer_.GetFreeSize(), peek_size);
-            break;
-        }
-
-        int len = ikcp_recv(kcp_, buffer, sizeof(buffer));
-        if (len < 0) //error: kcp revc error
-        {
-            server_->DoErrorLog("kcp revc error");
-            break;
-        }
-
-        assert(len == recv_buffer_.Write(buffer, len));
-    } while (true);
-    
-    do
-    {
-        if (!recv_buffer_.ReadNoPop(buffer, 4))
-        {
-            break;
-        }
-
-        IUINT32 tmp_length = *((IUINT32*)(&buffer[0]));
-        if (tmp_length == 0xffffffffu) //KCP heart
-        {
-            assert(4 == recv_buffer_.Read(buffer, 4));
-            //server_->DoErrorLog("Revc heart package");
-            continue;
-        }
-
-        int package_len = (int)ntohl((u_long)tmp_length);
-
-        if (package_len <= 0)
-        {
-            //package length invalid
-            server_->DoErrorLog("package size(%d) invalid", package_len);
-            break;
-        }
-
-        if (package_len > kcp_max_package_size ||
-            package_len > recv_buffer_.GetBufferSize())
-        {
-            //package len too large
-            server_->DoErrorLog("package size(%d) too large", package_len);
-            break;
-        }
-        if (package_len > recv_buffer_.GetUsedSize())
-        {
-            break;
-        }
-
-        assert(package_len == recv_buffer_.Read(buffer, package_len));
-        server_->OnKCPRevc(kcp_->conv, buffer, package_len);
-    } while (true);
-}
-
-int KCPSession::Send(const char* data, int len)
-{
-    assert(NULL != kcp_);
-    return ikcp_send(kcp_, data, len);
-}
-
-IUINT64 KCPSession::LastActiveTime() const
-{
-    return last_active_time_;
-}
-
-void KCPSession::SetKCP(ikcpcb* kcp)
-{
-    kcp_ = kcp;
-}
-
-void KCPSession::KCPInput(const sockaddr_in& sockaddr, const socklen_t socklen, const char* data, 
-    long sz, IUINT64 current)
-{
-    assert(NULL != kcp_);
-    assert(NULL != data);
-
-    if (0 != memcmp(&addr_, &sockaddr, sizeof(sockaddr_in))) //endpoint switch address or port
-    {
-        server_->DoErrorLog("conv(%d) switch address(%s) port(%d) to address(%s) port(%d)",
-            kcp_->conv, inet_ntoa(addr_.sockaddr.sin_addr), ntohs(addr_.sockaddr.sin_port),
-            inet_ntoa(sockaddr.sin_addr), ntohs(sockaddr.sin_port));
-
-        int conv = kcp_->conv;
-        Clear();
-        kcp_ = NewKCP(conv, this);
-        addr_ = KCPAddr(sockaddr, socklen);
-    }
-
-    ikcp_input(kcp_, data, sz);
-    last_active_time_ = current;
-}
-
-void KCPSession::Output(const char* buf, int len)
-{
-    server_->DoOutput(addr_, buf, len);
-}
-
-void KCPSession::Clear()
-{
-    if (NULL != kcp_)
-    {
-        ikcp_release(kcp_);
-        kcp_ = NULL;
-    }
-    recv_buffer_.Clear();
-}
-
-KCPSession::KCPSession(KCPServer* server, const KCPAddr& addr, IUINT64 current) :
-    server_(server), addr_(addr), last_active_time_(current)
-{
-}
-
-KCPSession::~KCPSession()
-{
-    if (NULL != kcp_)
-    {
-        ikcp_release(kcp_);
-    }
-}
-
+#include <string.h>
+#include <new>
+
+#include "kcpsession.h"
+#include "kcpserver.h"
+#include "kcpcompress.h"
+
+const int kcp_max_package_size = 64 * 1024; //64K
+const int kcp_package_len_size = 4; //4B
+const int kcp_max_fragments = 256; //frg is one byte on the wire
+const int kcp_compress_max_skip = 64; //packages, after a run of incompressible ones
+
+//walks the bytes of one kcp message across its fragments
+class KCPMessageCursor
+{
+public:
+    KCPMessageCursor(const IKCPVEC* vec, int count) : vec_(vec), count_(count), 
+        index_(0), offset_(0), left_(0)
+    {
+        for (int i = 0; i < count_; i++)
+        {
+            left_ += vec_[i].len;
+        }
+    }
+
+    int GetLeft() const
+    {
+        return left_;
+    }
+
+    bool Peek(char* dst, int len) const
+    {
+        if (len > left_)
+        {
+            return false;
+        }
+        for (int i = index_, offset = offset_; len > 0; i++, offset = 0)
+        {
+            int size = std::min(vec_[i].len - offset, len);
+            memcpy(dst, vec_[i].data + offset, size);
+            dst += size;
+            len -= size;
+        }
+        return true;
+    }
+
+    //the rest of the current fragment, stepped over
+    int Next(const char** data)
+    {
+        int size = std::min(vec_[index_].len - offset_, left_);
+        *data = vec_[index_].data + offset_;
+        Skip(size);
+        return size;
+    }
+
+    //point iov at the next len bytes and step over them, returns iov used
+    int Slice(iovec* iov, int len)
+    {
+        int count = 0;
+        while (len > 0)
+        {
+            int size = std::min(vec_[index_].len - offset_, len);
+            if (size > 0)
+            {
+                iov[count].iov_base = (void*)(vec_[index_].data + offset_);
+                iov[count].iov_len = size;
+                count++;
+            }
+            Skip(size);
+            len -= size;
+        }
+        return count;
+    }
+
+    void Skip(int len)
+    {
+        left_ -= len;
+        offset_ += len;
+        while (left_ > 0 && offset_ >= vec_[index_].len)
+        {
+            offset_ -= vec_[index_].len;
+            index_++;
+        }
+    }
+
+private:
+    const IKCPVEC* vec_;
+    int count_;
+    int index_;
+    int offset_;
+    int left_;
+};
+
+int kcp_output(const char* buf, int len, ikcpcb* kcp, void* ptr)
+{
+    assert(NULL != ptr);
+    KCPSession* session = static_cast<KCPSession*>(ptr);
+    session->Output(buf, len);
+    return 0;
+}
+
+static const IKCPCC* GetCongestionControl(int type)
+{
+    switch (type)
+    {
+    case KCP_CC_RENO:
+        return &ikcp_cc_reno;
+    case KCP_CC_BBR:
+        return &ikcp_cc_bbr;
+    default:
+        return &ikcp_cc_none;
+    }
+}
+
+ikcpcb* NewKCP(int conv, KCPSession* session, const KCPOptions& options)
+{
+    ikcpcb* kcp = ikcp_create(conv, (void*)session);
+    assert(NULL != kcp);
+    ikcp_setoutput(kcp, kcp_output);
+    ikcp_nodelay(kcp, 1, 10, 2, KCP_CC_NONE == options.congestion_control ? 1 : 0);
+    ikcp_setcc(kcp, GetCongestionControl(options.congestion_control));
+    ikcp_setsack(kcp, options.sack ? 1 : 0);
+    ikcp_wndsize(kcp, options.send_window, options.recv_window);
+    if (options.seq_ring)
+    {
+        ikcp_setring(kcp, 1);
+    }
+    return kcp;
+}
+
+KCPSession* NewKCPSession(KCPServer* server, const KCPAddr& addr, int conv, 
+    IUINT64 current)
+{
+    void* storage = server->session_pool_.Alloc();
+    KCPSession* session = new (storage) KCPSession(server, addr, current);
+    ikcpcb* kcp = NewKCP(conv, session, server->options_);
+    session->SetKCP(kcp);
+    session->SetFec(server->options_.fec_data_shards, server->options_.fec_parity_shards);
+    return session;
+}
+
+void DeleteKCPSession(KCPServer* server, KCPSession* session)
+{
+    if (NULL == session)
+    {
+        return;
+    }
+
+    session->~KCPSession();
+    server->session_pool_.Free(session);
+}
+
+KCPRingBuffer::KCPRingBuffer(KCPBufferPool* pool) : pool_(pool), buffer_(NULL), capacity_(0)
+{
+    assert(NULL != pool_);
+    Clear();
+}
+
+KCPRingBuffer::~KCPRingBuffer()
+{
+    Release();
+}
+
+void KCPRingBuffer::Clear()
+{
+    Release();
+}
+
+bool KCPRingBuffer::Reserve(int size)
+{
+    int capacity = 0;
+    char* buffer = pool_->Alloc(size, &capacity);
+    if (NULL == buffer)
+    {
+        return false;
+    }
+
+    //straighten the ring out into the new storage
+    int used = GetUsedSize();
+    ReadNoPop(buffer, used);
+    pool_->Free(buffer_, capacity_);
+    buffer_ = buffer;
+    capacity_ = capacity;
+    read_pos_ = 0;
+    write_pos_ = used;
+    is_full_ = false;
+    is_empty_ = (0 == used);
+    return true;
+}
+
+void KCPRingBuffer::Release()
+{
+    pool_->Free(buffer_, capacity_);
+    buffer_ = NULL;
+    capacity_ = 0;
+    read_pos_ = 0;
+    write_pos_ = 0;
+    is_full_ = false;
+    is_empty_ = true;
+}
+
+int KCPRingBuffer::GetUsedSize() const
+{
+    if (is_empty_)
+    {
+        return 0;
+    }
+    else if (is_full_)
+    {
+        return capacity_;
+    }
+
+    if (write_pos_ > read_pos_)
+    {
+        return write_pos_ - read_pos_;
+    }
+    return capacity_ - read_pos_ + write_pos_;
+}
+
+int KCPRingBuffer::GetFreeSize() const
+{
+    return BUFFER_SIZE - GetUsedSize();
+}
+
+int KCPRingBuffer::Write(const char* src, int len)
+{
+    if (len <= 0 || 0 == GetFreeSize())
+    {
+        return 0;
+    }
+
+    int want = std::min(GetUsedSize() + len, (int)BUFFER_SIZE);
+    if (want > capacity_ && !Reserve(want))
+    {
+        return 0;
+    }
+
+    is_empty_ = false;
+
+    if (write_pos_ >= read_pos_)
+    {
+        int left_size = capacity_ - write_pos_;
+        if (left_size > len)
+        {
+            memcpy(buffer_ + write_pos_, src, len);
+            write_pos_ += len;
+            return len;
+        }
+        memcpy(buffer_ + write_pos_, src, left_size);
+        write_pos_ = std::min(read_pos_, len - left_size);
+        memcpy(buffer_, src + left_size, write_pos_);
+        is_full_ = (read_pos_ == write_pos_);
+        return left_size + write_pos_;
+    }
+
+    int can_write_size = std::min(GetFreeSize(), len);
+    memcpy(buffer_ + write_pos_, src, can_write_size);
+    write_pos_ += can_write_size;
+    is_full_ = (read_pos_ == write_pos_);
+    return can_write_size;
+}
+
+int KCPRingBuffer::Read(char* dst, int len)
+{
+    if (len <= 0 || is_empty_)
+    {
+        return 0;
+    }
+
+    is_full_ = false;
+
+    int read_size = 0;
+    if (read_pos_ >= write_pos_)
+    {
+        int left_size = capacity_ - read_pos_;
+        if (left_size > len)
+        {
+            memcpy(dst, buffer_ + read_pos_, len);
+            read_pos_ += len;
+            return len;
+        }
+        memcpy(dst, buffer_ + read_pos_, left_size);
+        read_pos_ = std::min(write_pos_, len - left_size);
+        memcpy(dst + left_size, buffer_, read_pos_);
+        is_empty_ = (read_pos_ == write_pos_);
+        read_size = left_size + read_pos_;
+    }
+    else
+    {
+        read_size = std::min(GetUsedSize(), len);
+        memcpy(dst, buffer_ + read_pos_, read_size);
+        read_pos_ += read_size;
+        is_empty_ = (read_pos_ == write_pos_);
+    }
+
+    if (is_empty_) //drained, an idle session holds no storage
+    {
+        Release();
+    }
+    return read_size;
+}
+
+bool KCPRingBuffer::ReadNoPop(char* dst, int len) const
+{
+    if (len <= 0 || GetUsedSize() < len)
+    {
+        return false;
+    }
+
+    if (read_pos_ >= write_pos_)
+    {
+        int left_size = capacity_ - read_pos_;
+        int first_copy_size = std::min(left_size, len);
+        memcpy(dst, buffer_ + read_pos_, first_copy_size);
+        if (first_copy_size < len)
+        {
+            memcpy(dst + first_copy_size, buffer_, len - first_copy_size);
+        }
+    }
+    else
+    {
+        memcpy(dst, buffer_ + read_pos_, len);
+    }
+
+    return true;
+}
+
+int KCPRingBuffer::GetBufferSize() const
+{
+    return BUFFER_SIZE;
+}
+
+int KCPRingBuffer::GetCapacity() const
+{
+    return capacity_;
+}
+
+void KCPSession::Update(IUINT32 current)
+{
+    assert(NULL != kcp_);
+    if (current >= ikcp_check(kcp_, current))
+    {
+        ikcp_update(kcp_, current);
+    }
+    if (NULL != fec_encoder_) //a short group gets its parity this tick, if it earned one
+    {
+        fec_encoder_->Flush();
+    }
+
+    static thread_local char buffer[kcp_max_package_size];
+    static thread_local IKCPVEC vec[kcp_max_fragments];
+
+    do //revc kcp package 
+    {
+        int count = ikcp_peekv(kcp_, vec, kcp_max_fragments);
+        if (count < 0) //no kcp package
+        {
+            break;
+        }
+        assert(count <= kcp_max_fragments);
+
+        KCPMessageCursor cursor(vec, count);
+        int peek_size = cursor.GetLeft();
+        if (peek_size > kcp_max_package_size) //error kcp package too large
+        {
+            server_->DoErrorLog("kcp peek size(%d) too large", peek_size);
+            break;
+        }
+        if (peek_size > recv_buffer_.GetFreeSize()) //buffer not enough
+        {
+            server_->DoErrorLog("revc buffer remain size(%d) not enough for peek size(%d)",
+                recv_buffer_.GetFreeSize(), peek_size);
+            break;
+        }
+
+        //packages lined up with the message go straight from the segments,
+        //only what is left of a package split across messages hits the ring
+        if (0 == recv_buffer_.GetUsedSize())
+        {
+            DeliverPackages(&cursor);
+        }
+        while (cursor.GetLeft() > 0)
+        {
+            const char* data = NULL;
+            int len = cursor.Next(&data);
+            int written = recv_buffer_.Write(data, len);
+            assert(len == written);
+            (void)written;
+        }
+
+        ikcp_recv(kcp_, NULL, peek_size);
+    } while (true);
+    
+    do
+    {
+        if (!recv_buffer_.ReadNoPop(buffer, 4))
+        {
+            break;
+        }
+
+        IUINT32 tmp_length = *((IUINT32*)(&buffer[0]));
+        if (tmp_length == 0xffffffffu) //KCP heart
+        {
+            recv_buffer_.Read(buffer, 4);
+            //server_->DoErrorLog("Revc heart package");
+            continue;
+        }
+
+        int package_len = (int)(ntohl((u_long)tmp_length) & ~KCP_PACKAGE_COMPRESSED);
+
+        if (package_len <= 0)
+        {
+            //package length invalid
+            server_->DoErrorLog("package size(%d) invalid", package_len);
+            break;
+        }
+
+        if (package_len > kcp_max_package_size ||
+            package_len > recv_buffer_.GetBufferSize())
+        {
+            //package len too large
+            server_->DoErrorLog("package size(%d) too large", package_len);
+            break;
+        }
+        if (package_len > recv_buffer_.GetUsedSize())
+        {
+            break;
+        }
+
+        int read_size = recv_buffer_.Read(buffer, package_len);
+        assert(package_len == read_size);
+        (void)read_size;
+        if (ntohl((u_long)tmp_length) & KCP_PACKAGE_COMPRESSED)
+        {
+            iovec iov;
+            iov.iov_base = buffer;
+            iov.iov_len = package_len;
+            DeliverPacked(&iov, 1, package_len);
+            continue;
+        }
+        server_->OnKCPRevc(kcp_->conv, buffer, package_len);
+    } while (true);
+}
+
+void KCPSession::DeliverPackages(KCPMessageCursor* cursor)
+{
+    static thread_local iovec iov[kcp_max_fragments];
+
+    do
+    {
+        char header[kcp_package_len_size];
+        if (!cursor->Peek(header, kcp_package_len_size))
+        {
+            break;
+        }
+
+        IUINT32 tmp_length = *((IUINT32*)(&header[0]));
+        if (tmp_length == 0xffffffffu) //KCP heart
+        {
+            cursor->Skip(kcp_package_len_size);
+            continue;
+        }
+
+        //anything odd is left to the ring path, which reports it
+        int package_len = (int)(ntohl((u_long)tmp_length) & ~KCP_PACKAGE_COMPRESSED);
+        if (package_len <= 0 || package_len > kcp_max_package_size ||
+            package_len > recv_buffer_.GetBufferSize() ||
+            package_len > cursor->GetLeft())
+        {
+            break;
+        }
+
+        //like the ring path, the package handed up starts with its length
+        int count = cursor->Slice(iov, package_len);
+        if (ntohl((u_long)tmp_length) & KCP_PACKAGE_COMPRESSED)
+        {
+            DeliverPacked(iov, count, package_len);
+            continue;
+        }
+        server_->OnKCPRevc(kcp_->conv, iov, count, package_len);
+    } while (true);
+}
+
+void KCPSession::DeliverPacked(const iovec* iov, int count, int len)
+{
+    static thread_local char packed[kcp_max_package_size];
+    static thread_local char package[kcp_max_package_size];
+
+    const char* data = (const char*)iov[0].iov_base;
+    if (count > 1)
+    {
+        char* dst = packed;
+        for (int i = 0; i < count; i++)
+        {
+            memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+            dst += iov[i].iov_len;
+        }
+        data = packed;
+    }
+
+    int package_len = KCPCompressor::Unpack(data, len, package, kcp_max_package_size);
+    if (package_len < 0)
+    {
+        server_->DoErrorLog("conv(%d) compressed package size(%d) invalid", kcp_->conv, len);
+        return;
+    }
+    server_->OnKCPRevc(kcp_->conv, package, package_len);
+}
+
+bool KCPSession::Compress(const iovec* iov, int count, iovec* packed)
+{
+    static thread_local char gather[kcp_max_package_size];
+    static thread_local char buffer[kcp_max_package_size];
+
+    int len = 0;
+    for (int i = 0; i < count; i++)
+    {
+        len += (int)iov[i].iov_len;
+    }
+    if (len - kcp_package_len_size < server_->options_.compress_min_size ||
+        len > kcp_max_package_size)
+    {
+        return false;
+    }
+    if (compress_skip_ > 0)
+    {
+        compress_skip_--;
+        return false;
+    }
+
+    const char* data = (const char*)iov[0].iov_base;
+    if (count > 1)
+    {
+        char* dst = gather;
+        for (int i = 0; i < count; i++)
+        {
+            memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+            dst += iov[i].iov_len;
+        }
+        data = gather;
+    }
+
+    //worth it only if at least 1/16 comes off, else back off exponentially
+    int packed_len = KCPCompressor::Pack(data, len, buffer, len - len / 16);
+    if (packed_len < 0)
+    {
+        compress_skip_ = std::min(1 << compress_misses_, kcp_compress_max_skip);
+        compress_misses_ += compress_skip_ < kcp_compress_max_skip ? 1 : 0;
+        return false;
+    }
+
+    compress_misses_ = 0;
+    server_->stats_.send_compressed++;
+    server_->stats_.compress_saved += len - packed_len;
+    packed->iov_base = buffer;
+    packed->iov_len = packed_len;
+    return true;
+}
+
+int KCPSession::Send(const char* data, int len)
+{
+    assert(NULL != kcp_);
+    return ikcp_send(kcp_, data, len);
+}
+
+int KCPSession::SendV(const iovec* iov, int count)
+{
+    assert(NULL != kcp_);
+    iovec packed;
+    if (server_->options_.compress_min_size > 0 && Compress(iov, count, &packed))
+    {
+        return ikcp_send(kcp_, (const char*)packed.iov_base, (int)packed.iov_len);
+    }
+
+    static thread_local std::vector<IKCPVEC> vec;
+    vec.resize(count > 0 ? count : 1);
+    for (int i = 0; i < count; i++)
+    {
+        vec[i].data = (const char*)iov[i].iov_base;
+        vec[i].len = (int)iov[i].iov_len;
+    }
+    return ikcp_sendv(kcp_, &vec[0], count);
+}
+
+int KCPSession::SendBuffer(IKCPBUF* buf)
+{
+    assert(NULL != kcp_);
+    return ikcp_sendbuf(kcp_, buf);
+}
+
+IUINT64 KCPSession::LastActiveTime() const
+{
+    return last_active_time_;
+}
+
+IUINT64 KCPSession::NextUpdateTime(IUINT64 current) const
+{
+    assert(NULL != kcp_);
+    if (kcp_->updated && 0 == ikcp_waitsnd(kcp_) && 0 == kcp_->ackcount &&
+        0 == kcp_->probe && 0 != kcp_->rmt_wnd)
+    {
+        //nothing to flush, only input or send wakes it up again
+        return KCP_NEVER_UPDATE;
+    }
+
+    IUINT32 current32 = current & 0xfffffffflu;
+    IUINT32 next = ikcp_check(kcp_, current32);
+    return current + (IUINT32)(next - current32);
+}
+
+int KCPSession::GetConv() const
+{
+    assert(NULL != kcp_);
+    return kcp_->conv;
+}
+
+KCPTimerNode* KCPSession::GetTimer()
+{
+    return &timer_;
+}
+
+void KCPSession::SetKCP(ikcpcb* kcp)
+{
+    kcp_ = kcp;
+}
+
+void KCPSession::SetFec(int data_shards, int parity_shards)
+{
+    assert(NULL != kcp_);
+    if (NULL != fec_encoder_)
+    {
+        fec_encoder_->Flush();
+        delete fec_encoder_;
+        fec_encoder_ = NULL;
+    }
+    delete fec_decoder_; //sized for the old shard counts
+    fec_decoder_ = NULL;
+    if (data_shards > 0 && parity_shards > 0)
+    {
+        fec_encoder_ = new KCPFecEncoder(kcp_->conv, data_shards, parity_shards, 
+            &KCPSession::FecOutput, this);
+    }
+    ResetPathMtu();
+}
+
+int KCPSession::GetMtu() const
+{
+    assert(NULL != kcp_);
+    return (int)kcp_->mtu;
+}
+
+//the options bound the udp payload. with fec on a parity datagram is the
+//fec head, a 2 byte length and the longest kcp datagram of its group.
+//discovery starts over from mtu_min
+void KCPSession::ResetPathMtu()
+{
+    const KCPOptions& options = server_->options_;
+    int head = (NULL != fec_encoder_) ? KCP_FEC_HEAD_LENGTH + 2 : 0;
+    if (ikcp_setpmtu(kcp_, options.mtu_min - head, options.mtu_max - head) < 0)
+    {
+        server_->DoErrorLog("session(%d) mtu(%d, %d) invalid", kcp_->conv, 
+            options.mtu_min, options.mtu_max);
+    }
+}
+
+void KCPSession::KCPInput(const sockaddr_in& sockaddr, const socklen_t socklen, const char* data, 
+    long sz, IUINT64 current)
+{
+    assert(NULL != kcp_);
+    assert(NULL != data);
+
+    if (0 != memcmp(&addr_, &sockaddr, sizeof(sockaddr_in))) //endpoint switch address or port
+    {
+        server_->DoErrorLog("conv(%d) switch address(%s) port(%d) to address(%s) port(%d)",
+            kcp_->conv, inet_ntoa(addr_.sockaddr.sin_addr), ntohs(addr_.sockaddr.sin_port),
+            inet_ntoa(sockaddr.sin_addr), ntohs(sockaddr.sin_port));
+
+        int conv = kcp_->conv;
+        Clear();
+        kcp_ = NewKCP(conv, this, server_->options_);
+        ResetPathMtu(); //a new path as well
+        addr_ = KCPAddr(sockaddr, socklen);
+    }
+
+    if (KCPFecDecoder::IsFec(data, sz))
+    {
+        if (NULL == fec_encoder_) //no shard counts to bound a decoder, parity is dropped
+        {
+            if (KCPFecDecoder::IsFecData(data, sz))
+            {
+                ikcp_input(kcp_, data + KCP_FEC_HEAD_LENGTH, sz - KCP_FEC_HEAD_LENGTH);
+            }
+        }
+        else if (NULL == fec_decoder_)
+        {
+            fec_decoder_ = new KCPFecDecoder(kcp_->conv, fec_encoder_->GetDataShards(), 
+                fec_encoder_->GetParityShards(), server_->options_.mtu_max, 
+                &KCPSession::FecInput, this);
+        }
+        if (NULL != fec_decoder_ && !fec_decoder_->Input(data, sz))
+        {
+            server_->DoErrorLog("conv(%d) fec package len(%ld) invalid", kcp_->conv, sz);
+        }
+    }
+    else
+    {
+        ikcp_input(kcp_, data, sz);
+    }
+    last_active_time_ = current;
+}
+
+void KCPSession::Output(const char* buf, int len)
+{
+    if (NULL != fec_encoder_ && len <= KCP_FEC_MAX_DATAGRAM)
+    {
+        fec_encoder_->Encode(buf, len);
+        return;
+    }
+    server_->DoOutput(addr_, buf, len);
+}
+
+void KCPSession::FecOutput(const char* buf, int len, void* user)
+{
+    KCPSession* session = static_cast<KCPSession*>(user);
+    session->server_->DoOutput(session->addr_, buf, len);
+}
+
+void KCPSession::FecInput(const char* buf, int len, void* user)
+{
+    KCPSession* session = static_cast<KCPSession*>(user);
+    ikcp_input(session->kcp_, buf, len);
+}
+
+void KCPSession::Clear()
+{
+    if (NULL != kcp_)
+    {
+        ikcp_release(kcp_);
+        kcp_ = NULL;
+    }
+    if (NULL != fec_decoder_) //the peer starts its groups over
+    {
+        delete fec_decoder_;
+        fec_decoder_ = NULL;
+    }
+    recv_buffer_.Clear();
+}
+
+KCPSession::KCPSession(KCPServer* server, const KCPAddr& addr, IUINT64 current) :
+    kcp_(NULL), fec_encoder_(NULL), fec_decoder_(NULL), compress_misses_(0), compress_skip_(0), 
+    server_(server), addr_(addr), last_active_time_(current), recv_buffer_(&server->buffer_pool_)
+{
+    timer_.data = this;
+}
+
+KCPSession::~KCPSession()
+{
+    if (NULL != kcp_)
+    {
+        ikcp_release(kcp_);
+    }
+    delete fec_encoder_;
+    delete fec_decoder_;
+}
+
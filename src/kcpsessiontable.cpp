@@ -0,0 +1,175 @@
+#include <assert.h>
+
+#include "kcpsessiontable.h"
+
+const int KCP_SLOT_EMPTY = 0;
+const int KCP_SLOT_USED = 1;
+const int KCP_SLOT_DELETED = 2;
+const int KCP_TABLE_MIN_CAPACITY = 64;
+
+KCPSessionTable::KCPSessionTable() : size_(0), tombstones_(0), shift_(32)
+{
+}
+
+KCPSessionTable::~KCPSessionTable()
+{
+}
+
+int KCPSessionTable::Probe(int conv) const
+{
+    if (slots_.empty())
+    {
+        return -1;
+    }
+
+    int mask = (int)slots_.size() - 1;
+    int pos = HomeSlot(conv);
+    while (true)
+    {
+        const KCPSessionSlot& slot = slots_[pos];
+        if (KCP_SLOT_EMPTY == slot.state)
+        {
+            return -1;
+        }
+        if (KCP_SLOT_USED == slot.state && slot.conv == conv)
+        {
+            return pos;
+        }
+        pos = (pos + 1) & mask;
+    }
+}
+
+KCPSessionSlot* KCPSessionTable::Find(int conv)
+{
+    int pos = Probe(conv);
+    return pos >= 0 ? &slots_[pos] : NULL;
+}
+
+const KCPSessionSlot* KCPSessionTable::Find(int conv) const
+{
+    int pos = Probe(conv);
+    return pos >= 0 ? &slots_[pos] : NULL;
+}
+
+KCPSessionSlot* KCPSessionTable::Insert(int conv, KCPSession* session, IUINT64 current)
+{
+    assert(NULL == Find(conv));
+
+    //keep the load, tombstones included, under 3/4 so probes stay short
+    int capacity = (int)slots_.size();
+    if ((size_ + tombstones_ + 1) * 4 > capacity * 3)
+    {
+        int new_capacity = capacity > 0 ? capacity : KCP_TABLE_MIN_CAPACITY;
+        while ((size_ + 1) * 2 > new_capacity)
+        {
+            new_capacity *= 2;
+        }
+        Rehash(new_capacity);
+    }
+
+    int mask = (int)slots_.size() - 1;
+    int pos = HomeSlot(conv);
+    while (KCP_SLOT_USED == slots_[pos].state)
+    {
+        pos = (pos + 1) & mask;
+    }
+
+    KCPSessionSlot& slot = slots_[pos];
+    if (KCP_SLOT_DELETED == slot.state)
+    {
+        tombstones_--;
+    }
+    slot.conv = conv;
+    slot.state = KCP_SLOT_USED;
+    slot.session = session;
+    slot.last_active = current;
+    size_++;
+    return &slot;
+}
+
+void KCPSessionTable::Erase(int conv)
+{
+    int pos = Probe(conv);
+    if (pos < 0)
+    {
+        return;
+    }
+
+    KCPSessionSlot& slot = slots_[pos];
+    slot.session = NULL;
+    size_--;
+
+    //a slot followed by an empty one ends no probe chain, free it outright
+    int mask = (int)slots_.size() - 1;
+    if (KCP_SLOT_EMPTY == slots_[(pos + 1) & mask].state)
+    {
+        slot.state = KCP_SLOT_EMPTY;
+    }
+    else
+    {
+        slot.state = KCP_SLOT_DELETED;
+        tombstones_++;
+    }
+}
+
+void KCPSessionTable::Clear()
+{
+    size_ = 0;
+    tombstones_ = 0;
+    shift_ = 32;
+    slots_.clear();
+}
+
+int KCPSessionTable::GetSize() const
+{
+    return size_;
+}
+
+int KCPSessionTable::GetCapacity() const
+{
+    return (int)slots_.size();
+}
+
+KCPSessionSlot* KCPSessionTable::GetSlot(int pos)
+{
+    assert(pos >= 0 && pos < (int)slots_.size());
+    KCPSessionSlot& slot = slots_[pos];
+    return KCP_SLOT_USED == slot.state ? &slot : NULL;
+}
+
+int KCPSessionTable::HomeSlot(int conv) const
+{
+    //fibonacci hashing, the top bits mix every bit of the conv
+    return (int)(((IUINT32)conv * 2654435769u) >> shift_);
+}
+
+void KCPSessionTable::Rehash(int capacity)
+{
+    std::vector<KCPSessionSlot> old;
+    old.swap(slots_);
+
+    KCPSessionSlot empty = {0, KCP_SLOT_EMPTY, NULL, 0};
+    slots_.assign(capacity, empty);
+    tombstones_ = 0;
+    shift_ = 32;
+    for (int n = capacity; n > 1; n >>= 1)
+    {
+        shift_--;
+    }
+
+    int mask = capacity - 1;
+    for (size_t i = 0; i < old.size(); i++)
+    {
+        if (KCP_SLOT_USED != old[i].state)
+        {
+            continue;
+        }
+
+        int pos = HomeSlot(old[i].conv);
+        while (KCP_SLOT_EMPTY != slots_[pos].state)
+        {
+            pos = (pos + 1) & mask;
+        }
+        slots_[pos] = old[i];
+    }
+}
@@ -0,0 +1,209 @@
+#include <assert.h>
+
+#include "kcptimerwheel.h"
+
+KCPTimerNode::KCPTimerNode() : expire(0), pending(false), data(NULL)
+{
+    node.next = NULL;
+    node.prev = NULL;
+}
+
+KCPTimerWheel::KCPTimerWheel()
+{
+    Init(0);
+}
+
+KCPTimerWheel::~KCPTimerWheel()
+{
+}
+
+void KCPTimerWheel::Init(IUINT64 current)
+{
+    current_ = current;
+    count_ = 0;
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for (int i = 0; i < WHEEL_SIZE; i++)
+        {
+            iqueue_init(&slots_[level][i]);
+        }
+    }
+}
+
+void KCPTimerWheel::Schedule(KCPTimerNode* timer, IUINT64 expire)
+{
+    assert(NULL != timer);
+    Cancel(timer);
+    timer->expire = expire;
+    timer->pending = true;
+    count_++;
+    AddTimer(timer);
+}
+
+void KCPTimerWheel::Cancel(KCPTimerNode* timer)
+{
+    assert(NULL != timer);
+    if (NULL != timer->node.next) //in a slot or in a due list
+    {
+        iqueue_del(&timer->node);
+    }
+    if (timer->pending)
+    {
+        timer->pending = false;
+        count_--;
+    }
+}
+
+void KCPTimerWheel::Expire(IUINT64 current, iqueue_head* due)
+{
+    assert(NULL != due);
+    if (0 == count_)
+    {
+        if (current >= current_)
+        {
+            current_ = current + 1;
+        }
+        return;
+    }
+
+    while (current_ <= current)
+    {
+        int index = (int)(current_ & WHEEL_MASK);
+        if (0 == index)
+        {
+            //pull the next span of every upper level down before ticking it
+            for (int level = 1; level < WHEEL_LEVELS; level++)
+            {
+                int level_index = (int)((current_ >> (level * WHEEL_BITS)) & WHEEL_MASK);
+                Cascade(level, level_index);
+                if (0 != level_index)
+                {
+                    break;
+                }
+            }
+        }
+
+        iqueue_head* slot = &slots_[0][index];
+        while (!iqueue_is_empty(slot))
+        {
+            KCPTimerNode* timer = iqueue_entry(slot->next, KCPTimerNode, node);
+            iqueue_del(&timer->node);
+            iqueue_add_tail(&timer->node, due);
+            timer->pending = false;
+            count_--;
+        }
+
+        if (0 == count_)
+        {
+            current_ = current + 1;
+            break;
+        }
+
+        //skip empty slots up to the next cascade point
+        IUINT64 next = current_ + 1;
+        while ((next & WHEEL_MASK) != 0 && next <= current &&
+            iqueue_is_empty(&slots_[0][next & WHEEL_MASK]))
+        {
+            next++;
+        }
+        current_ = next;
+    }
+}
+
+IUINT64 KCPTimerWheel::NextExpireTime() const
+{
+    if (0 == count_)
+    {
+        return ~0ULL;
+    }
+
+    IUINT64 next = ~0ULL;
+    for (int i = (int)(current_ & WHEEL_MASK); i < WHEEL_SIZE; i++)
+    {
+        if (!iqueue_is_empty(&slots_[0][i]))
+        {
+            return (current_ & ~(IUINT64)WHEEL_MASK) + i;
+        }
+    }
+
+    //upper levels only tell the start of the span holding the timer
+    for (int level = 1; level < WHEEL_LEVELS; level++)
+    {
+        int shift = level * WHEEL_BITS;
+        IUINT64 span = current_ >> shift;
+        for (int k = 1; k <= WHEEL_SIZE; k++)
+        {
+            if (!iqueue_is_empty(&slots_[level][(span + k) & WHEEL_MASK]))
+            {
+                IUINT64 start = (span + k) << shift;
+                if (start < next)
+                {
+                    next = start;
+                }
+                break;
+            }
+        }
+    }
+
+    //level 0 slots behind current_ hold timers of the next span
+    for (int i = 0; i < (int)(current_ & WHEEL_MASK); i++)
+    {
+        if (!iqueue_is_empty(&slots_[0][i]))
+        {
+            IUINT64 expire = (current_ | WHEEL_MASK) + 1 + i;
+            if (expire < next)
+            {
+                next = expire;
+            }
+            break;
+        }
+    }
+
+    return next;
+}
+
+int KCPTimerWheel::GetSize() const
+{
+    return count_;
+}
+
+void KCPTimerWheel::AddTimer(KCPTimerNode* timer)
+{
+    IUINT64 expire = timer->expire;
+    if (expire < current_)
+    {
+        expire = current_;
+    }
+
+    IUINT64 delta = expire - current_;
+    const IUINT64 max_delta = (1ULL << (WHEEL_LEVELS * WHEEL_BITS)) - 1;
+    if (delta > max_delta)
+    {
+        expire = current_ + max_delta;
+        delta = max_delta;
+    }
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << ((level + 1) * WHEEL_BITS)))
+    {
+        level++;
+    }
+
+    int index = (int)((expire >> (level * WHEEL_BITS)) & WHEEL_MASK);
+    iqueue_add_tail(&timer->node, &slots_[level][index]);
+}
+
+void KCPTimerWheel::Cascade(int level, int index)
+{
+    iqueue_head list;
+    iqueue_init(&list);
+    iqueue_splice(&slots_[level][index], &list);
+    iqueue_init(&slots_[level][index]);
+
+    while (!iqueue_is_empty(&list))
+    {
+        KCPTimerNode* timer = iqueue_entry(list.next, KCPTimerNode, node);
+        iqueue_del(&timer->node);
+        AddTimer(timer);
+    }
+}
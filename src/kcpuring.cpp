@@ -0,0 +1,525 @@
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <linux/io_uring.h>
+
+#include "kcpiobackend.h"
+
+//the raw syscalls, liburing is not a dependency of this project
+static int io_uring_setup(unsigned entries, io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+const int KCP_URING_BGID = 0; //the receive ring's only buffer group
+const int KCP_URING_MAX_BUFS = 32768; //largest provided buffer ring
+
+//one mmapped submission/completion ring pair
+struct KCPUring
+{
+    KCPUring();
+    ~KCPUring();
+
+    bool Init(unsigned entries, unsigned cq_entries);
+    io_uring_sqe* GetSqe();
+    int Submit(unsigned min_complete);
+    io_uring_cqe* PeekCqe();
+    void SeenCqe();
+
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_sqe* sqes;
+    io_uring_cqe* cqes;
+    unsigned sq_entries;
+    unsigned pending; //sqes filled but not yet submitted
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+KCPUring::KCPUring() : fd(-1), sq_head(NULL), sq_tail(NULL), sq_mask(NULL),
+    sq_array(NULL), cq_head(NULL), cq_tail(NULL), cq_mask(NULL), sqes(NULL),
+    cqes(NULL), sq_entries(0), pending(0), sq_ptr(MAP_FAILED), sq_size(0),
+    cq_ptr(MAP_FAILED), cq_size(0), sqes_size(0)
+{
+}
+
+KCPUring::~KCPUring()
+{
+    if (sqes != NULL)
+    {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+    {
+        munmap(cq_ptr, cq_size);
+    }
+    if (sq_ptr != MAP_FAILED)
+    {
+        munmap(sq_ptr, sq_size);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+bool KCPUring::Init(unsigned entries, unsigned cq_entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (cq_entries > 0) //a multishot request posts many completions for one sqe
+    {
+        params.flags |= IORING_SETUP_CQSIZE;
+        params.cq_entries = cq_entries;
+    }
+
+    fd = io_uring_setup(entries, &params);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        sq_size = cq_size = std::max(sq_size, cq_size);
+    }
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == sq_ptr)
+    {
+        return false;
+    }
+
+    cq_ptr = sq_ptr;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == cq_ptr)
+        {
+            return false;
+        }
+    }
+
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void* ptr = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        fd, IORING_OFF_SQES);
+    if (MAP_FAILED == ptr)
+    {
+        return false;
+    }
+    sqes = (io_uring_sqe*)ptr;
+
+    char* sq = (char*)sq_ptr;
+    sq_head = (unsigned*)(sq + params.sq_off.head);
+    sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + params.sq_off.array);
+    sq_entries = params.sq_entries;
+
+    char* cq = (char*)cq_ptr;
+    cq_head = (unsigned*)(cq + params.cq_off.head);
+    cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+io_uring_sqe* KCPUring::GetSqe()
+{
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *sq_tail + pending;
+    if (tail - head >= sq_entries)
+    {
+        return NULL;
+    }
+
+    unsigned index = tail & *sq_mask;
+    sq_array[index] = index;
+    pending++;
+
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int KCPUring::Submit(unsigned min_complete)
+{
+    unsigned count = pending;
+    __atomic_store_n(sq_tail, *sq_tail + pending, __ATOMIC_RELEASE);
+    pending = 0;
+
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int ret = 0;
+    do
+    {
+        ret = io_uring_enter(fd, count, min_complete, flags);
+    } while (ret < 0 && EINTR == errno);
+    return ret;
+}
+
+io_uring_cqe* KCPUring::PeekCqe()
+{
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    return &cqes[head & *cq_mask];
+}
+
+void KCPUring::SeenCqe()
+{
+    __atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+}
+
+KCPUringBackend::KCPUringBackend(KCPServer* server, int recv_entries, int recv_slot_size,
+    int send_entries) : KCPIOBackend(server),
+    recv_entries_(recv_entries > 0 ? recv_entries : 1), slot_size_(recv_slot_size),
+    send_entries_(send_entries > 0 ? send_entries : 1), recv_ring_(NULL), send_ring_(NULL),
+    buf_ring_(NULL), buf_ring_size_(0), buf_count_(0), buf_size_(0), buf_tail_(0),
+    recv_armed_(false), send_outstanding_(0)
+{
+    memset(&recv_hdr_, 0, sizeof(recv_hdr_));
+}
+
+KCPUringBackend::~KCPUringBackend()
+{
+    //the kernel may still read a batch in flight, let it finish first
+    if (send_outstanding_ > 0)
+    {
+        send_ring_->Submit(send_outstanding_);
+    }
+
+    //closing the ring cancels the multishot recvmsg and drops the buffer ring
+    delete recv_ring_;
+    delete send_ring_;
+    if (NULL != buf_ring_)
+    {
+        munmap(buf_ring_, buf_ring_size_);
+    }
+}
+
+bool KCPUringBackend::Init(int fd)
+{
+    fd_ = fd;
+    buf_count_ = 1;
+    while (buf_count_ < recv_entries_ && buf_count_ < KCP_URING_MAX_BUFS)
+    {
+        buf_count_ <<= 1;
+    }
+
+    //every buffer can complete once before Read() hands it back, plus the last cqe
+    recv_ring_ = new KCPUring();
+    send_ring_ = new KCPUring();
+    if (!recv_ring_->Init(2, buf_count_ * 2) || !send_ring_->Init(send_entries_, 0))
+    {
+        DoErrorLog("call io_uring_setup error:%s", strerror(errno));
+        return false;
+    }
+    if (!InitBufRing())
+    {
+        return false;
+    }
+    inflight_.Init(send_entries_, KCP_RECV_SLOT_SIZE);
+    completed_.resize(send_entries_);
+
+    if (!ArmRecv() || recv_ring_->Submit(0) < 0)
+    {
+        DoErrorLog("submit io_uring recvmsg error:%s", strerror(errno));
+        return false;
+    }
+
+    //a kernel without multishot recvmsg fails the request right away
+    io_uring_cqe* cqe = recv_ring_->PeekCqe();
+    if (cqe != NULL && cqe->res < 0 && -EAGAIN != cqe->res && -EINTR != cqe->res)
+    {
+        DoErrorLog("io_uring recvmsg error:%s", strerror(-cqe->res));
+        return false;
+    }
+    return true;
+}
+
+bool KCPUringBackend::InitBufRing()
+{
+    buf_size_ = (int)(sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + KCP_GRO_CONTROL_SIZE)
+        + slot_size_;
+    recv_bufs_.resize((size_t)buf_count_ * buf_size_);
+
+    //the ring must be page aligned, which an anonymous mapping always is
+    buf_ring_size_ = buf_count_ * sizeof(io_uring_buf);
+    void* ptr = mmap(NULL, buf_ring_size_, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == ptr)
+    {
+        DoErrorLog("map io_uring buffer ring error:%s", strerror(errno));
+        return false;
+    }
+    buf_ring_ = (io_uring_buf*)ptr;
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (IUINT64)(unsigned long)buf_ring_;
+    reg.ring_entries = buf_count_;
+    reg.bgid = KCP_URING_BGID;
+    if (io_uring_register(recv_ring_->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        DoErrorLog("register io_uring buffer ring error:%s", strerror(errno));
+        return false;
+    }
+
+    buf_tail_ = 0;
+    for (int bid = 0; bid < buf_count_; bid++)
+    {
+        RecycleRecvBuf(bid);
+    }
+    __atomic_store_n(&((io_uring_buf_ring*)buf_ring_)->tail, buf_tail_, __ATOMIC_RELEASE);
+
+    //the kernel lays out each datagram as head, name, control, payload
+    recv_hdr_.msg_namelen = sizeof(sockaddr_in);
+    recv_hdr_.msg_controllen = KCP_GRO_CONTROL_SIZE;
+    return true;
+}
+
+bool KCPUringBackend::ArmRecv()
+{
+    io_uring_sqe* sqe = recv_ring_->GetSqe();
+    if (NULL == sqe)
+    {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd_;
+    sqe->addr = (IUINT64)(unsigned long)&recv_hdr_;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = KCP_URING_BGID;
+    recv_armed_ = true;
+    return true;
+}
+
+char* KCPUringBackend::GetRecvBuf(int bid)
+{
+    return &recv_bufs_[(size_t)bid * buf_size_];
+}
+
+void KCPUringBackend::RecycleRecvBuf(int bid)
+{
+    //visible to the kernel once the tail is published
+    io_uring_buf* buf = &buf_ring_[buf_tail_ & (buf_count_ - 1)];
+    buf->addr = (IUINT64)(unsigned long)GetRecvBuf(bid);
+    buf->len = buf_size_;
+    buf->bid = (unsigned short)bid;
+    buf_tail_++;
+}
+
+int KCPUringBackend::GetPollFd() const
+{
+    return recv_ring_->fd;
+}
+
+void KCPUringBackend::Read()
+{
+    int count = 0;
+    io_uring_cqe* cqe = NULL;
+    while ((cqe = recv_ring_->PeekCqe()) != NULL)
+    {
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        recv_ring_->SeenCqe();
+
+        //without F_MORE the request is done, an empty buffer ring (ENOBUFS) included
+        if (!(flags & IORING_CQE_F_MORE))
+        {
+            recv_armed_ = false;
+        }
+        if (res < 0)
+        {
+            if (-EAGAIN != res && -EINTR != res && -ENOBUFS != res)
+            {
+                DoErrorLog("io_uring recvmsg error(%d):%s", -res, strerror(-res));
+            }
+            continue;
+        }
+        if (!(flags & IORING_CQE_F_BUFFER))
+        {
+            continue;
+        }
+
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        char* buf = GetRecvBuf(bid);
+        io_uring_recvmsg_out* out = (io_uring_recvmsg_out*)buf;
+        msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_name = buf + sizeof(io_uring_recvmsg_out);
+        hdr.msg_namelen = std::min(out->namelen, (IUINT32)sizeof(sockaddr_in));
+        hdr.msg_control = (char*)hdr.msg_name + sizeof(sockaddr_in);
+        hdr.msg_controllen = out->controllen;
+        hdr.msg_flags = out->flags;
+
+        count++;
+        OnReceived(hdr, (char*)hdr.msg_control + KCP_GRO_CONTROL_SIZE,
+            (int)out->payloadlen, slot_size_);
+        RecycleRecvBuf(bid);
+    }
+    __atomic_store_n(&((io_uring_buf_ring*)buf_ring_)->tail, buf_tail_, __ATOMIC_RELEASE);
+
+    if (count > 0)
+    {
+        OnRecvBatch(count);
+    }
+    if (!recv_armed_ && (!ArmRecv() || recv_ring_->Submit(0) < 0))
+    {
+        DoErrorLog("submit io_uring recvmsg error:%s", strerror(errno));
+    }
+}
+
+void KCPUringBackend::Flush(KCPOutputQueue* queue)
+{
+    ReapSends(queue);
+    if (send_outstanding_ > 0 && queue->IsFull())
+    {
+        //nothing more fits until the ring hands the batch in flight back
+        send_ring_->Submit(send_outstanding_);
+        ReapSends(queue);
+    }
+    if (send_outstanding_ > 0)
+    {
+        return; //the queue keeps growing, it goes out on a later flush
+    }
+
+    //datagrams left over from EAGAIN go first, then the queue becomes the batch
+    if (inflight_.IsEmpty())
+    {
+        inflight_.Swap(queue);
+    }
+    SubmitSends();
+
+    //udp sends mostly complete inside the submit, reap them without waiting
+    ReapSends(queue);
+}
+
+bool KCPUringBackend::HasPending() const
+{
+    return !inflight_.IsEmpty();
+}
+
+void KCPUringBackend::SubmitSends()
+{
+    int count = inflight_.GetSize();
+    if (0 == count)
+    {
+        return;
+    }
+    mmsghdr* msgs = inflight_.GetMessages();
+    completed_.assign(completed_.size(), 0);
+
+    int submitted = 0;
+    for (int i = 0; i < count; i++)
+    {
+        io_uring_sqe* sqe = send_ring_->GetSqe();
+        if (NULL == sqe)
+        {
+            break;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd_;
+        sqe->addr = (IUINT64)(unsigned long)&msgs[i].msg_hdr;
+        sqe->len = 1;
+        sqe->user_data = i;
+        submitted++;
+    }
+
+    //the msghdrs point into inflight_, which stays put until every sqe completes
+    if (send_ring_->Submit(0) < 0)
+    {
+        DoErrorLog("submit io_uring sendmsg error:%s", strerror(errno));
+        return;
+    }
+    send_outstanding_ = submitted;
+    OnSendCall();
+}
+
+void KCPUringBackend::ReapSends(KCPOutputQueue* queue)
+{
+    if (0 == send_outstanding_)
+    {
+        return;
+    }
+
+    bool again = false;
+    io_uring_cqe* cqe = NULL;
+    while ((cqe = send_ring_->PeekCqe()) != NULL)
+    {
+        int index = (int)cqe->user_data;
+        int res = cqe->res;
+        send_ring_->SeenCqe();
+        send_outstanding_--;
+        if (res >= 0)
+        {
+            completed_[index] = 1;
+            OnSent(&inflight_, index);
+        }
+        else if (-EAGAIN == res || -EWOULDBLOCK == res || -ENOBUFS == res)
+        {
+            again = true; //kept for the next flush, ahead of the queue
+        }
+        else if (OnSegmentError(&inflight_, index, -res))
+        {
+            queue->SetSegmentation(false);
+            completed_[index] = 1;
+        }
+        else
+        {
+            const sockaddr_in& addr = inflight_.GetAddr(index);
+            DoErrorLog("udp send data size(%d) to address(%s) port(%d) error:%s",
+                inflight_.GetLength(index), inet_ntoa(addr.sin_addr),
+                ntohs(addr.sin_port), strerror(-res));
+            OnSendDropped();
+            completed_[index] = 1;
+        }
+    }
+
+    if (again)
+    {
+        OnSendAgain();
+    }
+    if (0 == send_outstanding_)
+    {
+        inflight_.Remove(&completed_[0]);
+    }
+}
+
+const char* KCPUringBackend::GetName() const
+{
+    return "io_uring";
+}
@@ -1,83 +1,770 @@
-#include <stdio.h>
-#include <unistd.h>
-#include <string.h>
-
-#include "kcpserver.h"
-
-void on_kcp_revc(int conv, const char* data, int len)
-{
-    assert(len >= 4);
-    char buffer[1024];
-    memcpy(buffer, data, len);
-    buffer[len] = '\0';
-    printf("[RECV] conv=%d data=%s len(%d)\n", conv, &buffer[4], len - 4);
-}
-
-void on_session_kick(int conv)
-{
-    printf("conv:%d kicked\n", conv);
-}
-
-void on_error_report(const char* data)
-{
-    printf("kcp error:%s\n", data);
-}
-
-void isleep(unsigned long millisecond)
-{
-    usleep((millisecond << 10) - (millisecond << 4) - (millisecond << 3));
-}
-
-void test_ring_buffer()
-{
-    const char* s = "0123456789";
-    char buf[15];
-    int loop = 100;
-    KCPRingBuffer q;
-    do
-    {
-        assert(q.GetUsedSize() == 0);
-        for (int i = 0; i < 5; i++)
-        {
-            assert(9 == q.Write(s, 9));
-        }
-        //assert(q.GetUsedSize() == KCPRingBuffer::BUFFER_SIZE);
-        for (int i = 0; i < 5; i++)
-        {
-            assert(q.Read(buf, 9) == 9);
-            buf[9] = 0;
-            printf("read from q:%s\n", buf);
-            assert(memcmp(s, buf, 9) == 0);
-        }
-        assert(q.GetUsedSize() == 0);
-    } while (loop--);
-}
-
-int main()
-{
-    //test_ring_buffer();
-
-    
-    KCPOptions options;
-    options.recv_cb = on_kcp_revc;
-    options.kick_cb = on_session_kick;
-    options.error_reporter = on_error_report;
-    options.port = 9528;
-    KCPServer server;
-    server.SetOption(options);
-    if (!server.Start())
-    {
-        printf("server start error");
-        exit(0);
-    }
-
-    printf("kcp server start...\n");
-
-    while (true)
-    {
-        isleep(1);
-        server.Update();
-    }
-
-    return 0;
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <map>
+#include <algorithm>
+#include <vector>
+#include <string>
+
+#include "kcpserver.h"
+#include "kcpfec.h"
+#include "kcpcompress.h"
+
+void on_kcp_revc(int conv, const char* data, int len)
+{
+    assert(len >= 4);
+    char buffer[1024];
+    memcpy(buffer, data, len);
+    buffer[len] = '\0';
+    printf("[RECV] conv=%d data=%s len(%d)\n", conv, &buffer[4], len - 4);
+}
+
+void on_session_kick(int conv)
+{
+    printf("conv:%d kicked\n", conv);
+}
+
+void on_error_report(const char* data)
+{
+    printf("kcp error:%s\n", data);
+}
+
+void isleep(unsigned long millisecond)
+{
+    usleep((millisecond << 10) - (millisecond << 4) - (millisecond << 3));
+}
+
+void test_ring_buffer()
+{
+    const char* s = "0123456789";
+    char buf[15];
+    int loop = 100;
+    KCPBufferPool pool;
+    KCPRingBuffer q(&pool);
+    do
+    {
+        assert(q.GetUsedSize() == 0);
+        for (int i = 0; i < 5; i++)
+        {
+            assert(9 == q.Write(s, 9));
+        }
+        //assert(q.GetUsedSize() == KCPRingBuffer::BUFFER_SIZE);
+        for (int i = 0; i < 5; i++)
+        {
+            assert(q.Read(buf, 9) == 9);
+            buf[9] = 0;
+            printf("read from q:%s\n", buf);
+            assert(memcmp(s, buf, 9) == 0);
+        }
+        assert(q.GetUsedSize() == 0);
+    } while (loop--);
+}
+
+double now_us()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void bench_session_table()
+{
+    const int counts[] = {10000, 100000, 1000000};
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+    {
+        int n = counts[c];
+        std::vector<int> convs(n);
+        for (int i = 0; i < n; i++)
+        {
+            convs[i] = rand();
+        }
+        std::vector<int> probes(convs);
+        std::random_shuffle(probes.begin(), probes.end());
+        KCPSession* fake = reinterpret_cast<KCPSession*>(&convs[0]);
+        long hits = 0;
+
+        std::map<int, KCPSession*> m;
+        double t0 = now_us();
+        for (int i = 0; i < n; i++)
+        {
+            m[convs[i]] = fake;
+        }
+        double t1 = now_us();
+        for (int i = 0; i < n; i++)
+        {
+            hits += m.find(probes[i]) != m.end();
+        }
+        double t2 = now_us();
+        for (auto it = m.begin(); it != m.end(); ++it)
+        {
+            hits += it->second == fake;
+        }
+        double t3 = now_us();
+        for (int i = 0; i < n; i++)
+        {
+            m.erase(probes[i]);
+        }
+        double t4 = now_us();
+        printf("map   n=%7d insert %6.1fns find %6.1fns walk %6.1fns erase %6.1fns\n", n,
+            (t1 - t0) * 1000 / n, (t2 - t1) * 1000 / n, (t3 - t2) * 1000 / n, (t4 - t3) * 1000 / n);
+
+        KCPSessionTable table;
+        t0 = now_us();
+        for (int i = 0; i < n; i++)
+        {
+            if (NULL == table.Find(convs[i]))
+            {
+                table.Insert(convs[i], fake, 0);
+            }
+        }
+        t1 = now_us();
+        for (int i = 0; i < n; i++)
+        {
+            hits += NULL != table.Find(probes[i]);
+        }
+        t2 = now_us();
+        for (int pos = 0; pos < table.GetCapacity(); pos++)
+        {
+            KCPSessionSlot* slot = table.GetSlot(pos);
+            hits += NULL != slot && slot->session == fake;
+        }
+        t3 = now_us();
+        for (int i = 0; i < n; i++)
+        {
+            table.Erase(probes[i]);
+        }
+        t4 = now_us();
+        printf("table n=%7d insert %6.1fns find %6.1fns walk %6.1fns erase %6.1fns\n", n,
+            (t1 - t0) * 1000 / n, (t2 - t1) * 1000 / n, (t3 - t2) * 1000 / n, (t4 - t3) * 1000 / n);
+        printf("(%ld)\n", hits);
+    }
+}
+
+static std::vector<std::string> bench_datagrams;
+
+int bench_output(const char* buf, int len, ikcpcb* kcp, void* user)
+{
+    bench_datagrams.push_back(std::string(buf, len));
+    return 0;
+}
+
+//per segment cost of ikcp_input header decode and ack encode in ikcp_flush
+void bench_ikcp_codec()
+{
+    const int rounds = 2000;
+    ikcpcb* sender = ikcp_create(1, NULL);
+    ikcpcb* receiver = ikcp_create(1, NULL);
+    ikcp_setoutput(sender, bench_output);
+    ikcp_setoutput(receiver, bench_output);
+    ikcp_nodelay(sender, 1, 10, 2, 1);
+    ikcp_wndsize(sender, 128, 128);
+    ikcp_wndsize(receiver, 128, 128);
+
+    //one datagram of small pushes, delivered once so every later copy is stale
+    for (int i = 0; i < 64; i++)
+    {
+        ikcp_send(sender, "x", 1);
+    }
+    ikcp_update(sender, 0);
+    ikcp_update(receiver, 0);
+    std::string push = bench_datagrams[0];
+    int segments = 0;
+    for (size_t pos = 0; pos + 24 <= push.size(); segments++)
+    {
+        IUINT32 len;
+        memcpy(&len, push.data() + pos + 20, 4);
+        pos += 24 + len;
+    }
+    bench_datagrams.clear();
+    ikcp_input(receiver, push.data(), push.size());
+    ikcp_flush(receiver);
+    std::string ack = bench_datagrams[0];
+    ikcp_input(sender, ack.data(), ack.size());
+    bench_datagrams.clear();
+
+    //best block of rounds, filters out preemption on a busy host
+    double ack_in = 1e30, push_in = 1e30;
+    for (int block = 0; block < 200; block++)
+    {
+        double t0 = now_us();
+        for (int i = 0; i < rounds; i++)
+        {
+            ikcp_input(sender, ack.data(), ack.size());
+        }
+        double t1 = now_us();
+        for (int i = 0; i < rounds; i++)
+        {
+            ikcp_input(receiver, push.data(), push.size());
+            ikcp_flush(receiver);
+            bench_datagrams.clear();
+        }
+        double t2 = now_us();
+        ack_in = std::min(ack_in, t1 - t0);
+        push_in = std::min(push_in, t2 - t1);
+    }
+    printf("segments %d: ack in %5.2fns push in + ack out %5.2fns per segment\n", segments,
+        ack_in * 1000 / rounds / segments, push_in * 1000 / rounds / segments);
+
+    ikcp_release(sender);
+    ikcp_release(receiver);
+}
+
+//gf(2^8) multiply-add and group encode throughput of every kernel the cpu has
+void bench_fec_codec()
+{
+    const int len = 64 * 1024;
+    const int shard_size = 1400;
+    const int data_shards = 10;
+    const int parity_shards = 4;
+    std::vector<char> src(len), dst(len);
+    std::vector<char> shards((data_shards + parity_shards) * shard_size);
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        shards[i] = (char)rand();
+    }
+    for (int i = 0; i < len; i++)
+    {
+        src[i] = (char)rand();
+    }
+    const char* data[data_shards];
+    char* parity[parity_shards];
+    for (int i = 0; i < data_shards; i++)
+    {
+        data[i] = &shards[i * shard_size];
+    }
+    for (int i = 0; i < parity_shards; i++)
+    {
+        parity[i] = &shards[(data_shards + i) * shard_size];
+    }
+
+    for (int kernel = KCP_GF_SCALAR; kernel <= KCP_GF_AVX2; kernel++)
+    {
+        if (KCPReedSolomon::SetKernel(kernel) != kernel)
+        {
+            break;
+        }
+
+        double muladd = 1e30, encode = 1e30;
+        for (int block = 0; block < 50; block++)
+        {
+            double t0 = now_us();
+            for (int i = 0; i < 16; i++)
+            {
+                KCPReedSolomon::MulAdd(&dst[0], &src[0], (IUINT8)(i + 2), len);
+            }
+            double t1 = now_us();
+            for (int i = 0; i < 16; i++)
+            {
+                KCPReedSolomon::Encode(data, data_shards, parity, parity_shards, shard_size);
+            }
+            double t2 = now_us();
+            muladd = std::min(muladd, t1 - t0);
+            encode = std::min(encode, t2 - t1);
+        }
+        printf("%-6s muladd %8.1fMB/s encode %d+%d %8.1fMB/s of data\n", 
+            KCPReedSolomon::GetKernelName(kernel), 16.0 * len / muladd, data_shards, 
+            parity_shards, 16.0 * data_shards * shard_size / encode);
+    }
+    KCPReedSolomon::SetKernel(KCP_GF_AVX2);
+}
+
+//two kcp endpoints over a simulated lossy link in virtual time
+struct FecBenchPeer
+{
+    ikcpcb* kcp;
+    KCPFecEncoder* encoder;
+    KCPFecDecoder* decoder;
+    int index;
+};
+
+static std::multimap<IUINT32, std::pair<int, std::string> > fec_link;
+static IUINT32 fec_link_now;
+static const IUINT32 fec_link_delay = 20; //ms one way
+static int fec_link_loss; //percent
+static int fec_link_sent;
+static int fec_link_mtu; //larger datagrams vanish from fec_link_mtu_from on, 0 for none
+static IUINT32 fec_link_mtu_from;
+
+void fec_link_send(const char* buf, int len, void* user)
+{
+    FecBenchPeer* peer = (FecBenchPeer*)user;
+    fec_link_sent++;
+    if (rand() % 100 < fec_link_loss)
+    {
+        return;
+    }
+    if (fec_link_mtu > 0 && len > fec_link_mtu && fec_link_now >= fec_link_mtu_from)
+    {
+        return;
+    }
+    fec_link.insert(std::make_pair(fec_link_now + fec_link_delay, 
+        std::make_pair(1 - peer->index, std::string(buf, len))));
+}
+
+int fec_kcp_output(const char* buf, int len, ikcpcb* kcp, void* user)
+{
+    FecBenchPeer* peer = (FecBenchPeer*)user;
+    if (NULL != peer->encoder)
+    {
+        peer->encoder->Encode(buf, len);
+    }
+    else
+    {
+        fec_link_send(buf, len, user);
+    }
+    return 0;
+}
+
+void fec_kcp_input(const char* buf, int len, void* user)
+{
+    ikcp_input(((FecBenchPeer*)user)->kcp, buf, len);
+}
+
+void bench_fec_run(int loss, int data_shards, int parity_shards)
+{
+    const int messages = 5000;
+    const int interval = 2; //ms between messages, about 5 datagrams a kcp flush
+    FecBenchPeer peers[2];
+    for (int i = 0; i < 2; i++)
+    {
+        peers[i].index = i;
+        peers[i].kcp = ikcp_create(1, &peers[i]);
+        ikcp_setoutput(peers[i].kcp, fec_kcp_output);
+        ikcp_nodelay(peers[i].kcp, 1, 10, 2, 1);
+        ikcp_wndsize(peers[i].kcp, 128, 128);
+        peers[i].encoder = data_shards > 0 ? new KCPFecEncoder(1, data_shards, parity_shards, 
+            fec_link_send, &peers[i]) : NULL;
+        peers[i].decoder = new KCPFecDecoder(1, data_shards, parity_shards, 
+            KCP_FEC_HEAD_LENGTH + 2 + KCP_FEC_MAX_DATAGRAM, fec_kcp_input, &peers[i]);
+    }
+
+    srand(1);
+    fec_link.clear();
+    fec_link_loss = loss;
+    fec_link_sent = 0;
+    std::vector<IUINT32> latency;
+    char message[1000] = { 0 };
+
+    for (fec_link_now = 0; (int)latency.size() < messages && fec_link_now < 600 * 1000; 
+        fec_link_now++)
+    {
+        if (fec_link_now % interval == 0 && fec_link_now < (IUINT32)(messages * interval))
+        {
+            memcpy(message, &fec_link_now, 4);
+            ikcp_send(peers[0].kcp, message, sizeof(message));
+        }
+        while (!fec_link.empty() && fec_link.begin()->first <= fec_link_now)
+        {
+            FecBenchPeer* peer = &peers[fec_link.begin()->second.first];
+            const std::string& datagram = fec_link.begin()->second.second;
+            if (KCPFecDecoder::IsFec(datagram.data(), datagram.size()))
+            {
+                peer->decoder->Input(datagram.data(), datagram.size());
+            }
+            else
+            {
+                ikcp_input(peer->kcp, datagram.data(), datagram.size());
+            }
+            fec_link.erase(fec_link.begin());
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            ikcp_update(peers[i].kcp, fec_link_now);
+            if (NULL != peers[i].encoder)
+            {
+                peers[i].encoder->Flush();
+            }
+        }
+        while (ikcp_recv(peers[1].kcp, message, sizeof(message)) > 0)
+        {
+            IUINT32 sent;
+            memcpy(&sent, message, 4);
+            latency.push_back(fec_link_now - sent);
+        }
+    }
+
+    std::sort(latency.begin(), latency.end());
+    size_t n = latency.size();
+    printf("loss %2d%% fec %2d+%d: p50 %4ums p99 %4ums p99.9 %4ums max %4ums, "
+        "%d datagrams, %llu rebuilt\n", loss, data_shards, parity_shards,
+        n ? latency[n / 2] : 0, n ? latency[n * 99 / 100] : 0, n ? latency[n * 999 / 1000] : 0,
+        n ? latency[n - 1] : 0, fec_link_sent, (unsigned long long)peers[1].decoder->GetRecovered());
+
+    for (int i = 0; i < 2; i++)
+    {
+        ikcp_release(peers[i].kcp);
+        delete peers[i].encoder;
+        delete peers[i].decoder;
+    }
+}
+
+//delivery latency percentiles with fec off and on, 20ms one way
+void bench_fec_latency()
+{
+    const int losses[] = { 1, 5, 10, 20 };
+    for (size_t i = 0; i < sizeof(losses) / sizeof(losses[0]); i++)
+    {
+        bench_fec_run(losses[i], 0, 0);
+        bench_fec_run(losses[i], 4, 2);
+        bench_fec_run(losses[i], 8, 4);
+    }
+}
+
+static int test_message_length(int index)
+{
+    return 8 + (index * 7919) % 3000; //one to three segments
+}
+
+//a transfer over the lossy link has to deliver every message, in order and intact,
+//returns the mtu the sender ended with
+IUINT32 test_kcp_transfer(const char* name, void (*setup)(ikcpcb* kcp), int loss)
+{
+    const int messages = 2000;
+    FecBenchPeer peers[2];
+    for (int i = 0; i < 2; i++)
+    {
+        peers[i].index = i;
+        peers[i].kcp = ikcp_create(1, &peers[i]);
+        peers[i].encoder = NULL;
+        peers[i].decoder = NULL;
+        ikcp_setoutput(peers[i].kcp, fec_kcp_output);
+        ikcp_nodelay(peers[i].kcp, 1, 10, 2, 0);
+        ikcp_wndsize(peers[i].kcp, 128, 128);
+        setup(peers[i].kcp);
+    }
+
+    srand(1);
+    fec_link.clear();
+    fec_link_loss = loss;
+    fec_link_sent = 0;
+    std::vector<char> message(4096);
+    int sent = 0, received = 0;
+
+    for (fec_link_now = 0; received < messages && fec_link_now < 300 * 1000; fec_link_now++)
+    {
+        //a bounded backlog, the sender waits on the window like an application would
+        while (sent < messages && ikcp_waitsnd(peers[0].kcp) < 256)
+        {
+            int len = test_message_length(sent);
+            for (int j = 4; j < len; j++)
+            {
+                message[j] = (char)(sent + j);
+            }
+            memcpy(&message[0], &sent, 4);
+            assert(0 == ikcp_send(peers[0].kcp, &message[0], len));
+            sent++;
+        }
+        while (!fec_link.empty() && fec_link.begin()->first <= fec_link_now)
+        {
+            const std::string& datagram = fec_link.begin()->second.second;
+            ikcp_input(peers[fec_link.begin()->second.first].kcp, datagram.data(), 
+                datagram.size());
+            fec_link.erase(fec_link.begin());
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            ikcp_update(peers[i].kcp, fec_link_now);
+        }
+
+        int len = 0;
+        while ((len = ikcp_recv(peers[1].kcp, &message[0], (int)message.size())) > 0)
+        {
+            int index;
+            memcpy(&index, &message[0], 4);
+            assert(index == received);
+            assert(len == test_message_length(index));
+            for (int j = 4; j < len; j++)
+            {
+                assert(message[j] == (char)(index + j));
+            }
+            received++;
+        }
+    }
+
+    printf("%-6s loss %2d%%: %d/%d messages in %ums, %d datagrams\n", name, loss, 
+        received, messages, fec_link_now, fec_link_sent);
+    assert(received == messages);
+    IUINT32 mtu = peers[0].kcp->mtu;
+    for (int i = 0; i < 2; i++)
+    {
+        ikcp_release(peers[i].kcp);
+    }
+    return mtu;
+}
+
+void test_setup_reno(ikcpcb* kcp)
+{
+}
+
+void test_setup_bbr(ikcpcb* kcp)
+{
+    ikcp_setcc(kcp, &ikcp_cc_bbr);
+}
+
+void test_setup_sack(ikcpcb* kcp)
+{
+    ikcp_setsack(kcp, 1);
+}
+
+//sn indexed rings and the retransmit heap, with sack so acks land out of order
+void test_setup_ring(ikcpcb* kcp)
+{
+    assert(0 == ikcp_setring(kcp, 1));
+    ikcp_setsack(kcp, 1);
+}
+
+void test_setup_pmtu(ikcpcb* kcp)
+{
+    assert(0 == ikcp_setpmtu(kcp, 548, 1400));
+}
+
+//every send path against a clean and a 10% loss link, 20ms one way. path mtu
+//discovery has to hold 1400 through loss, and when the path starts dropping
+//datagrams over 1000 bytes the segments cut before still have to get through
+void test_kcp_loopback()
+{
+    const int losses[] = { 0, 10 };
+    for (size_t i = 0; i < sizeof(losses) / sizeof(losses[0]); i++)
+    {
+        test_kcp_transfer("reno", test_setup_reno, losses[i]);
+        test_kcp_transfer("bbr", test_setup_bbr, losses[i]);
+        test_kcp_transfer("sack", test_setup_sack, losses[i]);
+        test_kcp_transfer("ring", test_setup_ring, losses[i]);
+
+        fec_link_mtu = 0;
+        assert(1400 == test_kcp_transfer("pmtu", test_setup_pmtu, losses[i]));
+        fec_link_mtu = 1000;
+        fec_link_mtu_from = 2000;
+        IUINT32 mtu = test_kcp_transfer("hole", test_setup_pmtu, losses[i]);
+        assert(mtu >= 548 && mtu <= 1000);
+        fec_link_mtu = 0;
+    }
+}
+
+//lz4 pack and unpack cost per package and ratio, json like and random bodies
+void bench_compress()
+{
+    const char* words[] = { "{\"id\":", "\"name\":\"", "\",\"items\":[", "],\"ok\":true}", 
+        "1024", "\"player\"", ",", "3.25" };
+    const int sizes[] = { 64, 256, 1024, 8192 };
+    std::vector<char> packed(KCP_LZ_MAX_INPUT), unpacked(KCP_LZ_MAX_INPUT);
+    for (int random = 0; random < 2; random++)
+    {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            int len = sizes[s];
+            std::string package(len, 0);
+            for (int i = 4; i < len; )
+            {
+                const char* word = words[rand() % 8];
+                for (int j = 0; word[j] != '\0' && i < len; j++)
+                {
+                    package[i++] = random ? (char)rand() : word[j];
+                }
+            }
+            IUINT32 head = htonl(len);
+            memcpy(&package[0], &head, 4);
+
+            const int rounds = 1000;
+            int packed_len = -1;
+            double pack = 1e30, unpack = 1e30;
+            for (int block = 0; block < 20; block++)
+            {
+                double t0 = now_us();
+                for (int i = 0; i < rounds; i++)
+                {
+                    packed_len = KCPCompressor::Pack(package.data(), len, &packed[0], 
+                        len - len / 16);
+                }
+                double t1 = now_us();
+                for (int i = 0; packed_len > 0 && i < rounds; i++)
+                {
+                    KCPCompressor::Unpack(&packed[0], packed_len, &unpacked[0], 
+                        KCP_LZ_MAX_INPUT);
+                }
+                double t2 = now_us();
+                pack = std::min(pack, t1 - t0);
+                unpack = std::min(unpack, t2 - t1);
+            }
+            printf("%-6s %5d bytes: packed %5d, pack %7.1fns unpack %7.1fns\n", 
+                random ? "random" : "json", len, packed_len, pack * 1000 / rounds, 
+                packed_len > 0 ? unpack * 1000 / rounds : 0.0);
+        }
+    }
+}
+
+struct ShardBenchClient
+{
+    int fd;
+    ikcpcb* kcp;
+    int outstanding;
+    std::vector<char> pending;
+};
+
+static KCPServer* shard_bench_server;
+
+void shard_bench_echo(int conv, const char* data, int len)
+{
+    shard_bench_server->Send(conv, data, len);
+}
+
+int shard_bench_output(const char* buf, int len, ikcpcb* kcp, void* user)
+{
+    send(((ShardBenchClient*)user)->fd, buf, len, 0);
+    return 0;
+}
+
+//one client thread, 'sessions' convs from first_conv, each its own socket keeping
+//'depth' 64 byte packages in flight and counting the echoes
+void shard_bench_client(int port, int first_conv, int sessions, IUINT64 end, 
+    std::atomic<IUINT64>* echoed)
+{
+    const int depth = 16, size = 64;
+    std::vector<ShardBenchClient> clients(sessions);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for (int i = 0; i < sessions; i++)
+    {
+        ShardBenchClient& client = clients[i];
+        client.fd = socket(AF_INET, SOCK_DGRAM, 0);
+        connect(client.fd, (sockaddr*)&addr, sizeof(addr));
+        fcntl(client.fd, F_SETFL, O_NONBLOCK);
+        client.kcp = ikcp_create(first_conv + i, &client);
+        ikcp_setoutput(client.kcp, shard_bench_output);
+        ikcp_nodelay(client.kcp, 1, 10, 2, 1);
+        ikcp_wndsize(client.kcp, 128, 128);
+        client.outstanding = 0;
+    }
+
+    char package[size];
+    memset(package, 'x', size);
+    IUINT32 head = htonl(size);
+    memcpy(package, &head, 4);
+    std::vector<char> buffer(65536);
+    IUINT64 count = 0;
+    while (iclock() < end)
+    {
+        IUINT32 current = (IUINT32)iclock();
+        for (int i = 0; i < sessions; i++)
+        {
+            ShardBenchClient& client = clients[i];
+            for (; client.outstanding < depth; client.outstanding++)
+            {
+                ikcp_send(client.kcp, package, size);
+            }
+            int n = 0;
+            while ((n = recv(client.fd, &buffer[0], buffer.size(), 0)) > 0)
+            {
+                ikcp_input(client.kcp, &buffer[0], n);
+            }
+            ikcp_update(client.kcp, current);
+            while ((n = ikcp_recv(client.kcp, &buffer[0], buffer.size())) > 0)
+            {
+                client.pending.insert(client.pending.end(), &buffer[0], &buffer[0] + n);
+            }
+            size_t pos = 0;
+            for (; pos + size <= client.pending.size(); pos += size)
+            {
+                client.outstanding--;
+                count++;
+            }
+            client.pending.erase(client.pending.begin(), client.pending.begin() + pos);
+        }
+        usleep(100);
+    }
+
+    for (int i = 0; i < sessions; i++)
+    {
+        ikcp_release(clients[i].kcp);
+        close(clients[i].fd);
+    }
+    *echoed += count;
+}
+
+//echo throughput of the sharded mode on loopback, the same client threads
+//against 1, 2, 4 .. workers. wants a free core per worker and client thread
+void bench_sharded()
+{
+    const int client_threads = 4, sessions = 64, seconds = 3;
+    int cores = (int)std::thread::hardware_concurrency();
+    int max_workers = std::max(cores - client_threads, 1);
+    for (int workers = 1; workers <= max_workers; workers *= 2)
+    {
+        KCPOptions options;
+        options.recv_cb = shard_bench_echo;
+        options.error_reporter = on_error_report;
+        options.port = 9600 + workers;
+        options.worker_threads = workers;
+        KCPServer server(options);
+        shard_bench_server = &server;
+        if (!server.Start())
+        {
+            printf("server start error\n");
+            return;
+        }
+        std::thread loop(&KCPServer::Run, &server);
+
+        std::atomic<IUINT64> echoed(0);
+        std::vector<std::thread> clients;
+        IUINT64 start = iclock(), end = start + seconds * 1000;
+        for (int i = 0; i < client_threads; i++)
+        {
+            clients.push_back(std::thread(shard_bench_client, options.port, 
+                1 + i * sessions, sessions, end, &echoed));
+        }
+        for (int i = 0; i < client_threads; i++)
+        {
+            clients[i].join();
+        }
+        IUINT64 elapsed = std::max(iclock() - start, (IUINT64)1);
+        server.Stop();
+        loop.join();
+
+        KCPServerStats stats = server.GetStats();
+        printf("workers %2d: %8llu packages/s echoed, %8llu datagrams/s in, %8llu out, "
+            "%llu forwarded\n", workers, 
+            (unsigned long long)(echoed.load() * 1000 / elapsed),
+            (unsigned long long)(stats.recv_packets * 1000 / elapsed),
+            (unsigned long long)(stats.send_packets * 1000 / elapsed),
+            (unsigned long long)stats.recv_forwarded);
+    }
+}
+
+int main()
+{
+    //test_ring_buffer();
+    //bench_session_table();
+    //bench_ikcp_codec();
+    //bench_fec_codec();
+    //bench_fec_latency();
+    //bench_compress();
+    //test_kcp_loopback();
+    //bench_sharded();
+
+    
+    KCPOptions options;
+    options.recv_cb = on_kcp_revc;
+    options.kick_cb = on_session_kick;
+    options.error_reporter = on_error_report;
+    options.port = 9528;
+    KCPServer server;
+    server.SetOption(options);
+    if (!server.Start())
+    {
+        printf("server start error");
+        exit(0);
+    }
+
+    printf("kcp server start...\n");
+
+    server.Run();
+
+    return 0;
 }
\ No newline at end of file